@@ -2,9 +2,16 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
 
 #include "cl.hpp"
 
@@ -12,6 +19,81 @@
 
 #define STRINGIFY(...) #__VA_ARGS__
 
+// Encodes a 24 bit TGA image into `out`, which is reused between frames. The rows are written
+// from the last one to the first, the pixels are RGB (channels == 3) or RGBA (channels == 4).
+// With rle the image is run-length encoded (image type 10), packets never cross a row.
+void EncodeTGA(std::vector<unsigned char>& out, const unsigned char* data, unsigned int width, unsigned int height, unsigned int channels, bool rle)
+{
+	const unsigned char header[18] = {
+		0x00,							/* ID Length, 0 => No ID        */
+		0x00,							/* Color Map Type, 0 => No color map included   */
+		static_cast<unsigned char>(rle ? 0x0a : 0x02),	/* Image Type, 2 => Uncompressed, 10 => RLE, True-color Image */
+		0x00, 0x00, 0x00, 0x00, 0x00,	/* 2 bytes Index, 2 bytes length, 1 byte size of the color map */
+		0x00, 0x00,						/* X-origin of Image    */
+		0x00, 0x00,						/* Y-origin of Image    */
+		static_cast<unsigned char>(width & 0xff), static_cast<unsigned char>((width >> 8) & 0xff),		/* Image Width      */
+		static_cast<unsigned char>(height & 0xff), static_cast<unsigned char>((height >> 8) & 0xff),	/* Image Height     */
+		0x18,							/* Pixel Depth, 0x18 => 24 Bits */
+		0x20							/* Image Descriptor     */
+	};
+
+	// a packet only costs more than the raw pixels when it ends at the 128 pixel limit or the end of a row
+	const size_t rowBytes = static_cast<size_t>(width) * 3;
+	out.resize(sizeof(header) + height * (rowBytes + (rle ? width / 128 + 2 : 0)));
+	std::copy(header, header + sizeof(header), out.begin());
+	unsigned char* dst = &out[sizeof(header)];
+
+	for (int y = height - 1; y >= 0; y--) {
+		const unsigned char* row = data + static_cast<size_t>(y) * width * channels;
+
+		if (!rle) {
+			for (size_t x = 0; x < width; x++, dst += 3) {
+				const unsigned char* src = row + x * channels;
+				dst[0] = src[2]; /* blue */
+				dst[1] = src[1]; /* green */
+				dst[2] = src[0]; /* red */
+			}
+			continue;
+		}
+
+		size_t x = 0;
+		while (x < width) {
+			const unsigned char* src = row + x * channels;
+
+			// length of the run of identical pixels starting at x
+			size_t run = 1;
+			while (x + run < width && run < 128 && memcmp(src, row + (x + run) * channels, 3) == 0)
+				run++;
+
+			if (run > 1) {
+				*dst++ = static_cast<unsigned char>(0x80 | (run - 1));
+				*dst++ = src[2];
+				*dst++ = src[1];
+				*dst++ = src[0];
+				x += run;
+				continue;
+			}
+
+			// raw packet up to the next run of at least two identical pixels
+			size_t raw = 1;
+			while (x + raw < width && raw < 128
+				&& !(x + raw + 1 < width && memcmp(row + (x + raw) * channels, row + (x + raw + 1) * channels, 3) == 0))
+				raw++;
+
+			*dst++ = static_cast<unsigned char>(raw - 1);
+			for (size_t i = 0; i < raw; i++, dst += 3) {
+				const unsigned char* p = row + (x + i) * channels;
+				dst[0] = p[2];
+				dst[1] = p[1];
+				dst[2] = p[0];
+			}
+			x += raw;
+		}
+	}
+
+	out.resize(dst - &out[0]);
+}
+
 void WriteTGA_RGB(const char* filename, unsigned char* data, unsigned int width, unsigned int height)
 {
 	FILE *f = fopen(filename, "wb");
@@ -20,33 +102,11 @@ void WriteTGA_RGB(const char* filename, unsigned char* data, unsigned int width,
 		exit(EXIT_FAILURE);
 	}
 
-	fputc(0x00, f); /* ID Length, 0 => No ID        */
-	fputc(0x00, f); /* Color Map Type, 0 => No color map included   */
-	fputc(0x02, f); /* Image Type, 2 => Uncompressed, True-color Image */
-	fputc(0x00, f); /* Next five bytes are about the color map entries */
-	fputc(0x00, f); /* 2 bytes Index, 2 bytes length, 1 byte size */
-	fputc(0x00, f);
-	fputc(0x00, f);
-	fputc(0x00, f);
-	fputc(0x00, f); /* X-origin of Image    */
-	fputc(0x00, f);
-	fputc(0x00, f); /* Y-origin of Image    */
-	fputc(0x00, f);
-	fputc(width & 0xff, f); /* Image Width      */
-	fputc((width >> 8) & 0xff, f);
-	fputc(height & 0xff, f); /* Image Height     */
-	fputc((height >> 8) & 0xff, f);
-	fputc(0x18, f); /* Pixel Depth, 0x18 => 24 Bits */
-	fputc(0x20, f); /* Image Descriptor     */
+	std::vector<unsigned char> image;
+	EncodeTGA(image, data, width, height, 3, false);
 
-	for (int y = height - 1; y >= 0; y--) {
-		for (size_t x = 0; x < width; x++) {
-			const size_t i = (y * width + x) * 3;
-			fputc(data[i + 2], f); /* write blue */
-			fputc(data[i + 1], f); /* write green */
-			fputc(data[i], f); /* write red */
-		}
-	}
+	fwrite(&image[0], 1, image.size(), f);
+	fclose(f);
 }
 
 const char *getErrorString(cl_int error)
@@ -137,3 +197,789 @@ bool CheckCLError(cl_int err)
 	return true;
 }
 
+
+// reads an integer from the environment, falls back to defaultValue when the variable is unset or malformed
+int GetEnvironmentInt(const char* name, int defaultValue)
+{
+	const char* value = getenv(name);
+	if (value == nullptr || *value == '\0')
+		return defaultValue;
+
+	char* end = nullptr;
+	long result = strtol(value, &end, 10);
+	if (*end != '\0')
+		return defaultValue;
+
+	return static_cast<int>(result);
+}
+
+
+const char* GetEnvironmentString(const char* name, const char* defaultValue)
+{
+	const char* value = getenv(name);
+	return (value == nullptr || *value == '\0') ? defaultValue : value;
+}
+
+
+// Records the queued/submit/start/end timestamps of enqueued commands and
+// exports them as a Chrome/Perfetto trace (chrome://tracing, ui.perfetto.dev).
+// Profiling is switched on by setting OCL_PROFILE to the trace file name;
+// the command queue has to be created with QueueProperties().
+class Profiler
+{
+public:
+	struct Record
+	{
+		std::string name;
+		cl_command_type type;
+		cl_ulong queued;
+		cl_ulong submit;
+		cl_ulong start;
+		cl_ulong end;
+	};
+
+	struct Statistics
+	{
+		size_t count;
+		cl_ulong total;
+		cl_ulong min;
+		cl_ulong max;
+		cl_ulong latency;	// sum of queued -> start
+	};
+
+	Profiler() :
+		enabled(false),
+		maxRecords(static_cast<size_t>(GetEnvironmentInt("OCL_PROFILE_MAX_RECORDS", 200000))),
+		traceFile(GetEnvironmentString("OCL_PROFILE", ""))
+	{
+		enabled = !traceFile.empty();
+	}
+
+	~Profiler()
+	{
+		for (size_t i = 0; i < pending.size(); ++i)
+			clReleaseEvent(pending[i].event);
+	}
+
+	bool IsEnabled() const
+	{
+		return enabled;
+	}
+
+	cl_command_queue_properties QueueProperties() const
+	{
+		return enabled ? CL_QUEUE_PROFILING_ENABLE : 0;
+	}
+
+	// returns the event slot to pass to an enqueue call, or nullptr when profiling is off
+	cl_event* Track(cl_event* event) const
+	{
+		return enabled ? event : nullptr;
+	}
+
+	// takes over the reference of a C API event
+	void Add(const char* name, cl_event event)
+	{
+		if (event == nullptr)
+			return;
+
+		if (!enabled) {
+			clReleaseEvent(event);
+			return;
+		}
+
+		Pending p = { name, event };
+		pending.push_back(p);
+	}
+
+	// the C++ wrapper keeps its own reference, so we retain one for ourselves
+	void Add(const char* name, const cl::Event& event)
+	{
+		if (!enabled || event() == nullptr)
+			return;
+
+		clRetainEvent(event());
+		Add(name, event());
+	}
+
+	// moves the finished commands from the pending list to the records, cheap enough to call every frame
+	void Collect()
+	{
+		size_t kept = 0;
+		for (size_t i = 0; i < pending.size(); ++i)
+		{
+			cl_int status = CL_QUEUED;
+			clGetEventInfo(pending[i].event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, nullptr);
+
+			if (status > CL_COMPLETE) {
+				pending[kept++] = pending[i];
+				continue;
+			}
+
+			if (status == CL_COMPLETE)
+				Resolve(pending[i]);
+
+			clReleaseEvent(pending[i].event);
+		}
+		pending.resize(kept);
+	}
+
+	// waits for the outstanding commands, then writes the trace and prints the per-command statistics
+	void Finish(cl_command_queue queue)
+	{
+		if (!enabled)
+			return;
+
+		clFinish(queue);
+		Collect();
+		WriteTrace(traceFile.c_str());
+		PrintStatistics(std::cout);
+	}
+
+	void WriteTrace(const char* filename) const
+	{
+		FILE *f = fopen(filename, "w");
+		if (!f) {
+			fprintf(stderr, "Unable to create trace file `%s'\n", filename);
+			return;
+		}
+
+		cl_ulong base = 0;
+		for (size_t i = 0; i < records.size(); ++i)
+			if (i == 0 || records[i].queued < base)
+				base = records[i].queued;
+
+		fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"device execution\"}},\n");
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":1,\"args\":{\"name\":\"queued to start\"}}");
+
+		for (size_t i = 0; i < records.size(); ++i)
+		{
+			const Record& r = records[i];
+			const char* category = CategoryName(r.type);
+
+			// the device timestamps are in nanoseconds, the trace format expects microseconds
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,"
+				"\"args\":{\"queued_us\":%.3f,\"submit_us\":%.3f}}",
+				r.name.c_str(), category, (r.start - base) * 1e-3, (r.end - r.start) * 1e-3,
+				(r.queued - base) * 1e-3, (r.submit - base) * 1e-3);
+
+			if (r.start > r.queued)
+				fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"wait\",\"ph\":\"X\",\"pid\":0,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+					r.name.c_str(), (r.queued - base) * 1e-3, (r.start - r.queued) * 1e-3);
+		}
+
+		fprintf(f, "\n]}\n");
+		fclose(f);
+	}
+
+	void PrintStatistics(std::ostream& os) const
+	{
+		std::vector<std::pair<cl_ulong, std::string> > order;
+		cl_ulong sum = 0;
+		for (std::map<std::string, Statistics>::const_iterator it = statistics.begin(); it != statistics.end(); ++it) {
+			order.push_back(std::make_pair(it->second.total, it->first));
+			sum += it->second.total;
+		}
+		std::sort(order.rbegin(), order.rend());
+
+		char line[256];
+		snprintf(line, sizeof(line), "%-28s %8s %12s %10s %10s %10s %10s %6s",
+			"command", "count", "total [ms]", "avg [us]", "min [us]", "max [us]", "wait [us]", "%");
+		os << line << '\n';
+
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			const Statistics& s = statistics.find(order[i].second)->second;
+			snprintf(line, sizeof(line), "%-28s %8zu %12.3f %10.2f %10.2f %10.2f %10.2f %6.2f",
+				order[i].second.c_str(), s.count, s.total * 1e-6, s.total * 1e-3 / s.count,
+				s.min * 1e-3, s.max * 1e-3, s.latency * 1e-3 / s.count, sum > 0 ? 100.0 * s.total / sum : 0.0);
+			os << line << '\n';
+		}
+		os.flush();
+	}
+
+	const std::map<std::string, Statistics>& GetStatistics() const
+	{
+		return statistics;
+	}
+
+private:
+	struct Pending
+	{
+		std::string name;
+		cl_event event;
+	};
+
+	static const char* CategoryName(cl_command_type type)
+	{
+		switch (type) {
+		case CL_COMMAND_NDRANGE_KERNEL: return "kernel";
+		case CL_COMMAND_READ_BUFFER: return "read";
+		case CL_COMMAND_WRITE_BUFFER: return "write";
+		case CL_COMMAND_COPY_BUFFER: return "copy";
+		case CL_COMMAND_FILL_BUFFER: return "fill";
+		case CL_COMMAND_MAP_BUFFER: return "map";
+		case CL_COMMAND_UNMAP_MEM_OBJECT: return "unmap";
+		default: return "command";
+		}
+	}
+
+	void Resolve(const Pending& p)
+	{
+		Record r;
+		r.name = p.name;
+		r.type = 0;
+		clGetEventInfo(p.event, CL_EVENT_COMMAND_TYPE, sizeof(cl_command_type), &r.type, nullptr);
+
+		cl_int err = clGetEventProfilingInfo(p.event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &r.queued, nullptr);
+		err |= clGetEventProfilingInfo(p.event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &r.submit, nullptr);
+		err |= clGetEventProfilingInfo(p.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &r.start, nullptr);
+		err |= clGetEventProfilingInfo(p.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &r.end, nullptr);
+		if (err != CL_SUCCESS)
+			return;
+
+		const cl_ulong duration = r.end - r.start;
+		const cl_ulong latency = r.start > r.queued ? r.start - r.queued : 0;
+
+		std::map<std::string, Statistics>::iterator it = statistics.find(r.name);
+		if (it == statistics.end()) {
+			Statistics s = { 1, duration, duration, duration, latency };
+			statistics[r.name] = s;
+		} else {
+			Statistics& s = it->second;
+			s.count++;
+			s.total += duration;
+			s.min = std::min(s.min, duration);
+			s.max = std::max(s.max, duration);
+			s.latency += latency;
+		}
+
+		// the statistics keep counting after the trace buffer is full
+		if (records.size() < maxRecords)
+			records.push_back(r);
+	}
+
+	bool enabled;
+	size_t maxRecords;
+	std::string traceFile;
+	std::vector<Pending> pending;
+	std::vector<Record> records;
+	std::map<std::string, Statistics> statistics;
+};
+
+Profiler profiler;
+
+
+// Picks the local work size of a kernel by timing the candidates on the device at first run.
+// The winners are stored in a per-device tuning database (tuning_<device>_<driver>.txt in OCL_TUNING_DIR)
+// and reused on later runs of the same kernel name, program source and global size.
+// OCL_AUTOTUNE=0 leaves the choice to the driver, OCL_AUTOTUNE=2 retunes.
+// A local size of all zeros means that the driver's own choice was the fastest.
+class AutoTuner
+{
+public:
+	AutoTuner() :
+		mode(GetEnvironmentInt("OCL_AUTOTUNE", 1)),
+		directory(GetEnvironmentString("OCL_TUNING_DIR", "."))
+	{
+	}
+
+	// the kernel arguments have to be set already, the kernel is launched several times
+	bool Tune(cl_command_queue queue, cl_kernel kernel, const char* name, cl_uint dims, const size_t* global, size_t* local)
+	{
+		for (cl_uint d = 0; d < 3; ++d)
+			local[d] = 0;
+
+		if (mode == 0)
+			return true;
+
+		cl_device_id device = nullptr;
+		cl_int err = clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, nullptr);
+		if (!CheckCLError(err))
+			return false;
+
+		Database& db = Load(device);
+		const std::string key = Key(kernel, name, dims, global);
+		std::map<std::string, Entry>::const_iterator it = db.entries.find(key);
+		if (mode != 2 && it != db.entries.end() && it->second.dims == dims) {
+			for (cl_uint d = 0; d < dims; ++d)
+				local[d] = it->second.local[d];
+			return true;
+		}
+
+		std::vector<Entry> candidates;
+		if (!Candidates(device, kernel, dims, candidates))
+			return false;
+
+		Entry best;
+		best.seconds = -1.0;
+		for (size_t i = 0; i < candidates.size(); ++i)
+		{
+			double seconds = Measure(queue, kernel, dims, global, candidates[i].local);
+			if (seconds >= 0.0 && (best.seconds < 0.0 || seconds < best.seconds)) {
+				best = candidates[i];
+				best.seconds = seconds;
+			}
+		}
+
+		if (best.seconds < 0.0) {
+			std::cerr << "Autotuning of " << name << " failed, using the default local size\n";
+			return true;
+		}
+
+		best.dims = dims;
+		for (cl_uint d = 0; d < dims; ++d)
+			local[d] = best.local[d];
+
+		db.entries[key] = best;
+		Save(db);
+
+		std::cout << "Autotuned " << name << ": local size " << local[0];
+		for (cl_uint d = 1; d < dims; ++d)
+			std::cout << 'x' << local[d];
+		std::cout << (local[0] == 0 ? " (driver)" : "") << ", " << best.seconds * 1e6 << " us" << std::endl;
+
+		return true;
+	}
+
+	// rounds the global size up to a multiple of the local size, the kernels have to check their bounds
+	static void RoundGlobalSize(cl_uint dims, const size_t* global, const size_t* local, size_t* rounded)
+	{
+		for (cl_uint d = 0; d < dims; ++d)
+			rounded[d] = local[d] == 0 ? global[d] : (global[d] + local[d] - 1) / local[d] * local[d];
+	}
+
+	static const size_t* LocalSizeOrNull(const size_t* local)
+	{
+		return local[0] == 0 ? nullptr : local;
+	}
+
+	static cl::NDRange LocalRange(cl_uint dims, const size_t* local)
+	{
+		if (local[0] == 0)
+			return cl::NullRange;
+
+		return dims == 1 ? cl::NDRange(local[0]) : dims == 2 ? cl::NDRange(local[0], local[1]) : cl::NDRange(local[0], local[1], local[2]);
+	}
+
+	static cl::NDRange GlobalRange(cl_uint dims, const size_t* global, const size_t* local)
+	{
+		size_t rounded[3] = { 1, 1, 1 };
+		RoundGlobalSize(dims, global, local, rounded);
+
+		return dims == 1 ? cl::NDRange(rounded[0]) : dims == 2 ? cl::NDRange(rounded[0], rounded[1]) : cl::NDRange(rounded[0], rounded[1], rounded[2]);
+	}
+
+private:
+	struct Entry
+	{
+		cl_uint dims;
+		size_t local[3];
+		double seconds;
+
+		Entry() : dims(0), seconds(0.0)
+		{
+			local[0] = local[1] = local[2] = 0;
+		}
+	};
+
+	struct Database
+	{
+		std::string path;
+		std::map<std::string, Entry> entries;
+	};
+
+	// name@global#source: a changed kernel or a new global size is tuned again
+	static std::string Key(cl_kernel kernel, const char* name, cl_uint dims, const size_t* global)
+	{
+		std::string source;
+		cl_program program = nullptr;
+		size_t length = 0;
+		if (clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &program, nullptr) == CL_SUCCESS
+			&& clGetProgramInfo(program, CL_PROGRAM_SOURCE, 0, nullptr, &length) == CL_SUCCESS && length > 0) {
+			source.resize(length);
+			if (clGetProgramInfo(program, CL_PROGRAM_SOURCE, length, &source[0], nullptr) != CL_SUCCESS)
+				source.clear();
+		}
+
+		// FNV-1a
+		unsigned long long hash = 14695981039346656037ull;
+		for (size_t i = 0; i < source.size(); ++i)
+			hash = (hash ^ static_cast<unsigned char>(source[i])) * 1099511628211ull;
+
+		std::ostringstream key;
+		key << name << '@' << global[0];
+		for (cl_uint d = 1; d < dims; ++d)
+			key << 'x' << global[d];
+		key << '#' << std::hex << hash;
+
+		return key.str();
+	}
+
+	Database& Load(cl_device_id device)
+	{
+		std::map<cl_device_id, Database>::iterator found = databases.find(device);
+		if (found != databases.end())
+			return found->second;
+
+		char deviceName[256] = { 0 };
+		char driverVersion[256] = { 0 };
+		clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, nullptr);
+		clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, driverVersion, nullptr);
+
+		// the driver version is part of the name, a driver update invalidates the old results
+		std::string id = std::string(deviceName) + "_" + driverVersion;
+		for (size_t i = 0; i < id.size(); ++i)
+			if (!isalnum(static_cast<unsigned char>(id[i])) && id[i] != '.')
+				id[i] = '_';
+
+		Database& db = databases[device];
+		db.path = directory + "/tuning_" + id + ".txt";
+
+		std::ifstream in(db.path.c_str());
+		std::string line;
+		while (std::getline(in, line))
+		{
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			std::istringstream ss(line);
+			std::string name;
+			Entry e;
+			if (ss >> name >> e.dims >> e.local[0] >> e.local[1] >> e.local[2] >> e.seconds && e.dims >= 1 && e.dims <= 3)
+				db.entries[name] = e;
+		}
+
+		return db;
+	}
+
+	void Save(const Database& db) const
+	{
+		std::ofstream out(db.path.c_str());
+		if (!out) {
+			std::cerr << "Unable to write tuning database `" << db.path << "'\n";
+			return;
+		}
+
+		out << "# kernel@global#source dims local0 local1 local2 seconds\n";
+		for (std::map<std::string, Entry>::const_iterator it = db.entries.begin(); it != db.entries.end(); ++it) {
+			const Entry& e = it->second;
+			out << it->first << ' ' << e.dims << ' ' << e.local[0] << ' ' << e.local[1] << ' ' << e.local[2] << ' ' << e.seconds << '\n';
+		}
+	}
+
+	// powers of two between the preferred multiple and the kernel's work-group limit, plus the driver's choice
+	static bool Candidates(cl_device_id device, cl_kernel kernel, cl_uint dims, std::vector<Entry>& candidates)
+	{
+		size_t maxGroup = 0;
+		size_t multiple = 1;
+		size_t maxItems[3] = { 1, 1, 1 };
+
+		cl_int err = clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, nullptr);
+		err |= clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, nullptr);
+		err |= clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItems), maxItems, nullptr);
+		if (!CheckCLError(err))
+			return false;
+
+		candidates.push_back(Entry());
+
+		size_t minGroup = 1;
+		while (minGroup < multiple && minGroup * 2 <= maxGroup)
+			minGroup *= 2;
+
+		for (size_t x = 1; x <= maxGroup && x <= maxItems[0]; x *= 2)
+			for (size_t y = 1; x * y <= maxGroup && (dims >= 2 || y == 1) && y <= maxItems[1]; y *= 2)
+			{
+				if (x * y < minGroup)
+					continue;
+
+				Entry e;
+				e.local[0] = x;
+				e.local[1] = dims >= 2 ? y : 0;
+				e.local[2] = dims == 3 ? 1 : 0;
+				candidates.push_back(e);
+			}
+
+		return true;
+	}
+
+	static double Measure(cl_command_queue queue, cl_kernel kernel, cl_uint dims, const size_t* global, const size_t* local)
+	{
+		const int repetitions = 5;
+
+		size_t rounded[3] = { 1, 1, 1 };
+		RoundGlobalSize(dims, global, local, rounded);
+
+		// the first launch pays for the lazy allocations and is not measured
+		cl_int err = clEnqueueNDRangeKernel(queue, kernel, dims, nullptr, rounded, LocalSizeOrNull(local), 0, nullptr, nullptr);
+		if (err != CL_SUCCESS || clFinish(queue) != CL_SUCCESS)
+			return -1.0;
+
+		std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < repetitions && err == CL_SUCCESS; ++i)
+			err = clEnqueueNDRangeKernel(queue, kernel, dims, nullptr, rounded, LocalSizeOrNull(local), 0, nullptr, nullptr);
+		if (err != CL_SUCCESS || clFinish(queue) != CL_SUCCESS)
+			return -1.0;
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+		return std::chrono::duration<double>(end - begin).count() / repetitions;
+	}
+
+	int mode;
+	std::string directory;
+	std::map<cl_device_id, Database> databases;
+};
+
+AutoTuner autoTuner;
+
+
+const size_t HOST_PAGE_SIZE = 4096;
+
+
+void* AlignedAlloc(size_t alignment, size_t bytes)
+{
+#ifdef _WIN32
+	return _aligned_malloc(bytes, alignment);
+#else
+	void* p = nullptr;
+	return posix_memalign(&p, alignment, bytes) == 0 ? p : nullptr;
+#endif
+}
+
+
+void AlignedFree(void* p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+
+// Devices sharing their memory with the host (CPUs, integrated GPUs) can hand out their buffers with
+// a map instead of a copy. OCL_ZERO_COPY=0/1 overrides the CL_DEVICE_HOST_UNIFIED_MEMORY query.
+bool UseZeroCopy(cl_device_id device)
+{
+	int mode = GetEnvironmentInt("OCL_ZERO_COPY", -1);
+	if (mode >= 0)
+		return mode != 0;
+
+	cl_bool unified = CL_FALSE;
+	if (clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified, nullptr) != CL_SUCCESS)
+		return false;
+
+	return unified == CL_TRUE;
+}
+
+
+// Rotating host/device frame buffers, so the device computes frame k+1 while the host presents frame k.
+// Readbacks are non-blocking and run on a separate transfer queue, chained to the producing command
+// through its event. The ring size (frames in flight) is read from OCL_FRAMES_IN_FLIGHT.
+// On zero-copy devices the frames are CL_MEM_ALLOC_HOST_PTR buffers and the readback is a map,
+// otherwise they are copied into page-aligned host memory.
+class FrameRing
+{
+public:
+	FrameRing() :
+		transfer(nullptr),
+		frameBytes(0),
+		zeroCopy(false),
+		next(0),
+		inFlight(0)
+	{
+	}
+
+	~FrameRing()
+	{
+		Release();
+	}
+
+	static int DefaultSize()
+	{
+		return std::max(1, std::min(8, GetEnvironmentInt("OCL_FRAMES_IN_FLIGHT", 2)));
+	}
+
+	bool Allocate(cl_context context, cl_device_id device, size_t bytes, int count)
+	{
+		Release();
+
+		cl_int err = CL_SUCCESS;
+		transfer = clCreateCommandQueue(context, device, profiler.QueueProperties(), &err);
+		if (transfer == nullptr || !CheckCLError(err))
+			return false;
+
+		frameBytes = bytes;
+		zeroCopy = UseZeroCopy(device);
+		slots.resize(count);
+		for (int i = 0; i < count; ++i)
+		{
+			slots[i].device = clCreateBuffer(context, CL_MEM_READ_WRITE | (zeroCopy ? CL_MEM_ALLOC_HOST_PTR : 0), bytes, nullptr, &err);
+			if (slots[i].device == nullptr || !CheckCLError(err))
+				return false;
+
+			if (zeroCopy)
+				continue;
+
+			slots[i].host = AlignedAlloc(HOST_PAGE_SIZE, bytes);
+			if (slots[i].host == nullptr) {
+				std::cerr << "Unable to allocate " << bytes << " bytes of host memory\n";
+
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	void Release()
+	{
+		Drain();
+
+		for (size_t i = 0; i < slots.size(); ++i)
+		{
+			if (slots[i].device != nullptr)
+				clReleaseMemObject(slots[i].device);
+			AlignedFree(slots[i].host);
+		}
+		slots.clear();
+
+		if (transfer != nullptr)
+			clReleaseCommandQueue(transfer);
+		transfer = nullptr;
+		next = 0;
+	}
+
+	size_t FrameBytes() const
+	{
+		return frameBytes;
+	}
+
+	bool IsZeroCopy() const
+	{
+		return zeroCopy;
+	}
+
+	// frees the slot of the next frame, has to be called before anything is enqueued that writes Current()
+	bool Acquire(cl_command_queue queue)
+	{
+		// the caller skipped a presentation, the oldest frame is dropped
+		if (inFlight == slots.size())
+			Retire();
+
+		return Unmap(queue, slots[next]);
+	}
+
+	// device buffer of the frame being produced
+	cl_mem Current() const
+	{
+		return slots[next].device;
+	}
+
+	// device buffer of the previously produced frame
+	cl_mem Previous() const
+	{
+		return slots[(next + slots.size() - 1) % slots.size()].device;
+	}
+
+	// starts the readback of the current frame once `rendered' has completed and moves to the next slot;
+	// the frame is read into `destination' if it is given (e.g. a mapped pixel buffer), unless the slot is mapped
+	bool Submit(cl_command_queue queue, cl_event rendered, void* destination = nullptr)
+	{
+		Slot& slot = slots[next];
+		slot.target = destination != nullptr ? destination : slot.host;
+		const cl_uint waitCount = rendered != nullptr ? 1 : 0;
+		const cl_event* waitList = rendered != nullptr ? &rendered : nullptr;
+
+		cl_int err = CL_SUCCESS;
+		if (zeroCopy)
+			slot.mapped = clEnqueueMapBuffer(transfer, slot.device, CL_FALSE, CL_MAP_READ, 0, frameBytes, waitCount, waitList, &slot.ready, &err);
+		else
+			err = clEnqueueReadBuffer(transfer, slot.device, CL_FALSE, 0, frameBytes, slot.target, waitCount, waitList, &slot.ready);
+		if (!CheckCLError(err))
+			return false;
+
+		if (profiler.IsEnabled()) {
+			clRetainEvent(slot.ready);
+			profiler.Add(zeroCopy ? "MapFrame" : "ReadFrame", slot.ready);
+		}
+
+		// both queues are flushed, so the device works while the host presents
+		clFlush(queue);
+		clFlush(transfer);
+
+		next = (next + 1) % slots.size();
+		inFlight++;
+
+		return true;
+	}
+
+	// returns the oldest frame once every slot is in flight, nullptr while the pipeline is still filling up;
+	// the memory stays valid until the slot is acquired again
+	const void* Present()
+	{
+		if (inFlight < slots.size() || inFlight == 0)
+			return nullptr;
+
+		return Retire();
+	}
+
+	// waits for every frame in flight and hands the buffers back to the device
+	void Drain()
+	{
+		while (inFlight > 0)
+			Retire();
+
+		if (transfer == nullptr)
+			return;
+
+		for (size_t i = 0; i < slots.size(); ++i)
+			Unmap(transfer, slots[i]);
+		clFinish(transfer);
+	}
+
+private:
+	struct Slot
+	{
+		cl_mem device;
+		void* host;
+		void* target;
+		void* mapped;
+		cl_event ready;
+
+		Slot() : device(nullptr), host(nullptr), target(nullptr), mapped(nullptr), ready(nullptr) {}
+	};
+
+	const void* Retire()
+	{
+		Slot& slot = slots[(next + slots.size() - inFlight) % slots.size()];
+		inFlight--;
+
+		clWaitForEvents(1, &slot.ready);
+		clReleaseEvent(slot.ready);
+		slot.ready = nullptr;
+
+		return zeroCopy ? slot.mapped : slot.target;
+	}
+
+	static bool Unmap(cl_command_queue queue, Slot& slot)
+	{
+		if (slot.mapped == nullptr)
+			return true;
+
+		cl_event event = nullptr;
+		cl_int err = clEnqueueUnmapMemObject(queue, slot.device, slot.mapped, 0, nullptr, profiler.Track(&event));
+		slot.mapped = nullptr;
+		profiler.Add("UnmapFrame", event);
+
+		return CheckCLError(err);
+	}
+
+	cl_command_queue transfer;
+	std::vector<Slot> slots;
+	size_t frameBytes;
+	bool zeroCopy;
+	size_t next;
+	size_t inFlight;
+};
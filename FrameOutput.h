@@ -0,0 +1,544 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <csignal>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Common.h"
+#include "Runtime.h"
+
+// Frame dumps written by a background thread, so the simulation does not wait on the disk.
+// The queue is bounded: when it is full Submit() blocks until the writer catches up, or drops
+// the frame if dropWhenFull is set. The pixel buffers are recycled between frames.
+//
+// OCL_DUMP_FRAMES  - file name prefix of the dumped frames, <prefix>_000000.tga, ...; unset disables the dump
+// OCL_DUMP_RLE     - 1 writes run-length encoded TGA images
+// OCL_DUMP_QUEUE   - number of frames waiting for the disk (default: 8)
+// OCL_DUMP_DROP    - 1 drops frames instead of waiting when the queue is full
+class ImageWriter
+{
+public:
+	ImageWriter() :
+		prefix(GetEnvironmentString("OCL_DUMP_FRAMES", "")),
+		rle(GetEnvironmentInt("OCL_DUMP_RLE", 0) != 0),
+		dropWhenFull(GetEnvironmentInt("OCL_DUMP_DROP", 0) != 0),
+		capacity(static_cast<size_t>(std::max(1, GetEnvironmentInt("OCL_DUMP_QUEUE", 8)))),
+		frameIndex(0),
+		dropped(0),
+		stopping(false)
+	{
+	}
+
+	~ImageWriter()
+	{
+		Stop();
+	}
+
+	bool IsEnabled() const
+	{
+		return !prefix.empty();
+	}
+
+	// returns a buffer for a frame of `bytes` to be filled by the caller and passed to Submit(),
+	// nullptr if the frame has to be dropped
+	std::vector<unsigned char>* Acquire(size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (jobs.size() >= capacity) {
+			if (dropWhenFull) {
+				dropped++;
+				frameIndex++;
+				return nullptr;
+			}
+			changed.wait(lock, [this] { return jobs.size() < capacity; });
+		}
+
+		std::vector<unsigned char>* buffer = nullptr;
+		if (pool.empty()) {
+			buffer = new std::vector<unsigned char>();
+		} else {
+			buffer = pool.back();
+			pool.pop_back();
+		}
+		buffer->resize(bytes);
+
+		return buffer;
+	}
+
+	// hands the frame over to the writer thread, the frames are numbered in submission order
+	void Submit(std::vector<unsigned char>* pixels, unsigned int width, unsigned int height, unsigned int channels)
+	{
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "_%06zu.tga", frameIndex++);
+
+		Job job = { prefix + suffix, pixels, width, height, channels };
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(job);
+		}
+		changed.notify_all();
+
+		if (!worker.joinable())
+			worker = std::thread(&ImageWriter::Run, this);
+	}
+
+	// copies the pixels into a recycled buffer and queues them
+	void Write(const unsigned char* pixels, unsigned int width, unsigned int height, unsigned int channels)
+	{
+		const size_t bytes = static_cast<size_t>(width) * height * channels;
+		std::vector<unsigned char>* buffer = Acquire(bytes);
+		if (buffer == nullptr)
+			return;
+
+		memcpy(&(*buffer)[0], pixels, bytes);
+		Submit(buffer, width, height, channels);
+	}
+
+	// writes the queued frames and stops the thread
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+
+		if (worker.joinable())
+			worker.join();
+
+		for (size_t i = 0; i < pool.size(); ++i)
+			delete pool[i];
+		pool.clear();
+
+		if (dropped > 0)
+			std::cerr << dropped << " frames were dropped by the frame writer\n";
+		dropped = 0;
+	}
+
+private:
+	struct Job
+	{
+		std::string filename;
+		std::vector<unsigned char>* pixels;
+		unsigned int width;
+		unsigned int height;
+		unsigned int channels;
+	};
+
+	void Run()
+	{
+		std::vector<unsigned char> encoded;
+
+		for (;;)
+		{
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty())
+					return;
+
+				job = jobs.front();
+			}
+
+			EncodeTGA(encoded, &(*job.pixels)[0], job.width, job.height, job.channels, rle);
+
+			FILE *f = fopen(job.filename.c_str(), "wb");
+			if (!f) {
+				fprintf(stderr, "Unable to create output TGA image `%s'\n", job.filename.c_str());
+			} else {
+				fwrite(&encoded[0], 1, encoded.size(), f);
+				fclose(f);
+			}
+
+			// the job leaves the queue only after it is written, so the queue bounds the frames in memory
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				jobs.pop_front();
+				pool.push_back(job.pixels);
+			}
+			changed.notify_all();
+		}
+	}
+
+	std::string prefix;
+	bool rle;
+	bool dropWhenFull;
+	size_t capacity;
+	size_t frameIndex;
+	size_t dropped;
+	bool stopping;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<Job> jobs;
+	std::vector<std::vector<unsigned char>*> pool;
+	std::thread worker;
+};
+
+
+// Shared part of the stream conversion kernels, the program prepends the definition of
+// float3 FramePixel (__global const FRAME_TYPE* frame, int index) returning RGB in [0, 1]
+// and FRAME_TYPE is passed as a build option.
+const char* STREAM_KERNEL_SOURCE = STRINGIFY(
+	uchar ToByte(float value)
+	{
+		return convert_uchar_sat_rte(value * 255.0f);
+	}
+
+	// full range BT.601 (the C420jpeg colour space of Y4M), one work-item per 2x2 block,
+	// the frames are stored bottom-up and the video is top-down
+	__kernel
+	void ConvertYUV420(__global const FRAME_TYPE* frame, const int width, const int height, __global uchar* yuv)
+	{
+		int2 block = (int2) (get_global_id(0), get_global_id(1));
+		int chromaWidth = (width + 1) / 2;
+		int chromaHeight = (height + 1) / 2;
+		if (block.x >= chromaWidth || block.y >= chromaHeight)
+			return;
+
+		float3 sum = (float3) (0.0f);
+		for (int dy = 0; dy < 2; ++dy)
+		for (int dx = 0; dx < 2; ++dx)
+		{
+			int x = min(block.x * 2 + dx, width - 1);
+			int y = min(block.y * 2 + dy, height - 1);
+			float3 rgb = FramePixel(frame, (height - 1 - y) * width + x);
+			sum += rgb;
+
+			if (block.x * 2 + dx < width && block.y * 2 + dy < height)
+				yuv[y * width + x] = ToByte(dot(rgb, (float3) (0.299f, 0.587f, 0.114f)));
+		}
+
+		float3 rgb = sum * 0.25f;
+		int chroma = block.y * chromaWidth + block.x;
+		yuv[width * height + chroma] = ToByte(dot(rgb, (float3) (-0.168736f, -0.331264f, 0.5f)) + 0.5f);
+		yuv[width * height + chromaWidth * chromaHeight + chroma] = ToByte(dot(rgb, (float3) (0.5f, -0.418688f, -0.081312f)) + 0.5f);
+	}
+
+	__kernel
+	void ConvertRGB24(__global const FRAME_TYPE* frame, const int width, const int height, __global uchar* rgb)
+	{
+		int2 id = (int2) (get_global_id(0), get_global_id(1));
+		if (id.x >= width || id.y >= height)
+			return;
+
+		float3 pixel = FramePixel(frame, (height - 1 - id.y) * width + id.x);
+		vstore3(convert_uchar3_sat_rte(pixel * 255.0f), id.y * width + id.x, rgb);
+	}
+);
+
+
+// Streams the frames as Y4M (YUV 4:2:0) or raw RGB24 video into a file or into stdout for a pipe,
+// e.g. OCL_STREAM=- ./nbody | ffmpeg -i - out.mp4. The colour conversion runs on the device, only the
+// converted frame is read back, and a writer thread feeds the output. The queue between them is
+// bounded: a slow consumer blocks the producer, or frames are dropped with OCL_STREAM_DROP=1.
+//
+// OCL_STREAM         - output file, "-" is stdout (the log messages go to stderr then); unset disables the stream
+// OCL_STREAM_FORMAT  - "y4m" (default) or "rgb" (ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -i -)
+// OCL_STREAM_EVERY   - only every Nth frame is streamed (default: 1)
+// OCL_STREAM_FPS     - frame rate written into the Y4M header (default: 60)
+// OCL_STREAM_QUEUE   - number of frames waiting for the consumer (default: 4)
+// OCL_STREAM_DROP    - 1 drops frames instead of waiting when the queue is full
+class VideoStream
+{
+public:
+	VideoStream() :
+		path(GetEnvironmentString("OCL_STREAM", "")),
+		y4m(std::string(GetEnvironmentString("OCL_STREAM_FORMAT", "y4m")) != "rgb"),
+		every(std::max(1, GetEnvironmentInt("OCL_STREAM_EVERY", 1))),
+		fps(std::max(1, GetEnvironmentInt("OCL_STREAM_FPS", 60))),
+		capacity(static_cast<size_t>(std::max(1, GetEnvironmentInt("OCL_STREAM_QUEUE", 4)))),
+		dropWhenFull(GetEnvironmentInt("OCL_STREAM_DROP", 0) != 0),
+		file(nullptr),
+		program(nullptr),
+		kernel(nullptr),
+		context(nullptr),
+		frameCounter(0),
+		streamWidth(0),
+		streamHeight(0),
+		dropped(0),
+		stopping(false),
+		broken(false)
+	{
+		if (path.empty())
+			return;
+
+		if (path == "-") {
+			// the video takes over stdout, everything printed from now on goes to stderr
+			fflush(stdout);
+#ifdef _WIN32
+			int fd = _dup(_fileno(stdout));
+			_dup2(_fileno(stderr), _fileno(stdout));
+			_setmode(fd, _O_BINARY);
+			file = _fdopen(fd, "wb");
+#else
+			int fd = dup(STDOUT_FILENO);
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+			file = fdopen(fd, "wb");
+#endif
+		} else {
+			file = fopen(path.c_str(), "wb");
+		}
+
+		if (file == nullptr) {
+			fprintf(stderr, "Unable to open the video stream `%s'\n", path.c_str());
+			path.clear();
+			return;
+		}
+
+#ifndef _WIN32
+		// a consumer closing the pipe is reported by fwrite instead of killing the process
+		signal(SIGPIPE, SIG_IGN);
+#endif
+	}
+
+	~VideoStream()
+	{
+		Stop();
+	}
+
+	bool IsEnabled() const
+	{
+		return !path.empty() && !broken;
+	}
+
+	// builds the conversion kernel, pixelSource defines FramePixel for frames of frameType
+	bool Init(const Runtime& runtime, const char* pixelSource, const char* frameType)
+	{
+		if (!IsEnabled())
+			return true;
+
+		const std::string source = std::string(pixelSource) + STREAM_KERNEL_SOURCE;
+		const std::string options = std::string("-DFRAME_TYPE=") + frameType;
+		program = BuildProgram(runtime, source.c_str(), options.c_str());
+		if (program == nullptr)
+			return false;
+
+		cl_int err = CL_SUCCESS;
+		kernel = clCreateKernel(program, y4m ? "ConvertYUV420" : "ConvertRGB24", &err);
+		if (!CheckCLError(err))
+			return false;
+
+		context = runtime.context();
+
+		return true;
+	}
+
+	// enqueues the conversion and the readback of a frame produced earlier on the same queue,
+	// the writer thread waits for the readback
+	bool Encode(cl_command_queue queue, cl_mem frame, int width, int height)
+	{
+		if (!IsEnabled() || kernel == nullptr || frameCounter++ % every != 0)
+			return true;
+
+		// the size of the video is fixed by the first frame
+		if (streamWidth == 0) {
+			streamWidth = width;
+			streamHeight = height;
+		} else if (width != streamWidth || height != streamHeight) {
+			dropped++;
+			return true;
+		}
+
+		const int chromaWidth = (width + 1) / 2;
+		const int chromaHeight = (height + 1) / 2;
+		const size_t bytes = y4m ? static_cast<size_t>(width) * height + 2 * static_cast<size_t>(chromaWidth) * chromaHeight
+			: static_cast<size_t>(width) * height * 3;
+
+		Slot* slot = Acquire(bytes);
+		if (slot == nullptr)
+			return true;
+
+		cl_int err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &frame);
+		err |= clSetKernelArg(kernel, 1, sizeof(int), &width);
+		err |= clSetKernelArg(kernel, 2, sizeof(int), &height);
+		err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &slot->device);
+		if (!CheckCLError(err))
+			return false;
+
+		const size_t global[2] = { static_cast<size_t>(y4m ? chromaWidth : width), static_cast<size_t>(y4m ? chromaHeight : height) };
+		cl_event converted = nullptr;
+		err = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, global, nullptr, 0, nullptr, profiler.Track(&converted));
+		if (!CheckCLError(err))
+			return false;
+		profiler.Add(y4m ? "ConvertYUV420" : "ConvertRGB24", converted);
+
+		err = clEnqueueReadBuffer(queue, slot->device, CL_FALSE, 0, bytes, &slot->host[0], 0, nullptr, &slot->ready);
+		if (!CheckCLError(err))
+			return false;
+
+		if (profiler.IsEnabled()) {
+			clRetainEvent(slot->ready);
+			profiler.Add("ReadStream", slot->ready);
+		}
+		clFlush(queue);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(slot);
+		}
+		changed.notify_all();
+
+		if (!worker.joinable())
+			worker = std::thread(&VideoStream::Run, this);
+
+		return true;
+	}
+
+	// writes the queued frames, stops the thread and closes the output
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+
+		if (worker.joinable())
+			worker.join();
+
+		for (size_t i = 0; i < pool.size(); ++i) {
+			clReleaseMemObject(pool[i]->device);
+			delete pool[i];
+		}
+		pool.clear();
+
+		if (kernel != nullptr)
+			clReleaseKernel(kernel);
+		if (program != nullptr)
+			clReleaseProgram(program);
+		kernel = nullptr;
+		program = nullptr;
+
+		if (file != nullptr)
+			fclose(file);
+		file = nullptr;
+
+		if (dropped > 0)
+			std::cerr << dropped << " frames were dropped by the video stream\n";
+		dropped = 0;
+	}
+
+private:
+	struct Slot
+	{
+		cl_mem device;
+		std::vector<unsigned char> host;
+		cl_event ready;
+	};
+
+	Slot* Acquire(size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (jobs.size() >= capacity) {
+			if (dropWhenFull) {
+				dropped++;
+				return nullptr;
+			}
+			changed.wait(lock, [this] { return jobs.size() < capacity || broken; });
+			if (broken)
+				return nullptr;
+		}
+
+		if (!pool.empty()) {
+			Slot* slot = pool.back();
+			pool.pop_back();
+			return slot;
+		}
+
+		lock.unlock();
+
+		// every frame of the stream has the same size, so a slot is never resized
+		Slot* slot = new Slot();
+		slot->host.resize(bytes);
+		slot->ready = nullptr;
+
+		cl_int err = CL_SUCCESS;
+		slot->device = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, nullptr, &err);
+		if (slot->device == nullptr || !CheckCLError(err)) {
+			delete slot;
+			return nullptr;
+		}
+
+		return slot;
+	}
+
+	void Run()
+	{
+		if (y4m)
+			fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", streamWidth, streamHeight, fps);
+
+		for (;;)
+		{
+			Slot* slot = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty())
+					break;
+
+				slot = jobs.front();
+			}
+
+			clWaitForEvents(1, &slot->ready);
+			clReleaseEvent(slot->ready);
+			slot->ready = nullptr;
+
+			if (!broken) {
+				bool written = !y4m || fputs("FRAME\n", file) >= 0;
+				written = written && fwrite(&slot->host[0], 1, slot->host.size(), file) == slot->host.size();
+				if (!written) {
+					fprintf(stderr, "The video stream `%s' was closed, streaming stopped\n", path.c_str());
+					broken = true;
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				jobs.pop_front();
+				pool.push_back(slot);
+			}
+			changed.notify_all();
+		}
+
+		fflush(file);
+	}
+
+	std::string path;
+	bool y4m;
+	int every;
+	int fps;
+	size_t capacity;
+	bool dropWhenFull;
+	FILE* file;
+
+	cl_program program;
+	cl_kernel kernel;
+	cl_context context;
+
+	size_t frameCounter;
+	int streamWidth;
+	int streamHeight;
+	size_t dropped;
+	bool stopping;
+	std::atomic<bool> broken;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<Slot*> jobs;
+	std::vector<Slot*> pool;
+	std::thread worker;
+};
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <GL/freeglut.h>
+
+#include "Common.h"
+
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_TIMEOUT_EXPIRED 0x911B
+#endif
+
+// Draws the frames as a texture on a fullscreen quad. The frames are streamed into the texture
+// through a ring of pixel buffer objects, so the upload does not stall the GL pipeline, and the
+// memory handed out by Acquire() is the PBO itself: an OpenCL readback into it is the only copy
+// on the host. Depending on the GL implementation the PBOs are
+//
+//   persistent - mapped once (GL 4.4 / ARB_buffer_storage), a fence per slot guards the reuse
+//   map        - mapped by Acquire() and unmapped before the upload (GL 3.0 / ARB_map_buffer_range)
+//   client     - no PBOs (GL 2.0), the frames are uploaded from host memory
+//
+// OCL_PRESENT_MODE - forces "persistent", "map" or "client" (default: the best one available)
+class Presenter
+{
+public:
+	Presenter() :
+		mode(Client),
+		format(GL_RGBA),
+		type(GL_UNSIGNED_BYTE),
+		bytesPerPixel(4),
+		count(0),
+		next(0),
+		width(0),
+		height(0),
+		texture(0),
+		gl()
+	{
+	}
+
+	// picks the mode and loads the GL entry points, needs a current context
+	bool Init(GLenum pixelFormat, GLenum pixelType, size_t pixelBytes, int slots)
+	{
+		format = pixelFormat;
+		type = pixelType;
+		bytesPerPixel = pixelBytes;
+		count = std::max(1, slots);
+
+		const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+		const char* extensions = reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+		if (version == nullptr) {
+			std::cerr << "No current OpenGL context for the presenter\n";
+			return false;
+		}
+
+		const int major = atoi(version);
+		const bool hasMapRange = LoadFunctions() && (major >= 3 || HasExtension(extensions, "GL_ARB_map_buffer_range"));
+		const bool hasStorage = hasMapRange && gl.BufferStorage != nullptr && gl.FenceSync != nullptr
+			&& (major >= 5 || HasExtension(extensions, "GL_ARB_buffer_storage"));
+
+		mode = hasStorage ? Persistent : (hasMapRange ? Map : Client);
+
+		const std::string requested = GetEnvironmentString("OCL_PRESENT_MODE", "");
+		if (requested == "client" || (requested == "map" && hasMapRange) || (requested == "persistent" && hasStorage))
+			mode = requested == "client" ? Client : (requested == "map" ? Map : Persistent);
+		else if (!requested.empty())
+			std::cerr << "Presentation mode `" << requested << "' is not available, using " << ModeName() << '\n';
+
+		std::cout << "Presenting the frames through " << ModeName() << " (OpenGL " << version << ")" << std::endl;
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		return true;
+	}
+
+	// (re)creates the texture and the buffers for frames of the new size, the frames in the old buffers are lost
+	bool Resize(int newWidth, int newHeight)
+	{
+		ReleaseSlots();
+
+		width = newWidth;
+		height = newHeight;
+		const size_t bytes = FrameBytes();
+
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, format, type, nullptr);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		slots.resize(count);
+		for (size_t i = 0; i < slots.size(); ++i)
+		{
+			Slot& slot = slots[i];
+			if (mode == Client) {
+				slot.host.resize(bytes);
+				continue;
+			}
+
+			gl.GenBuffers(1, &slot.buffer);
+			gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+			if (mode == Persistent) {
+				const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				gl.BufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, flags);
+				slot.mapped = gl.MapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, flags);
+			} else {
+				gl.BufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+			}
+			gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+			if (mode == Persistent && slot.mapped == nullptr) {
+				std::cerr << "Unable to map a pixel buffer of " << bytes << " bytes\n";
+				return false;
+			}
+		}
+		next = 0;
+
+		return true;
+	}
+
+	size_t FrameBytes() const
+	{
+		return static_cast<size_t>(width) * height * bytesPerPixel;
+	}
+
+	// memory for the next frame, it stays valid until the frame is uploaded or `count' frames later
+	void* Acquire()
+	{
+		if (slots.empty())
+			return nullptr;
+
+		Slot& slot = slots[next];
+		next = (next + 1) % slots.size();
+
+		switch (mode)
+		{
+		case Persistent:
+			// the upload of the previous frame in this slot has to finish before it is overwritten
+			if (slot.fence != nullptr) {
+				while (gl.ClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+					;
+				gl.DeleteSync(slot.fence);
+				slot.fence = nullptr;
+			}
+			return slot.mapped;
+
+		case Map:
+			// a frame that was never uploaded keeps its mapping; invalidating lets the driver orphan the old storage
+			if (slot.mapped == nullptr) {
+				gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+				slot.mapped = gl.MapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, FrameBytes(), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+				gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+			return slot.mapped;
+
+		default:
+			return &slot.host[0];
+		}
+	}
+
+	// copies a frame into the texture, either memory from Acquire() or any other host memory
+	void Upload(const void* frame)
+	{
+		if (frame == nullptr || texture == 0)
+			return;
+
+		glBindTexture(GL_TEXTURE_2D, texture);
+
+		Slot* slot = Find(frame);
+		if (slot == nullptr || mode == Client) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, frame);
+		} else {
+			// the source is the bound buffer, the pointer is an offset into it
+			gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->buffer);
+			if (mode == Map) {
+				gl.UnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				slot->mapped = nullptr;
+			}
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, nullptr);
+			if (mode == Persistent)
+				slot->fence = gl.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	// draws the texture over the whole viewport, the first row of the frame is at the bottom
+	void Draw()
+	{
+		if (texture == 0)
+			return;
+
+		glEnable(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+
+		glBegin(GL_QUADS);
+		glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
+		glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, -1.0f);
+		glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, 1.0f);
+		glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, 1.0f);
+		glEnd();
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glDisable(GL_TEXTURE_2D);
+	}
+
+	// needs the context, so it is not left to the destructor
+	void Release()
+	{
+		ReleaseSlots();
+
+		if (texture != 0)
+			glDeleteTextures(1, &texture);
+		texture = 0;
+	}
+
+private:
+	enum Mode { Persistent, Map, Client };
+
+	struct Slot
+	{
+		GLuint buffer;
+		void* mapped;
+		void* fence;
+		std::vector<unsigned char> host;
+
+		Slot() : buffer(0), mapped(nullptr), fence(nullptr) {}
+	};
+
+	// the buffer entry points are not in the GL 1.1 headers of every platform
+	struct Functions
+	{
+		void (APIENTRY* GenBuffers)(GLsizei, GLuint*);
+		void (APIENTRY* DeleteBuffers)(GLsizei, const GLuint*);
+		void (APIENTRY* BindBuffer)(GLenum, GLuint);
+		void (APIENTRY* BufferData)(GLenum, ptrdiff_t, const void*, GLenum);
+		void (APIENTRY* BufferStorage)(GLenum, ptrdiff_t, const void*, GLbitfield);
+		void* (APIENTRY* MapBufferRange)(GLenum, ptrdiff_t, ptrdiff_t, GLbitfield);
+		GLboolean (APIENTRY* UnmapBuffer)(GLenum);
+		void* (APIENTRY* FenceSync)(GLenum, GLbitfield);
+		GLenum (APIENTRY* ClientWaitSync)(void*, GLbitfield, uint64_t);
+		void (APIENTRY* DeleteSync)(void*);
+	};
+
+	template <typename T>
+	static bool Load(T& function, const char* name)
+	{
+		function = reinterpret_cast<T>(glutGetProcAddress(name));
+
+		return function != nullptr;
+	}
+
+	// true if the functions of the map mode are there, the others are optional
+	bool LoadFunctions()
+	{
+		Load(gl.BufferStorage, "glBufferStorage");
+		Load(gl.FenceSync, "glFenceSync");
+		Load(gl.ClientWaitSync, "glClientWaitSync");
+		Load(gl.DeleteSync, "glDeleteSync");
+		if (gl.ClientWaitSync == nullptr || gl.DeleteSync == nullptr)
+			gl.FenceSync = nullptr;
+
+		return Load(gl.GenBuffers, "glGenBuffers") && Load(gl.DeleteBuffers, "glDeleteBuffers")
+			&& Load(gl.BindBuffer, "glBindBuffer") && Load(gl.BufferData, "glBufferData")
+			&& Load(gl.MapBufferRange, "glMapBufferRange") && Load(gl.UnmapBuffer, "glUnmapBuffer");
+	}
+
+	static bool HasExtension(const char* extensions, const char* name)
+	{
+		if (extensions == nullptr)
+			return false;
+
+		const size_t length = strlen(name);
+		for (const char* p = strstr(extensions, name); p != nullptr; p = strstr(p + length, name))
+			if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+				return true;
+
+		return false;
+	}
+
+	const char* ModeName() const
+	{
+		return mode == Persistent ? "persistently mapped PBOs" : (mode == Map ? "mapped PBOs" : "client memory");
+	}
+
+	Slot* Find(const void* frame)
+	{
+		for (size_t i = 0; i < slots.size(); ++i)
+			if (frame == (mode == Client ? static_cast<void*>(&slots[i].host[0]) : slots[i].mapped))
+				return &slots[i];
+
+		return nullptr;
+	}
+
+	void ReleaseSlots()
+	{
+		for (size_t i = 0; i < slots.size(); ++i)
+		{
+			Slot& slot = slots[i];
+			if (slot.fence != nullptr)
+				gl.DeleteSync(slot.fence);
+			if (slot.buffer != 0) {
+				if (slot.mapped != nullptr) {
+					gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+					gl.UnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+					gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				}
+				gl.DeleteBuffers(1, &slot.buffer);
+			}
+		}
+		slots.clear();
+	}
+
+	Mode mode;
+	GLenum format;
+	GLenum type;
+	size_t bytesPerPixel;
+	int count;
+	size_t next;
+	int width;
+	int height;
+	GLuint texture;
+	std::vector<Slot> slots;
+	Functions gl;
+};
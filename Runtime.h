@@ -0,0 +1,275 @@
+#pragma once
+
+#include "Common.h"
+
+// Shared OpenCL setup: enumerates every platform and device, picks one by a policy and creates the
+// context, the command queue and the programs for it.
+//
+// OCL_DEVICE         - "<platform>:<device>" indices or a part of the platform/device name, overrides the policy
+// OCL_DEVICE_POLICY  - "compute-units" (default), "fastest" (measured with a small kernel) or "first"
+//
+// GPUs and accelerators are preferred, CPU devices are only picked when there is nothing else.
+
+struct Runtime
+{
+	cl::Platform platform;
+	cl::Device device;
+	cl::Context context;
+	cl::CommandQueue queue;
+};
+
+
+struct DeviceCandidate
+{
+	size_t platformIndex;
+	size_t deviceIndex;
+	cl::Platform platform;
+	cl::Device device;
+	std::string name;
+};
+
+
+std::string ToLower(std::string text)
+{
+	for (size_t i = 0; i < text.size(); ++i)
+		text[i] = static_cast<char>(tolower(static_cast<unsigned char>(text[i])));
+
+	return text;
+}
+
+
+std::vector<DeviceCandidate> EnumerateDevices(void)
+{
+	std::vector<DeviceCandidate> candidates;
+
+	std::vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+
+	for (size_t p = 0; p < platforms.size(); ++p)
+	{
+		std::vector<cl::Device> devices;
+		if (platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &devices) != CL_SUCCESS)
+			continue;
+
+		for (size_t d = 0; d < devices.size(); ++d)
+		{
+			DeviceCandidate c;
+			c.platformIndex = p;
+			c.deviceIndex = d;
+			c.platform = platforms[p];
+			c.device = devices[d];
+			c.name = platforms[p].getInfo<CL_PLATFORM_NAME>() + " / " + devices[d].getInfo<CL_DEVICE_NAME>();
+			candidates.push_back(c);
+		}
+	}
+
+	return candidates;
+}
+
+
+const char* BENCHMARK_SOURCE = STRINGIFY(
+	__kernel
+	void Benchmark(__global float* data)
+	{
+		int id = get_global_id(0);
+		float x = data[id];
+		for (int i = 0; i < 512; ++i)
+			x = mad(x, 0.999f, 0.001f);
+		data[id] = x;
+	}
+);
+
+
+// runs a short arithmetic kernel on the device, returns the seconds per launch or a negative value on failure
+double BenchmarkDevice(const cl::Device& device)
+{
+	const size_t items = 1 << 20;
+	const int repetitions = 3;
+
+	cl_int err = CL_SUCCESS;
+	cl::Context context(device, nullptr, nullptr, nullptr, &err);
+	if (err != CL_SUCCESS)
+		return -1.0;
+
+	cl::CommandQueue queue(context, device, 0, &err);
+	if (err != CL_SUCCESS)
+		return -1.0;
+
+	cl::Program program(context, BENCHMARK_SOURCE);
+	std::vector<cl::Device> devices(1, device);
+	if (program.build(devices) != CL_SUCCESS)
+		return -1.0;
+
+	cl::Kernel kernel(program, "Benchmark", &err);
+	cl::Buffer data(context, CL_MEM_READ_WRITE, sizeof(cl_float) * items, nullptr, &err);
+	if (err != CL_SUCCESS || kernel.setArg(0, data) != CL_SUCCESS)
+		return -1.0;
+
+	// the first launch compiles and allocates lazily on some drivers
+	if (queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(items), cl::NullRange) != CL_SUCCESS || queue.finish() != CL_SUCCESS)
+		return -1.0;
+
+	std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < repetitions; ++i)
+		err |= queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(items), cl::NullRange);
+	if (err != CL_SUCCESS || queue.finish() != CL_SUCCESS)
+		return -1.0;
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+	return std::chrono::duration<double>(end - begin).count() / repetitions;
+}
+
+
+// the explicit choice of OCL_DEVICE, returns false if it does not match any device
+bool FindRequestedDevice(const std::vector<DeviceCandidate>& candidates, const std::string& request, DeviceCandidate& chosen)
+{
+	size_t platformIndex = 0;
+	size_t deviceIndex = 0;
+	char separator = 0;
+	std::istringstream ss(request);
+	if (ss >> platformIndex >> separator >> deviceIndex && separator == ':' && ss.eof()) {
+		for (size_t i = 0; i < candidates.size(); ++i)
+			if (candidates[i].platformIndex == platformIndex && candidates[i].deviceIndex == deviceIndex) {
+				chosen = candidates[i];
+				return true;
+			}
+
+		return false;
+	}
+
+	for (size_t i = 0; i < candidates.size(); ++i)
+		if (ToLower(candidates[i].name).find(ToLower(request)) != std::string::npos) {
+			chosen = candidates[i];
+			return true;
+		}
+
+	return false;
+}
+
+
+bool SelectDevice(const std::vector<DeviceCandidate>& candidates, DeviceCandidate& chosen)
+{
+	const std::string policy = GetEnvironmentString("OCL_DEVICE_POLICY", "compute-units");
+
+	// GPUs and accelerators first, the CPUs are the fallback
+	std::vector<DeviceCandidate> pool;
+	for (size_t i = 0; i < candidates.size(); ++i)
+		if ((candidates[i].device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) == 0)
+			pool.push_back(candidates[i]);
+
+	if (pool.empty()) {
+		pool = candidates;
+		std::cout << "No GPU or accelerator found, falling back to the CPU devices." << std::endl;
+	}
+
+	if (pool.empty())
+		return false;
+
+	size_t best = 0;
+	if (policy == "fastest")
+	{
+		double bestSeconds = -1.0;
+		for (size_t i = 0; i < pool.size(); ++i)
+		{
+			double seconds = BenchmarkDevice(pool[i].device);
+			std::cout << "  " << pool[i].name << ": " << (seconds < 0.0 ? std::string("failed") : std::to_string(seconds * 1e3) + " ms") << std::endl;
+			if (seconds >= 0.0 && (bestSeconds < 0.0 || seconds < bestSeconds)) {
+				bestSeconds = seconds;
+				best = i;
+			}
+		}
+	}
+	else if (policy == "compute-units")
+	{
+		cl_ulong bestScore = 0;
+		for (size_t i = 0; i < pool.size(); ++i)
+		{
+			// the clock breaks the ties between devices with the same number of compute units
+			cl_ulong score = static_cast<cl_ulong>(pool[i].device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) * 100000
+				+ pool[i].device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+			if (score > bestScore) {
+				bestScore = score;
+				best = i;
+			}
+		}
+	}
+	else if (policy != "first")
+	{
+		std::cerr << "Unknown device policy `" << policy << "', using the first device\n";
+	}
+
+	chosen = pool[best];
+
+	return true;
+}
+
+
+// queueProperties are added to the ones of the profiler
+bool InitRuntime(Runtime& runtime, cl_command_queue_properties queueProperties = 0)
+{
+	std::vector<DeviceCandidate> candidates = EnumerateDevices();
+	if (candidates.empty()) {
+		std::cout << "Unable to find suitable platform." << std::endl;
+
+		return false;
+	}
+
+	DeviceCandidate chosen;
+	const char* request = GetEnvironmentString("OCL_DEVICE", nullptr);
+	if (request != nullptr) {
+		if (!FindRequestedDevice(candidates, request, chosen)) {
+			std::cerr << "No device matches OCL_DEVICE=" << request << ", the available devices are:\n";
+			for (size_t i = 0; i < candidates.size(); ++i)
+				std::cerr << "  " << candidates[i].platformIndex << ':' << candidates[i].deviceIndex << "  " << candidates[i].name << '\n';
+
+			return false;
+		}
+	} else if (!SelectDevice(candidates, chosen)) {
+		return false;
+	}
+
+	std::cout << "Using " << chosen.name << std::endl;
+
+	cl_int err = CL_SUCCESS;
+	cl_context_properties properties [] =
+		{ CL_CONTEXT_PLATFORM, (cl_context_properties) (chosen.platform) (), 0 };
+
+	runtime.platform = chosen.platform;
+	runtime.device = chosen.device;
+	runtime.context = cl::Context(chosen.device, properties, nullptr, nullptr, &err);
+	if (!CheckCLError(err))
+		return false;
+
+	runtime.queue = cl::CommandQueue(runtime.context, runtime.device, profiler.QueueProperties() | queueProperties, &err);
+	if (!CheckCLError(err))
+		return false;
+
+	return true;
+}
+
+
+// returns the built program (owned by the caller) or nullptr, the build log is printed on failure
+cl_program BuildProgram(const Runtime& runtime, const char* source, const char* options)
+{
+	cl_int err = CL_SUCCESS;
+	cl_program program = clCreateProgramWithSource(runtime.context(), 1, &source, nullptr, &err);
+	if (program == nullptr || !CheckCLError(err))
+		return nullptr;
+
+	cl_device_id device = runtime.device();
+	err = clBuildProgram(program, 1, &device, options, nullptr, nullptr);
+	if (!CheckCLError(err)) {
+		size_t logLength = 0;
+		clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logLength);
+
+		std::string log(logLength, '\0');
+		clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logLength, &log[0], nullptr);
+		std::cerr << "Build log:\n" << log << std::endl;
+
+		clReleaseProgram(program);
+
+		return nullptr;
+	}
+
+	return program;
+}
@@ -1,6 +1,8 @@
 #include <GL/freeglut.h>
-#include <CL/cl2.hpp>
 #include "../Common.h"
+#include "../Runtime.h"
+#include "../FrameOutput.h"
+#include "../Presenter.h"
 
 
 const char* programSource = STRINGIFY (
@@ -26,21 +28,35 @@ const char* programSource = STRINGIFY (
     }
 );
 
+// colours of the cells for the video stream
+const char* pixelSource = STRINGIFY (
+    float3 FramePixel (__global const char* frame, int index)
+    {
+        return frame [index] == 1 ? (float3) (0.22f, 1.0f, 0.08f) : (float3) (0.0f, 0.0f, 0.0f);
+    }
+);
+
 size_t screenWidth          = 800;
 size_t screenHeight         = 600;
 size_t globalWorkSize [2]   = { 0 };
+size_t localWorkSize [3]    = { 0 };
 bool keysPressed [256]      = { false };
 bool isRunning              = true;
 
+Runtime runtime;
+
+// the device, the context and the queue are owned by the runtime
+cl_device_id device         = nullptr;
 cl_context context          = nullptr;
 cl_command_queue commands   = nullptr;
 cl_program program          = nullptr;
 cl_kernel kernel            = nullptr;
                               
 char* hostBuffer            = nullptr;
-cl_float3* image            = nullptr;
-cl_mem deviceBufferIn       = nullptr;
-cl_mem deviceBufferOut      = nullptr;
+FrameRing frames;
+Presenter presenter;
+ImageWriter frameWriter;
+VideoStream videoStream;
 
 cl_int errorCode            = CL_SUCCESS;
 
@@ -54,11 +70,7 @@ bool AllocateData (void)
     if (hostBuffer != nullptr)
         delete [] hostBuffer;
 
-    if (image != nullptr)
-        delete [] image;
-
     try {
-        image = new cl_float3 [screenWidth * screenHeight];
         hostBuffer = new char [screenWidth * screenHeight];
     } catch (const std::bad_alloc& ba) {
         std::cerr << "Bad alloc exception was caught: " << ba.what () << '\n';
@@ -66,29 +78,9 @@ bool AllocateData (void)
         return false;
     }
 
-    // (re)allocating device data
-    if (deviceBufferOut != nullptr)
-        clReleaseMemObject (deviceBufferOut);
-    
-    if (deviceBufferIn != nullptr)
-        clReleaseMemObject (deviceBufferIn);
-
-    deviceBufferIn = clCreateBuffer (context,
-                                    CL_MEM_READ_WRITE,
-                                    screenWidth * screenHeight,
-                                    nullptr,
-                                    &errorCode);
-
-    if (deviceBufferIn == nullptr || !CheckCLError (errorCode))
-        return false;
-
-    deviceBufferOut = clCreateBuffer (context,
-                                    CL_MEM_READ_WRITE,
-                                    screenWidth * screenHeight,
-                                    nullptr,
-                                    &errorCode);
-
-    if (deviceBufferOut == nullptr || !CheckCLError (errorCode))
+    // (re)allocating device data: the generations rotate through the frame ring,
+    // each step reads the previous frame and writes the current one, so at least two are needed
+    if (!frames.Allocate (context, device, screenWidth * screenHeight, std::max (2, FrameRing::DefaultSize ())))
         return false;
 
     return true;
@@ -101,112 +93,61 @@ bool InitData (void)
     for (size_t i = 0; i < screenWidth * screenHeight; ++i)
         hostBuffer [i] = (static_cast<float> (rand ()) / RAND_MAX < 0.3) ? 1 : 0;
 
+    // the generations still in flight belong to the old board
+    frames.Drain ();
+
+    cl_event event = nullptr;
     errorCode = clEnqueueWriteBuffer (commands,
-                                    deviceBufferIn,
+                                    frames.Previous (),
                                     CL_TRUE, 
                                     0,
                                     screenWidth * screenHeight,
                                     hostBuffer,
                                     0,
                                     nullptr,
-                                    nullptr);
+                                    profiler.Track (&event));
 
     if (!CheckCLError (errorCode))
         return false;
 
+    profiler.Add ("WriteInitialState", event);
+
     return true;
 }
 
 
-// OpenCL
-bool InitOpenCL (void)
+bool SetKernelArguments (void)
 {
-    // get available platforms - we want to get maximum 1 platform
-    cl_platform_id platform = nullptr;
-    errorCode = clGetPlatformIDs (1, &platform, nullptr);
-    if (!CheckCLError (errorCode))
-        return false;
-    
-    // get available GPU devices - we want to get maximum 1 device
-    cl_device_id device = nullptr;
-    errorCode = clGetDeviceIDs (platform,
-                                CL_DEVICE_TYPE_GPU,
-                                1,
-                                &device,
-                                nullptr);
-
-    if (!CheckCLError (errorCode))
-        return false;
+    cl_mem in = frames.Previous ();
+    cl_mem out = frames.Current ();
 
-    // creation of OpenCL context
-    context = clCreateContext (nullptr,
-                            1,
-                            &device,
-                            nullptr,
-                            nullptr,
-                            &errorCode);
+    errorCode = clSetKernelArg (kernel, 0, sizeof (cl_mem), &in); 
+    errorCode |= clSetKernelArg (kernel, 1, sizeof (int), &screenWidth); 
+    errorCode |= clSetKernelArg (kernel, 2, sizeof (int), &screenHeight); 
+    errorCode |= clSetKernelArg (kernel, 3, sizeof (cl_mem), &out); 
 
-    if (context == nullptr || !CheckCLError (errorCode))
-        return false;
+    return CheckCLError (errorCode);
+}
 
-    // creation of OpenCL command queue with the CL_QUEUE_PROFILING_ENABLE property
-    commands = clCreateCommandQueue (context,
-                                    device,
-                                    CL_QUEUE_PROFILING_ENABLE,
-                                    &errorCode);
 
-    if (commands == nullptr || !CheckCLError (errorCode))
+// OpenCL
+bool InitOpenCL (void)
+{
+    // selection of the device, creation of the context and the command queue
+    if (!InitRuntime (runtime))
         return false;
 
-    // creation of the program
-    program = clCreateProgramWithSource (context,
-                                        1,
-                                        &programSource,
-                                        nullptr,
-                                        &errorCode);
+    device = runtime.device ();
+    context = runtime.context ();
+    commands = runtime.queue ();
 
-    if (!CheckCLError (errorCode))
+    // creation and compilation of the program
+    program = BuildProgram (runtime, programSource, nullptr);
+    if (program == nullptr)
         return false;
 
-    // compilation of the program
-    errorCode = clBuildProgram (program,
-                                1,
-                                &device,
-                                nullptr,
-                                nullptr,
-                                nullptr);
-
-    if (!CheckCLError (errorCode))
-    {
-        size_t logLength;
-        char* log = nullptr;
-        clGetProgramBuildInfo (program,
-                            device,
-                            CL_PROGRAM_BUILD_LOG,
-                            0,
-                            nullptr,
-                            &logLength);
-
-        try {
-            log = new char [logLength];
-        } catch (const std::bad_alloc& ba) {
-            std::cerr << "Bad alloc exception was caught: " << ba.what () << '\n';
-
-            return false;
-        }
-        clGetProgramBuildInfo (program,
-                            device,
-                            CL_PROGRAM_BUILD_LOG,
-                            logLength,
-                            log,
-                            nullptr);
-
-        std::cout << log << std::endl;
-        if (log != nullptr)
-            delete [] log;
-
+    if (!videoStream.Init (runtime, pixelSource, "char"))
         return false;
-    }
 
     // creation of the kernel
     kernel = clCreateKernel (program, "GOL", &errorCode);
@@ -216,6 +157,12 @@ bool InitOpenCL (void)
     // allocation and initialization of host and device data
     if (!AllocateData () || !InitData ())
         return false;
+
+    // picking the local work size, the tuning runs only overwrite the output slot, which the first
+    // generation writes again
+    if (!SetKernelArguments ()
+        || !autoTuner.Tune (commands, kernel, "GOL", 2, globalWorkSize, localWorkSize))
+        return false;
     
     return true;
 }
@@ -223,67 +170,91 @@ bool InitOpenCL (void)
 
 void RunOpenCL (void)
 {
+    // the output slot may still be mapped by the host from an earlier presentation
+    if (!frames.Acquire (commands))
+        exit (-1);
+
     // setting the kernel arguments
-    errorCode = clSetKernelArg (kernel, 0, sizeof (cl_mem), &deviceBufferIn); 
-    errorCode |= clSetKernelArg (kernel, 1, sizeof (int), &screenWidth); 
-    errorCode |= clSetKernelArg (kernel, 2, sizeof (int), &screenHeight); 
-    errorCode |= clSetKernelArg (kernel, 3, sizeof (cl_mem), &deviceBufferOut); 
-    if (!CheckCLError (errorCode))
+    if (!SetKernelArguments ())
         exit (-1);
 
+    // the global size has to be a multiple of the tuned local size, the kernel checks its bounds
+    size_t roundedWorkSize [2];
+    AutoTuner::RoundGlobalSize (2, globalWorkSize, localWorkSize, roundedWorkSize);
+
     // kernel execution
+    cl_event event = nullptr;
     errorCode = clEnqueueNDRangeKernel (commands,
                                         kernel,
                                         2,
                                         nullptr,
-                                        globalWorkSize,
-                                        nullptr,
+                                        roundedWorkSize,
+                                        AutoTuner::LocalSizeOrNull (localWorkSize),
                                         0,
                                         nullptr,
-                                        nullptr);
+                                        &event);
 
     if (!CheckCLError (errorCode))
         exit (-1);
 
-    // getting back the results
-    clFinish (commands);
-    errorCode = clEnqueueReadBuffer (commands,
-                                    deviceBufferOut,
-                                    CL_TRUE,
-                                    0,
-                                    screenWidth * screenHeight,
-                                    hostBuffer,
-                                    0,
-                                    nullptr,
-                                    nullptr);
+    // the video is converted on the device, before the slot moves on
+    if (!videoStream.Encode (commands, frames.Current (), screenWidth, screenHeight))
+        exit (-1);
 
-    if (!CheckCLError (errorCode))
+    // getting back the results without blocking, this generation becomes the input of the next step
+    if (!frames.Submit (commands, event))
         exit (-1);
 
-    // swap the device buffers for the next step of the computation
-    std::swap (deviceBufferIn, deviceBufferOut);
-    
-    // updating the image
-    for (size_t i = 0; i < screenWidth * screenHeight; ++i)
-        image [i] = (hostBuffer [i] == 1) ? cl_float3 {0.22f, 1.0f, 0.08f} : cl_float3 {0.0f, 0.0f, 0.0f};
+    profiler.Add ("GOL", event);
+    profiler.Collect ();
+
+    // updating the image from the oldest generation in flight, while the device computes the newer ones
+    const char* state = static_cast<const char*> (frames.Present ());
+    if (state == nullptr)
+        return;
+
+    // the colours are written straight into a pixel buffer of the presenter
+    cl_uchar4* image = static_cast<cl_uchar4*> (presenter.Acquire ());
+    if (image != nullptr)
+    {
+        for (size_t i = 0; i < screenWidth * screenHeight; ++i)
+            image [i] = (state [i] == 1) ? cl_uchar4 {{56, 255, 20, 255}} : cl_uchar4 {{0, 0, 0, 255}};
+        presenter.Upload (image);
+    }
+
+    // dumping the generation, the file is written by the writer thread
+    if (frameWriter.IsEnabled ())
+    {
+        std::vector<unsigned char>* pixels = frameWriter.Acquire (screenWidth * screenHeight * 3);
+        if (pixels == nullptr)
+            return;
+
+        for (size_t i = 0; i < screenWidth * screenHeight; ++i)
+        {
+            (*pixels) [i * 3 + 0] = (state [i] == 1) ? 56 : 0;
+            (*pixels) [i * 3 + 1] = (state [i] == 1) ? 255 : 0;
+            (*pixels) [i * 3 + 2] = (state [i] == 1) ? 20 : 0;
+        }
+        frameWriter.Submit (pixels, screenWidth, screenHeight, 3);
+    }
 }
 
 
 void DestroyOpenCL (void)
 {
+    // write the profiling trace before the queue goes away
+    frameWriter.Stop ();
+    videoStream.Stop ();
+    frames.Release ();
+    presenter.Release ();
+    profiler.Finish (commands);
+
     // free data
     clReleaseKernel (kernel);
     clReleaseProgram (program);
-    clReleaseMemObject (deviceBufferOut);
-    clReleaseMemObject (deviceBufferIn);
-    clReleaseCommandQueue (commands);
-    clReleaseContext (context);
 
     if (hostBuffer != nullptr)
         delete [] hostBuffer;
-
-    if (image != nullptr)
-        delete [] image;
 }
 
 
@@ -292,6 +263,9 @@ void InitOpenGL (void)
 {
     glClearColor (0.17f, 0.4f, 0.6f, 1.0f);
     glDisable (GL_DEPTH_TEST);
+
+    if (!presenter.Init (GL_RGBA, GL_UNSIGNED_BYTE, sizeof (cl_uchar4), 2) || !presenter.Resize (screenWidth, screenHeight))
+        exit (-1);
 }
 
 
@@ -300,7 +274,7 @@ void Display (void)
     if (isRunning)
     {
         glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glDrawPixels (screenWidth, screenHeight, GL_RGBA, GL_FLOAT, image);
+        presenter.Draw ();
         glutSwapBuffers ();
     }
 }
@@ -358,7 +332,7 @@ void Reshape (int newWidth, int newHeight)
     screenWidth = newWidth;
     screenHeight = newHeight;
 
-    if (AllocateData () && InitData ())
+    if (AllocateData () && InitData () && presenter.Resize (screenWidth, screenHeight))
         glViewport (0, 0, screenWidth, screenHeight);
     else
         exit (-1);
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "../Common.h"
+#include "../Runtime.h"
+#include "DeviceStage.h"
+#include "RadixTree.h"
+
+// Collisions: the bodies are spheres of the radii of their attributes (mass, radius, type, see
+// InitialConditions.h), two bodies that overlap merge into one at their centre of mass with their
+// momentum, their volume and the type of the heavier one. The broad phase walks the radix tree of the
+// bodies (see RadixTree.h), built on the device for every pass: a node is opened when its box comes
+// within the radius of the body plus the largest radius of all. Every body picks the nearest body it
+// overlaps, the pairs that picked each other merge; the closest pair of a cluster always does, the rest
+// of the cluster follows in the later passes. The merged bodies are removed by a stream compaction that
+// keeps the order of the survivors, the active body count shrinks with them.
+//
+// Built after the accessors of the particle buffers (see ForceVariants.h) and SCAN_KERNEL_SOURCE.
+const char* COLLISION_KERNEL_SOURCE = STRINGIFY (
+    // the largest value of the work-group, in work-groups of a power of two
+    uint GroupMax (__local uint* scratch, uint value)
+    {
+        int lid = get_local_id (0);
+        scratch [lid] = value;
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (int half = get_local_size (0) / 2; half > 0; half /= 2)
+        {
+            if (lid < half)
+                scratch [lid] = max (scratch [lid], scratch [lid + half]);
+            barrier (CLK_LOCAL_MEM_FENCE);
+        }
+
+        return scratch [0];
+    }
+
+    // the largest radius into stats [1], positive floats order like their bits
+    __kernel
+    void MeasureBodies (__global const float4* attributes, __global uint* stats, __local uint* scratch, const int BODY_NUM)
+    {
+        int id = get_global_id (0);
+        uint largest = GroupMax (scratch, id < BODY_NUM ? as_uint (attributes [id].y) : 0u);
+
+        if (get_local_id (0) == 0)
+            atomic_max (stats + 1, largest);
+    }
+
+    // the nearest body that overlaps, -1 for none; equal distances go to the lower index, so the choice is mutual.
+    // The tree is walked depth first, its nodes are numbered as in RadixTree.h; the stack is deeper than any
+    // path of a tree of 32 bit codes with 31 bit indices appended
+    __kernel
+    void FindPartners (__global const PARTICLE_MEMORY* particles, __global const float4* attributes, __global const int2* children,
+        __global const float4* boxes, __global const int* leafBodies, __global int* partners, const int BODY_NUM, __global const uint* stats)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        float2 p = LOAD_PARTICLE (id, particles).xy;
+        float radius = attributes [id].y;
+        float reach = radius + as_float (stats [1]);
+
+        int best = -1;
+        float bestDistance = MAXFLOAT;
+        int stack [72];
+        int top = 0;
+        stack [top++] = 0;
+        while (top > 0)
+        {
+            int node = stack [--top];
+            float4 box = boxes [node];
+            if (any (p + reach < box.xy) || any (p - reach > box.zw))
+                continue;
+
+            if (node < BODY_NUM - 1)
+            {
+                int2 c = children [node];
+                stack [top++] = c.x;
+                stack [top++] = c.y;
+                continue;
+            }
+
+            int j = leafBodies [node - (BODY_NUM - 1)];
+            if (j == id)
+                continue;
+
+            float2 r = box.xy - p;
+            float d2 = dot (r, r);
+            float touch = radius + attributes [j].y;
+            if (d2 < touch * touch && (d2 < bestDistance || (d2 == bestDistance && j < best)))
+            {
+                best = j;
+                bestDistance = d2;
+            }
+        }
+
+        partners [id] = best;
+    }
+
+    // the lower index of a mutual pair takes the centre of mass, its velocity and the merged attributes
+    __kernel
+    void MergeBodies (__global PARTICLE_MEMORY* particles, __global float4* attributes, __global const int* partners,
+        __global int* alive, const int BODY_NUM)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        int partner = partners [id];
+        bool merged = partner >= 0 && partners [partner] == id;
+        alive [id] = !merged || id < partner;
+        if (!merged || id > partner)
+            return;
+
+        float4 a = attributes [id];
+        float4 b = attributes [partner];
+        float m = a.x + b.x;
+        STORE_PARTICLE ((LOAD_PARTICLE (id, particles) * a.x + LOAD_PARTICLE (partner, particles) * b.x) / m, id, particles);
+        attributes [id] = (float4) (m, cbrt (a.y * a.y * a.y + b.y * b.y * b.y), a.x >= b.x ? a.z : b.z, 0.0f);
+    }
+
+    __kernel
+    void CountAlive (__global const int* alive, __global int* groupCounts, __local int* scratch, const int BODY_NUM)
+    {
+        int id = get_global_id (0);
+        int count = GroupScan (scratch, id < BODY_NUM ? alive [id] : 0);
+
+        if (get_local_id (0) == get_local_size (0) - 1)
+            groupCounts [get_group_id (0)] = count;
+    }
+
+    __kernel
+    void ScatterAlive (__global const PARTICLE_MEMORY* particles, __global const float4* attributes, __global const int* alive,
+        __global const int* groupPlaces, __global PARTICLE_MEMORY* compacted, __global float4* compactedAttributes,
+        __local int* scratch, const int BODY_NUM)
+    {
+        int id = get_global_id (0);
+        int flag = id < BODY_NUM ? alive [id] : 0;
+        int place = groupPlaces [get_group_id (0)] + GroupScan (scratch, flag) - flag;
+
+        if (flag)
+        {
+            STORE_PARTICLE (LOAD_PARTICLE (id, particles), place, compacted);
+            compactedAttributes [place] = attributes [id];
+        }
+    }
+);
+
+
+// The collision stage of a simulation: the radix tree and the buffers of the compaction, allocated for the
+// body count it starts with.
+class Collisions
+{
+public:
+    Collisions () : capacity (0), localSize (1) {}
+
+    bool IsEnabled () const
+    {
+        return capacity > 0;
+    }
+
+    size_t Capacity () const
+    {
+        return capacity;
+    }
+
+    bool Init (const Runtime& runtime, size_t bodies, const std::string& prefix, const std::string& options)
+    {
+        context = runtime.context;
+
+        program = BuildStageProgram (runtime, prefix + SCAN_KERNEL_SOURCE, COLLISION_KERNEL_SOURCE, options);
+        if (program () == nullptr)
+            return false;
+
+        cl::Kernel* kernels [] = { &measureKernel, &partnerKernel, &mergeKernel, &countKernel, &scanKernel, &scatterKernel };
+        const char* names [] = { "MeasureBodies", "FindPartners", "MergeBodies", "CountAlive", "ScanGroups", "ScatterAlive" };
+        if (!CreateKernels (program, kernels, names, 6) || !tree.Init (runtime, bodies, prefix, options))
+            return false;
+
+        // the scans and the reduction run in work-groups of a power of two
+        size_t maxLocal = measureKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (runtime.device);
+        maxLocal = std::min (maxLocal, countKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (runtime.device));
+        maxLocal = std::min (maxLocal, scatterKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (runtime.device));
+        localSize = 1;
+        while (localSize * 2 <= std::min<size_t> (maxLocal, 256))
+            localSize *= 2;
+
+        const size_t groups = (bodies + localSize - 1) / localSize;
+        cl::Buffer* buffers [] = { &partners, &alive, &groupCounts, &stats };
+        const size_t bytes [] = { sizeof (cl_int) * bodies, sizeof (cl_int) * bodies, sizeof (cl_int) * groups, 2 * sizeof (cl_uint) };
+        for (int i = 0; i < 4; ++i)
+        {
+            cl_int err = CL_SUCCESS;
+            *buffers [i] = cl::Buffer (context, CL_MEM_READ_WRITE, bytes [i], nullptr, &err);
+            if (!CheckCLError (err))
+                return false;
+        }
+
+        capacity = bodies;
+
+        return true;
+    }
+
+    // merges the overlapping bodies of `particles' into `compacted', their attributes into `compactedAttributes',
+    // and updates the body count, which is read back
+    bool Collide (cl::CommandQueue& queue, const cl::Buffer& particles, const cl::Buffer& attributes, const cl::Buffer& compacted,
+        const cl::Buffer& compactedAttributes, size_t& bodyCount)
+    {
+        const cl_int bodies = static_cast<cl_int> (bodyCount);
+        const size_t groups = (bodyCount + localSize - 1) / localSize;
+        const cl_uint initialStats [2] = { 0, 0 };
+
+        cl_int err = measureKernel.setArg (0, attributes);
+        err |= measureKernel.setArg (1, stats);
+        err |= measureKernel.setArg (2, cl::Local (sizeof (cl_uint) * localSize));
+        err |= measureKernel.setArg (3, bodies);
+
+        err |= partnerKernel.setArg (0, particles);
+        err |= partnerKernel.setArg (1, attributes);
+        err |= partnerKernel.setArg (2, tree.Children ());
+        err |= partnerKernel.setArg (3, tree.Boxes ());
+        err |= partnerKernel.setArg (4, tree.Bodies ());
+        err |= partnerKernel.setArg (5, partners);
+        err |= partnerKernel.setArg (6, bodies);
+        err |= partnerKernel.setArg (7, stats);
+
+        err |= mergeKernel.setArg (0, particles);
+        err |= mergeKernel.setArg (1, attributes);
+        err |= mergeKernel.setArg (2, partners);
+        err |= mergeKernel.setArg (3, alive);
+        err |= mergeKernel.setArg (4, bodies);
+
+        err |= countKernel.setArg (0, alive);
+        err |= countKernel.setArg (1, groupCounts);
+        err |= countKernel.setArg (2, cl::Local (sizeof (cl_int) * localSize));
+        err |= countKernel.setArg (3, bodies);
+
+        err |= scanKernel.setArg (0, groupCounts);
+        err |= scanKernel.setArg (1, stats);
+        err |= scanKernel.setArg (2, cl::Local (sizeof (cl_int) * localSize));
+        err |= scanKernel.setArg (3, static_cast<cl_int> (groups));
+
+        err |= scatterKernel.setArg (0, particles);
+        err |= scatterKernel.setArg (1, attributes);
+        err |= scatterKernel.setArg (2, alive);
+        err |= scatterKernel.setArg (3, groupCounts);
+        err |= scatterKernel.setArg (4, compacted);
+        err |= scatterKernel.setArg (5, compactedAttributes);
+        err |= scatterKernel.setArg (6, cl::Local (sizeof (cl_int) * localSize));
+        err |= scatterKernel.setArg (7, bodies);
+        if (!CheckCLError (err)
+            || !CheckCLError (queue.enqueueWriteBuffer (stats, true, 0, sizeof (initialStats), initialStats))
+            || !LaunchKernel (queue, measureKernel, "MeasureBodies", cl::NDRange (groups * localSize), cl::NDRange (localSize))
+            || !tree.Build (queue, particles, attributes, bodyCount, treeFirst, treeLast)
+            || !LaunchKernel (queue, partnerKernel, "FindPartners", cl::NDRange (bodyCount), cl::NullRange)
+            || !LaunchKernel (queue, mergeKernel, "MergeBodies", cl::NDRange (bodyCount), cl::NullRange)
+            || !LaunchKernel (queue, countKernel, "CountAlive", cl::NDRange (groups * localSize), cl::NDRange (localSize))
+            || !LaunchKernel (queue, scanKernel, "ScanGroups", cl::NDRange (localSize), cl::NDRange (localSize))
+            || !LaunchKernel (queue, scatterKernel, "ScatterAlive", cl::NDRange (groups * localSize), cl::NDRange (localSize)))
+            return false;
+
+        // the launches of the next steps need the new count
+        cl_uint count = 0;
+        if (!CheckCLError (queue.enqueueReadBuffer (stats, true, 0, sizeof (count), &count)))
+            return false;
+
+        bodyCount = count;
+
+        return true;
+    }
+
+private:
+    size_t capacity;
+    size_t localSize;
+    RadixTree tree;
+    cl::Event treeFirst;
+    cl::Event treeLast;
+
+    cl::Context context;
+    cl::Program program;
+    cl::Kernel measureKernel;
+    cl::Kernel partnerKernel;
+    cl::Kernel mergeKernel;
+    cl::Kernel countKernel;
+    cl::Kernel scanKernel;
+    cl::Kernel scatterKernel;
+
+    cl::Buffer partners;
+    cl::Buffer alive;
+    cl::Buffer groupCounts;
+    cl::Buffer stats;
+};
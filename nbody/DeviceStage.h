@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+
+#include "../Common.h"
+#include "../Runtime.h"
+
+// The pieces shared by the device stages of the simulation (FMM.h, Collisions.h, Space3D.h, RadixTree.h).
+// A stage builds a program of its own from a prefix and its kernel source; the prefix brings what the
+// source is built after, the simulation constants or the accessors of the particle buffers (see
+// ForceVariants.h). Every launch of a stage is recorded with the profiler.
+
+// the scans of the stages that compact or sort and of the trajectory coder (Trajectory.h), prepended to their sources
+const char* SCAN_KERNEL_SOURCE = STRINGIFY (
+    // inclusive prefix sum over the work-group, every work-item has to call it
+    int GroupScan (__local int* scratch, int value)
+    {
+        int lid = get_local_id (0);
+        scratch [lid] = value;
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = 1; offset < get_local_size (0); offset *= 2)
+        {
+            int before = lid >= offset ? scratch [lid - offset] : 0;
+            barrier (CLK_LOCAL_MEM_FENCE);
+            scratch [lid] += before;
+            barrier (CLK_LOCAL_MEM_FENCE);
+        }
+
+        return scratch [lid];
+    }
+
+    // the counts become their first places, in one work-group; the sum of all of them goes to total [0]
+    __kernel
+    void ScanGroups (__global int* groupCounts, __global uint* total, __local int* scratch, const int count)
+    {
+        int lid = get_local_id (0);
+        int chunk = (count + get_local_size (0) - 1) / get_local_size (0);
+        int begin = min (lid * chunk, count);
+        int end = min (begin + chunk, count);
+
+        int sum = 0;
+        for (int g = begin; g < end; ++g)
+            sum += groupCounts [g];
+
+        int all = GroupScan (scratch, sum);
+        int place = all - sum;
+        for (int g = begin; g < end; ++g)
+        {
+            int c = groupCounts [g];
+            groupCounts [g] = place;
+            place += c;
+        }
+
+        if (lid == get_local_size (0) - 1)
+            total [0] = all;
+    }
+);
+
+
+cl::Program BuildStageProgram (const Runtime& runtime, const std::string& prefix, const char* source, const std::string& options)
+{
+    const std::string full = prefix + source;
+    return cl::Program (BuildProgram (runtime, full.c_str (), options.c_str ()));
+}
+
+
+// the kernels of `program' by their names
+bool CreateKernels (const cl::Program& program, cl::Kernel* const* kernels, const char* const* names, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        cl_int err = CL_SUCCESS;
+        *kernels [i] = cl::Kernel (program, names [i], &err);
+        if (!CheckCLError (err))
+            return false;
+    }
+
+    return true;
+}
+
+
+// `event' keeps the launch for the timing
+bool LaunchKernel (cl::CommandQueue& queue, cl::Kernel& kernel, const char* name, const cl::NDRange& global, const cl::NDRange& local,
+    cl::Event* event = nullptr, const cl::NDRange& offset = cl::NullRange)
+{
+    cl::Event launched;
+    if (!CheckCLError (queue.enqueueNDRangeKernel (kernel, offset, global, local, nullptr, &launched)))
+        return false;
+
+    profiler.Add (name, launched);
+    if (event != nullptr)
+        *event = launched;
+
+    return true;
+}
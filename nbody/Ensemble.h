@@ -0,0 +1,328 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include "../Common.h"
+#include "../Runtime.h"
+
+// Ensembles: many small independent systems advanced by one launch for parameter studies. The bodies
+// of all systems are stored one system after the other, each system has its offset, its body count
+// and its own G, softening and time step. One work-group advances one system, the work-items share
+// the bodies of the system and stage the positions through local memory.
+//
+// The systems are read from a text file, one system per line: <bodies> <G> <softening> <time step>,
+// lines starting with '#' are comments.
+const char* ENSEMBLE_KERNEL_SOURCE = STRINGIFY (
+    // systems: offset and body count, parameters: G, softening, time step
+    __kernel
+    void EnsembleKernel (__global const float4* particles, __global float4* updated, __global const int2* systems,
+        __global const float4* parameters, __local float2* tile)
+    {
+        int lid = get_local_id (0);
+        int size = get_local_size (0);
+        int2 range = systems [get_group_id (0)];
+        float4 p = parameters [get_group_id (0)];
+        float eps2 = p.y * p.y;
+
+        __global const float4* bodies = particles + range.x;
+
+        // every work-item runs the same number of iterations, the barriers are reached by all of them
+        for (int base = 0; base < range.y; base += size)
+        {
+            int i = base + lid;
+            float4 body = i < range.y ? bodies [i] : (float4) (0.0f);
+
+            float2 F = (float2) (0.0f, 0.0f);
+            for (int start = 0; start < range.y; start += size)
+            {
+                int j = start + lid;
+                tile [lid] = j < range.y ? bodies [j].xy : (float2) (0.0f);
+                barrier (CLK_LOCAL_MEM_FENCE);
+
+                // the body itself is skipped, without softening its term would be 0 / 0
+                int count = min (size, range.y - start);
+                for (int k = 0; k < count; ++k)
+                {
+                    float2 r = tile [k] - body.xy;
+                    if (start + k != i)
+                        F += r / pow (dot (r, r) + eps2, 1.5f);
+                }
+                barrier (CLK_LOCAL_MEM_FENCE);
+            }
+
+            if (i < range.y)
+            {
+                float2 vel = body.zw + p.x * F * p.z;
+                float2 pos = body.xy + vel * p.z;
+                updated [range.x + i] = (float4) (pos, vel);
+            }
+        }
+    }
+
+    // total energy of each system (unit masses), the work-items sum their bodies and the first one the work-items
+    __kernel
+    void EnsembleEnergy (__global const float4* particles, __global const int2* systems, __global const float4* parameters,
+        __local float* partial, __global float* energies)
+    {
+        int lid = get_local_id (0);
+        int size = get_local_size (0);
+        int2 range = systems [get_group_id (0)];
+        float4 p = parameters [get_group_id (0)];
+        float eps2 = p.y * p.y;
+
+        __global const float4* bodies = particles + range.x;
+
+        float e = 0.0f;
+        for (int i = lid; i < range.y; i += size)
+        {
+            float4 body = bodies [i];
+            float potential = 0.0f;
+            for (int j = 0; j < range.y; ++j)
+            {
+                if (j != i)
+                {
+                    float2 r = bodies [j].xy - body.xy;
+                    potential -= rsqrt (dot (r, r) + eps2);
+                }
+            }
+            e += 0.5f * dot (body.zw, body.zw) + 0.5f * p.x * potential;
+        }
+        partial [lid] = e;
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        if (lid == 0)
+        {
+            float sum = 0.0f;
+            for (int i = 0; i < size; ++i)
+                sum += partial [i];
+            energies [get_group_id (0)] = sum;
+        }
+    }
+);
+
+
+struct EnsembleSystem
+{
+    int bodies;
+    float gravity;
+    float softening;
+    float timeStep;
+};
+
+
+bool ReadEnsembleFile (const std::string& path, std::vector<EnsembleSystem>& systems)
+{
+    std::ifstream in (path.c_str ());
+    if (!in)
+    {
+        std::cerr << "Unable to open ensemble `" << path << "'\n";
+        return false;
+    }
+
+    std::string line;
+    for (int number = 1; std::getline (in, line); ++number)
+    {
+        std::istringstream ss (line);
+        EnsembleSystem system;
+        if (line.empty () || line [0] == '#' || !(ss >> std::ws) || ss.eof ())
+            continue;
+
+        if (!(ss >> system.bodies >> system.gravity >> system.softening >> system.timeStep) || system.bodies < 1)
+        {
+            std::cerr << path << ':' << number << ": expected <bodies> <G> <softening> <time step>\n";
+            return false;
+        }
+        systems.push_back (system);
+    }
+
+    if (systems.empty ())
+        std::cerr << "The ensemble `" << path << "' has no systems\n";
+
+    return !systems.empty ();
+}
+
+
+// Runs `steps' steps of every system, `particles' holds the initial state of all systems one after
+// the other and gets the final one. The energy drift of each system is printed at the end.
+class Ensemble
+{
+public:
+    Ensemble () : program (nullptr), stepKernel (nullptr), energyKernel (nullptr), localSize (1), bodyCount (0) {}
+
+    ~Ensemble ()
+    {
+        if (energyKernel != nullptr)
+            clReleaseKernel (energyKernel);
+        if (stepKernel != nullptr)
+            clReleaseKernel (stepKernel);
+        if (program != nullptr)
+            clReleaseProgram (program);
+    }
+
+    bool Init (const Runtime& runtime, const std::vector<EnsembleSystem>& ensemble)
+    {
+        systems = ensemble;
+        program = BuildProgram (runtime, ENSEMBLE_KERNEL_SOURCE, nullptr);
+        if (program == nullptr)
+            return false;
+
+        cl_int err = CL_SUCCESS;
+        stepKernel = clCreateKernel (program, "EnsembleKernel", &err);
+        if (!CheckCLError (err))
+            return false;
+
+        energyKernel = clCreateKernel (program, "EnsembleEnergy", &err);
+        if (!CheckCLError (err))
+            return false;
+
+        std::vector<cl_int2> ranges (systems.size ());
+        std::vector<cl_float4> parameters (systems.size ());
+        int largest = 0;
+        bodyCount = 0;
+        for (size_t s = 0; s < systems.size (); ++s)
+        {
+            ranges [s].s [0] = static_cast<cl_int> (bodyCount);
+            ranges [s].s [1] = systems [s].bodies;
+            parameters [s].s [0] = systems [s].gravity;
+            parameters [s].s [1] = systems [s].softening;
+            parameters [s].s [2] = systems [s].timeStep;
+            parameters [s].s [3] = 0.0f;
+            bodyCount += systems [s].bodies;
+            largest = std::max (largest, systems [s].bodies);
+        }
+
+        // a work-group as large as the largest system, in whole wavefronts, within the limit of the device
+        size_t maxLocal = 1;
+        clGetKernelWorkGroupInfo (stepKernel, runtime.device (), CL_KERNEL_WORK_GROUP_SIZE, sizeof (maxLocal), &maxLocal, nullptr);
+        localSize = std::max<size_t> (1, std::min<size_t> (std::min<size_t> (maxLocal, 256), (largest + 31) / 32 * 32));
+
+        context = runtime.context;
+        rangeBuffer = cl::Buffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof (cl_int2) * ranges.size (), &ranges [0], &err);
+        if (err != CL_SUCCESS)
+            return CheckCLError (err);
+
+        parameterBuffer = cl::Buffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof (cl_float4) * parameters.size (), &parameters [0], &err);
+        if (err != CL_SUCCESS)
+            return CheckCLError (err);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            state [i] = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_float4) * bodyCount, nullptr, &err);
+            if (err != CL_SUCCESS)
+                return CheckCLError (err);
+        }
+
+        energyBuffer = cl::Buffer (context, CL_MEM_WRITE_ONLY, sizeof (cl_float) * systems.size (), nullptr, &err);
+
+        return CheckCLError (err);
+    }
+
+    size_t BodyCount () const
+    {
+        return bodyCount;
+    }
+
+    bool Run (cl::CommandQueue& queue, std::vector<cl_float4>& particles, int steps)
+    {
+        if (particles.size () != bodyCount
+            || queue.enqueueWriteBuffer (state [0], true, 0, sizeof (cl_float4) * bodyCount, &particles [0]) != CL_SUCCESS)
+            return false;
+
+        std::vector<cl_float> initial;
+        if (!Energies (queue, state [0], initial))
+            return false;
+
+        const size_t global = systems.size () * localSize;
+        std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now ();
+
+        // the steps go back-to-back, flushed now and then, so the device never runs dry
+        for (int step = 0; step < steps; ++step)
+        {
+            cl_mem from = state [step % 2] ();
+            cl_mem to = state [(step + 1) % 2] ();
+            cl_int err = clSetKernelArg (stepKernel, 0, sizeof (cl_mem), &from);
+            err |= clSetKernelArg (stepKernel, 1, sizeof (cl_mem), &to);
+            err |= clSetKernelArg (stepKernel, 2, sizeof (cl_mem), &rangeBuffer ());
+            err |= clSetKernelArg (stepKernel, 3, sizeof (cl_mem), &parameterBuffer ());
+            err |= clSetKernelArg (stepKernel, 4, sizeof (cl_float2) * localSize, nullptr);
+            if (!CheckCLError (err))
+                return false;
+
+            cl_event event = nullptr;
+            err = clEnqueueNDRangeKernel (queue (), stepKernel, 1, nullptr, &global, &localSize, 0, nullptr, profiler.Track (&event));
+            if (!CheckCLError (err))
+                return false;
+            profiler.Add ("EnsembleKernel", event);
+
+            if (step % 64 == 63)
+            {
+                queue.flush ();
+                profiler.Collect ();
+            }
+        }
+
+        if (queue.finish () != CL_SUCCESS)
+            return false;
+        const double seconds = std::chrono::duration<double> (std::chrono::high_resolution_clock::now () - begin).count ();
+
+        const cl::Buffer& last = state [steps % 2];
+        std::vector<cl_float> final;
+        if (!Energies (queue, last, final)
+            || queue.enqueueReadBuffer (last, true, 0, sizeof (cl_float4) * bodyCount, &particles [0]) != CL_SUCCESS)
+            return false;
+
+        double interactions = 0.0;
+        std::cout << "system  bodies           G   softening   time step        E(0)        E(t)   rel. drift\n";
+        for (size_t s = 0; s < systems.size (); ++s)
+        {
+            const EnsembleSystem& system = systems [s];
+            const double drift = initial [s] != 0.0f ? (final [s] - initial [s]) / std::fabs (initial [s]) : 0.0;
+            char row [160];
+            snprintf (row, sizeof (row), "%6zu %7d %11.4g %11.4g %11.4g %11.4g %11.4g %12.4g\n",
+                s, system.bodies, system.gravity, system.softening, system.timeStep, initial [s], final [s], drift);
+            std::cout << row;
+            interactions += static_cast<double> (system.bodies) * system.bodies * steps;
+        }
+        std::cout << systems.size () << " systems, " << bodyCount << " bodies, " << steps << " steps in " << seconds << " s, "
+            << interactions / seconds * 1.0e-9 << " billion interactions/s" << std::endl;
+
+        return true;
+    }
+
+private:
+    bool Energies (cl::CommandQueue& queue, const cl::Buffer& particles, std::vector<cl_float>& energies)
+    {
+        cl_mem source = particles ();
+        cl_int err = clSetKernelArg (energyKernel, 0, sizeof (cl_mem), &source);
+        err |= clSetKernelArg (energyKernel, 1, sizeof (cl_mem), &rangeBuffer ());
+        err |= clSetKernelArg (energyKernel, 2, sizeof (cl_mem), &parameterBuffer ());
+        err |= clSetKernelArg (energyKernel, 3, sizeof (cl_float) * localSize, nullptr);
+        err |= clSetKernelArg (energyKernel, 4, sizeof (cl_mem), &energyBuffer ());
+        if (!CheckCLError (err))
+            return false;
+
+        const size_t global = systems.size () * localSize;
+        cl_event event = nullptr;
+        err = clEnqueueNDRangeKernel (queue (), energyKernel, 1, nullptr, &global, &localSize, 0, nullptr, profiler.Track (&event));
+        if (!CheckCLError (err))
+            return false;
+        profiler.Add ("EnsembleEnergy", event);
+
+        energies.resize (systems.size ());
+
+        return queue.enqueueReadBuffer (energyBuffer, true, 0, sizeof (cl_float) * energies.size (), &energies [0]) == CL_SUCCESS;
+    }
+
+    std::vector<EnsembleSystem> systems;
+    cl::Context context;
+    cl_program program;
+    cl_kernel stepKernel;
+    cl_kernel energyKernel;
+    cl::Buffer rangeBuffer;
+    cl::Buffer parameterBuffer;
+    cl::Buffer energyBuffer;
+    cl::Buffer state [2];
+    size_t localSize;
+    size_t bodyCount;
+};
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "../Common.h"
+#include "../Runtime.h"
+#include "DeviceStage.h"
+#include "RadixTree.h"
+
+// Fast multipole method on the binary radix tree of the bodies (see RadixTree.h), built on the device
+// every step, so nothing is read back. The potential of the simulation is the softened 1 / r of three
+// dimensions restricted to the plane, so the expansions are Cartesian Taylor series in x and y up to
+// FMM_ORDER (the complex series of the two-dimensional FMM belong to the logarithm). Coefficient (a, b)
+// of a series is at a + b = n: n (n + 1) / 2 + b. The derivatives of the kernel come from the Hermite
+// recurrence of McMurchie and Davidson.
+//
+// The cells of the FMM are the nodes of the tree down to the first ones with at most FMM_LEAF bodies,
+// its leaves. The expansions are about the centres of mass of the nodes, a cell reaches from there to
+// the farthest corner of its box. A pair of cells whose radii are below theta times the distance of
+// their centres interacts through M2L, a pair of leaves otherwise directly; of the other pairs the larger
+// cell is opened (the dual tree walk). Every cell walks the pairs of its ancestors for its own sources,
+// so the walk needs no lists: the multipoles go up the tree like the reduction of the tree, the M2L runs
+// over the cells and every body evaluates the locals of the cells above it and walks the pairs of its
+// leaf again for the direct pulls.
+//
+// In the periodic box (see Periodic.h) a pair of cells is taken at the nearest image of their centres.
+// The bodies of a pair of leaves pull as in the direct sum, at their nearest images and with the Ewald
+// table for the other ones. A far cell pulls through the M2L of the block of its four images around the
+// target, the nearest one and the next ones along x and y, and on every body with the table correction
+// of all the others at its centre of mass: they are at least a box away, where that field is smooth.
+const int FMM_MAX_ORDER = 8;
+
+// built with the simulation constants, FMM_ORDER, FMM_TERMS = (FMM_ORDER + 1) (FMM_ORDER + 2) / 2,
+// FMM_LEAF, FMM_THETA, PERIODIC and EWALD_SIZE
+const char* FMM_KERNEL_SOURCE = STRINGIFY (
+    int Term (int a, int b)
+    {
+        int n = a + b;
+        return n * (n + 1) / 2 + b;
+    }
+
+    // x^a / a! and y^b / b! up to the order
+    void ScaledPowers (float2 v, float* px, float* py)
+    {
+        px [0] = 1.0f;
+        py [0] = 1.0f;
+        for (int a = 1; a <= FMM_ORDER; ++a)
+        {
+            px [a] = px [a - 1] * v.x / a;
+            py [a] = py [a - 1] * v.y / a;
+        }
+    }
+
+    // the derivatives of 1 / sqrt (r^2 + eps^2) at r: the Hermite recurrence is run from the highest
+    // auxiliary function down, each pass overwrites the orders it no longer needs
+    void Derivatives (float2 r, float* D)
+    {
+        float inverse = rsqrt (dot (r, r) + eps * eps);
+        float inverse2 = inverse * inverse;
+
+        float g [FMM_ORDER + 1];
+        g [0] = inverse;
+        for (int n = 1; n <= FMM_ORDER; ++n)
+            g [n] = -(2 * n - 1) * inverse2 * g [n - 1];
+
+        D [0] = g [FMM_ORDER];
+        for (int n = FMM_ORDER - 1; n >= 0; --n)
+        {
+            for (int s = FMM_ORDER - n; s >= 1; --s)
+            {
+                for (int u = 0; u <= s; ++u)
+                {
+                    int t = s - u;
+                    if (t > 0)
+                        D [Term (t, u)] = (t >= 2 ? (t - 1) * D [Term (t - 2, u)] : 0.0f) + r.x * D [Term (t - 1, u)];
+                    else
+                        D [Term (0, u)] = (u >= 2 ? (u - 1) * D [Term (0, u - 2)] : 0.0f) + r.y * D [Term (0, u - 1)];
+                }
+            }
+            D [0] = g [n];
+        }
+    }
+
+    // the softened pull of a unit mass at r
+    float2 Pull (float2 r)
+    {
+        float inverse = rsqrt (dot (r, r) + eps * eps);
+        return r * (inverse * inverse * inverse);
+    }
+
+    float2 NearestImage (float2 r)
+    {
+        return PERIODIC ? r - round (r) : r;
+    }
+
+    // the pull of the other images of a unit mass at its nearest image r, from the table of Periodic.h
+    float2 EwaldImages (float2 r, __constant float2* ewald)
+    {
+        float2 t = (r + 0.5f) * (EWALD_SIZE - 1);
+        float2 cell = clamp (floor (t), 0.0f, EWALD_SIZE - 2.0f);
+        float2 f = t - cell;
+        int i = (int) cell.x + (int) cell.y * EWALD_SIZE;
+
+        return mix (mix (ewald [i], ewald [i + 1], f.x), mix (ewald [i + EWALD_SIZE], ewald [i + EWALD_SIZE + 1], f.x), f.y);
+    }
+
+    // the shift of image k of the block of a far source: the nearest image, the next one along x, along y
+    // and along both, towards `side'
+    float2 BlockShift (float2 side, int k)
+    {
+        return (float2) ((k & 1) != 0 ? side.x : 0.0f, (k & 2) != 0 ? side.y : 0.0f);
+    }
+
+    // the pull of the images of a unit mass at r outside its block towards `side': all of them less the block
+    float2 OuterImages (float2 r, float2 side, __constant float2* ewald)
+    {
+        float2 nearest = r - round (r);
+        float2 pull = Pull (nearest) + EwaldImages (nearest, ewald);
+        for (int k = 0; k < 4; ++k)
+            pull -= Pull (r + BlockShift (side, k));
+
+        return pull;
+    }
+
+    // the sorted bodies of a node, the range of its leaves
+    int2 NodeRange (__global const int2* ranges, int node, int BODY_NUM)
+    {
+        return node < BODY_NUM - 1 ? ranges [node] : (int2) (node - (BODY_NUM - 1));
+    }
+
+    bool IsLeafCell (__global const int2* ranges, int node, int BODY_NUM)
+    {
+        int2 range = NodeRange (ranges, node, BODY_NUM);
+        return range.y - range.x < FMM_LEAF;
+    }
+
+    // the root and the nodes below a cell that is not a leaf
+    bool IsCell (__global const int2* ranges, __global const int* parents, int node, int BODY_NUM)
+    {
+        return node == 0 || !IsLeafCell (ranges, parents [node], BODY_NUM);
+    }
+
+    float CellRadius (float4 centre, float4 box)
+    {
+        return length (fmax (box.zw - centre.xy, centre.xy - box.xy));
+    }
+
+    // the next source of cell `target' in the dual walk from the pair of the roots, 1 for an M2L, 2 for a
+    // pair of leaves, 3 for an M2L of a cell above `target' and 0 at the end; `far' gets the centre of the
+    // nearest image of a far source and the side of its block. Only the pairs of the cells above `target'
+    // are followed: their target is
+    // replaced by its child on the way to `target'. The stack grows only when a source is opened, so it
+    // is deeper than any path of a tree of 32 bit codes with 31 bit indices appended
+    int NextSource (__global const int2* children, __global const int2* ranges, __global const float4* centres,
+        __global const float4* boxes, const int BODY_NUM, int target, int2* stack, int* top, int* source, float4* far)
+    {
+        int first = NodeRange (ranges, target, BODY_NUM).x;
+        while (*top > 0)
+        {
+            int2 pair = stack [--*top];
+            float4 a = centres [pair.x];
+            float4 b = centres [pair.y];
+            float radiusA = CellRadius (a, boxes [pair.x]);
+            float radiusB = CellRadius (b, boxes [pair.y]);
+            float2 separation = NearestImage (a.xy - b.xy);
+            if (radiusA + radiusB < FMM_THETA * length (separation))
+            {
+                *source = pair.y;
+                *far = (float4) (a.xy - separation, separation.x < 0.0f ? -1.0f : 1.0f, separation.y < 0.0f ? -1.0f : 1.0f);
+                return pair.x == target ? 1 : 3;
+            }
+
+            bool leafA = IsLeafCell (ranges, pair.x, BODY_NUM);
+            bool leafB = IsLeafCell (ranges, pair.y, BODY_NUM);
+            if (leafA && leafB)
+            {
+                // a leaf above `target' is `target'
+                *source = pair.y;
+                return 2;
+            }
+
+            if (!leafA && (leafB || radiusA >= radiusB))
+            {
+                if (pair.x == target)
+                    continue;
+
+                int2 c = children [pair.x];
+                stack [(*top)++] = (int2) (NodeRange (ranges, c.y, BODY_NUM).x <= first ? c.y : c.x, pair.y);
+            }
+            else
+            {
+                int2 c = children [pair.y];
+                stack [(*top)++] = (int2) (pair.x, c.x);
+                stack [(*top)++] = (int2) (pair.x, c.y);
+            }
+        }
+
+        return 0;
+    }
+
+    // one work-item per node: the leaves take the multipoles of their bodies, then climb like ReduceRadixTree,
+    // the second child to arrive at a cell shifts the multipoles of both to it; the masses are the first
+    // components of the attributes
+    __kernel
+    void FmmUpward (__global const float4* particles, __global const float4* attributes, __global const int* leafBodies,
+        __global const int2* children, __global const int2* ranges, __global const int* parents, __global const float4* centres,
+        volatile __global float* multipoles, __global int* arrivals, const int BODY_NUM)
+    {
+        int node = get_global_id (0);
+        if (node >= 2 * BODY_NUM - 1 || !IsLeafCell (ranges, node, BODY_NUM) || !IsCell (ranges, parents, node, BODY_NUM))
+            return;
+
+        float M [FMM_TERMS];
+        for (int t = 0; t < FMM_TERMS; ++t)
+            M [t] = 0.0f;
+
+        float px [FMM_ORDER + 1];
+        float py [FMM_ORDER + 1];
+        int2 range = NodeRange (ranges, node, BODY_NUM);
+        for (int k = range.x; k <= range.y; ++k)
+        {
+            int body = leafBodies [k];
+            ScaledPowers (centres [node].xy - particles [body].xy, px, py);
+            float mass = attributes [body].x;
+            for (int n = 0; n <= FMM_ORDER; ++n)
+                for (int b = 0; b <= n; ++b)
+                    M [Term (n - b, b)] += mass * px [n - b] * py [b];
+        }
+
+        for (int t = 0; t < FMM_TERMS; ++t)
+            multipoles [node * FMM_TERMS + t] = M [t];
+
+        // a single body is the root, without a parent
+        node = node > 0 ? parents [node] : -1;
+        while (node >= 0)
+        {
+            // the multipoles of this child are visible before the second one can see the count
+            mem_fence (CLK_GLOBAL_MEM_FENCE);
+            if (atomic_inc (arrivals + node) == 0)
+                return;
+
+            for (int t = 0; t < FMM_TERMS; ++t)
+                M [t] = 0.0f;
+
+            int2 c = children [node];
+            for (int side = 0; side < 2; ++side)
+            {
+                int child = side == 0 ? c.x : c.y;
+                ScaledPowers (centres [node].xy - centres [child].xy, px, py);
+
+                for (int n = 0; n <= FMM_ORDER; ++n)
+                {
+                    for (int b = 0; b <= n; ++b)
+                    {
+                        int a = n - b;
+                        float sum = 0.0f;
+                        for (int i = 0; i <= a; ++i)
+                            for (int j = 0; j <= b; ++j)
+                                sum += multipoles [child * FMM_TERMS + Term (i, j)] * px [a - i] * py [b - j];
+                        M [Term (a, b)] += sum;
+                    }
+                }
+            }
+
+            for (int t = 0; t < FMM_TERMS; ++t)
+                multipoles [node * FMM_TERMS + t] = M [t];
+
+            node = parents [node];
+        }
+    }
+
+    // the local expansion of a cell from the multipoles of its far sources, the terms up to the order in all;
+    // it holds only the sources of the cell itself, the cells above it keep theirs. In the periodic box a
+    // source is taken at the block of its images
+    __kernel
+    void FmmM2L (__global const int2* children, __global const int2* ranges, __global const int* parents, __global const float4* centres,
+        __global const float4* boxes, __global const float* multipoles, __global float* locals, const int BODY_NUM)
+    {
+        int target = get_global_id (0);
+        if (target >= 2 * BODY_NUM - 1 || !IsCell (ranges, parents, target, BODY_NUM))
+            return;
+
+        float L [FMM_TERMS];
+        for (int t = 0; t < FMM_TERMS; ++t)
+            L [t] = 0.0f;
+
+        float D [FMM_TERMS];
+        int2 stack [72];
+        int top = 0;
+        stack [top++] = (int2) (0, 0);
+        int source = 0;
+        float4 far = (float4) (0.0f);
+        int kind = 0;
+        while ((kind = NextSource (children, ranges, centres, boxes, BODY_NUM, target, stack, &top, &source, &far)) != 0)
+        {
+            if (kind != 1)
+                continue;
+
+            __global const float* M = multipoles + source * FMM_TERMS;
+            for (int k = 0; k < (PERIODIC ? 4 : 1); ++k)
+            {
+                Derivatives (centres [target].xy - far.xy - BlockShift (far.zw, k), D);
+
+                for (int n = 0; n <= FMM_ORDER; ++n)
+                {
+                    for (int b = 0; b <= n; ++b)
+                    {
+                        float sum = 0.0f;
+                        for (int m = 0; m <= FMM_ORDER - n; ++m)
+                            for (int j = 0; j <= m; ++j)
+                                sum += M [Term (m - j, j)] * D [Term (n - b + m - j, b + j)];
+                        L [Term (n - b, b)] += sum;
+                    }
+                }
+            }
+        }
+
+        for (int t = 0; t < FMM_TERMS; ++t)
+            locals [target * FMM_TERMS + t] = L [t];
+    }
+
+    // one work-item per sorted body: the gradients of the locals of its leaf and the cells above it, which
+    // take the place of the L2L, and the direct pulls of the leaves its leaf meets in the walk; in the
+    // periodic box the far cells of the walk add the pulls of their images outside the blocks
+    __kernel
+    void FmmL2P (__global const float4* particles, __global const float4* attributes, __global const int* leafBodies,
+        __global const int2* children, __global const int2* ranges, __global const int* parents, __global const float4* centres,
+        __global const float4* boxes, __global const float* locals, __global float2* accelerations, const int BODY_NUM,
+        __constant float2* ewald)
+    {
+        int k = get_global_id (0);
+        if (k >= BODY_NUM)
+            return;
+
+        int body = leafBodies [k];
+        float2 position = particles [body].xy;
+
+        int leaf = BODY_NUM - 1 + k;
+        while (leaf > 0 && IsLeafCell (ranges, parents [leaf], BODY_NUM))
+            leaf = parents [leaf];
+
+        float px [FMM_ORDER + 1];
+        float py [FMM_ORDER + 1];
+        float2 F = (float2) (0.0f, 0.0f);
+        for (int cell = leaf; cell >= 0; cell = cell > 0 ? parents [cell] : -1)
+        {
+            ScaledPowers (position - centres [cell].xy, px, py);
+            __global const float* L = locals + cell * FMM_TERMS;
+            for (int n = 1; n <= FMM_ORDER; ++n)
+            {
+                for (int b = 0; b <= n; ++b)
+                {
+                    int a = n - b;
+                    float l = L [Term (a, b)];
+                    if (a > 0)
+                        F.x += l * px [a - 1] * py [b];
+                    if (b > 0)
+                        F.y += l * px [a] * py [b - 1];
+                }
+            }
+        }
+
+        int2 stack [72];
+        int top = 0;
+        stack [top++] = (int2) (0, 0);
+        int source = 0;
+        float4 far = (float4) (0.0f);
+        int kind = 0;
+        while ((kind = NextSource (children, ranges, centres, boxes, BODY_NUM, leaf, stack, &top, &source, &far)) != 0)
+        {
+            if (kind != 2)
+            {
+                if (PERIODIC)
+                    F += OuterImages (far.xy - position, far.zw, ewald) * centres [source].z;
+                continue;
+            }
+
+            int2 range = NodeRange (ranges, source, BODY_NUM);
+            for (int s = range.x; s <= range.y; ++s)
+            {
+                int other = leafBodies [s];
+                if (other == body)
+                    continue;
+
+                float2 r = NearestImage (particles [other].xy - position);
+                float2 pull = PERIODIC ? Pull (r) + EwaldImages (r, ewald) : Pull (r);
+                F += pull * attributes [other].x;
+            }
+        }
+
+        accelerations [body] = F * G;
+    }
+
+    __kernel
+    void FmmAdvance (__global const float4* particles, __global float4* updated, __global const float2* accelerations, const int BODY_NUM)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        float2 vel = particles [id].zw + accelerations [id] * dt;
+        float2 pos = particles [id].xy + vel * dt;
+        if (PERIODIC)
+            pos -= floor (pos);
+
+        updated [id] = (float4) (pos, vel);
+    }
+);
+
+
+// The accelerations of the FMM and the steps integrated with them. The tree and all the phases run on the
+// device behind the commands of the previous step.
+class Fmm
+{
+public:
+    Fmm () : terms (0) {}
+
+    // `prefix' and `options' bring the simulation constants dt, G and eps, the accessors of the float
+    // particles, PERIODIC and EWALD_SIZE, the tree is built with them as well; `ewald' is the correction
+    // table of the periodic box (see Periodic.h)
+    bool Init (const Runtime& runtime, size_t bodies, int order, double theta, int leafSize, const std::string& prefix,
+        const std::string& options, const cl::Buffer& ewald)
+    {
+        order = std::max (1, std::min (FMM_MAX_ORDER, order));
+        terms = (order + 1) * (order + 2) / 2;
+        context = runtime.context;
+        ewaldBuffer = ewald;
+
+        std::ostringstream fmmOptions;
+        fmmOptions << options << " -DFMM_ORDER=" << order << " -DFMM_TERMS=" << terms << " -DFMM_LEAF=" << std::max (1, leafSize)
+            << " -DFMM_THETA=" << std::setprecision (9) << theta << "f";
+        program = BuildStageProgram (runtime, prefix, FMM_KERNEL_SOURCE, fmmOptions.str ());
+        if (program () == nullptr)
+            return false;
+
+        cl::Kernel* kernels [] = { &upwardKernel, &m2lKernel, &l2pKernel, &advanceKernel };
+        const char* names [] = { "FmmUpward", "FmmM2L", "FmmL2P", "FmmAdvance" };
+        if (!CreateKernels (program, kernels, names, 4) || !tree.Init (runtime, bodies, prefix, options))
+            return false;
+
+        const size_t nodes = RadixTree::NodeCount (bodies);
+        cl::Buffer* buffers [] = { &multipoleBuffer, &localBuffer, &arrivalBuffer, &accelerationBuffer };
+        const size_t bytes [] = { sizeof (cl_float) * terms * nodes, sizeof (cl_float) * terms * nodes,
+            sizeof (cl_int) * std::max<size_t> (1, bodies - 1), sizeof (cl_float2) * bodies };
+        for (int i = 0; i < 4; ++i)
+        {
+            cl_int err = CL_SUCCESS;
+            *buffers [i] = cl::Buffer (context, CL_MEM_READ_WRITE, bytes [i], nullptr, &err);
+            if (!CheckCLError (err))
+                return false;
+        }
+
+        return true;
+    }
+
+    // the accelerations of the first `bodyCount' float bodies in `particles' with the masses of `attributes'
+    // into AccelerationBuffer (), `first' gets the first command of the tree
+    bool Accelerations (cl::CommandQueue& queue, const cl::Buffer& particles, const cl::Buffer& attributes, size_t bodyCount,
+        cl::Event* first = nullptr)
+    {
+        if (!tree.Build (queue, particles, attributes, bodyCount, treeFirst, treeLast))
+            return false;
+
+        if (first != nullptr)
+            *first = treeFirst;
+
+        const cl_int bodies = static_cast<cl_int> (bodyCount);
+        const size_t nodes = RadixTree::NodeCount (bodyCount);
+
+        cl_int err = upwardKernel.setArg (0, particles);
+        err |= upwardKernel.setArg (1, attributes);
+        err |= upwardKernel.setArg (2, tree.Bodies ());
+        err |= upwardKernel.setArg (3, tree.Children ());
+        err |= upwardKernel.setArg (4, tree.Ranges ());
+        err |= upwardKernel.setArg (5, tree.Parents ());
+        err |= upwardKernel.setArg (6, tree.Centres ());
+        err |= upwardKernel.setArg (7, multipoleBuffer);
+        err |= upwardKernel.setArg (8, arrivalBuffer);
+        err |= upwardKernel.setArg (9, bodies);
+
+        err |= m2lKernel.setArg (0, tree.Children ());
+        err |= m2lKernel.setArg (1, tree.Ranges ());
+        err |= m2lKernel.setArg (2, tree.Parents ());
+        err |= m2lKernel.setArg (3, tree.Centres ());
+        err |= m2lKernel.setArg (4, tree.Boxes ());
+        err |= m2lKernel.setArg (5, multipoleBuffer);
+        err |= m2lKernel.setArg (6, localBuffer);
+        err |= m2lKernel.setArg (7, bodies);
+
+        err |= l2pKernel.setArg (0, particles);
+        err |= l2pKernel.setArg (1, attributes);
+        err |= l2pKernel.setArg (2, tree.Bodies ());
+        err |= l2pKernel.setArg (3, tree.Children ());
+        err |= l2pKernel.setArg (4, tree.Ranges ());
+        err |= l2pKernel.setArg (5, tree.Parents ());
+        err |= l2pKernel.setArg (6, tree.Centres ());
+        err |= l2pKernel.setArg (7, tree.Boxes ());
+        err |= l2pKernel.setArg (8, localBuffer);
+        err |= l2pKernel.setArg (9, accelerationBuffer);
+        err |= l2pKernel.setArg (10, bodies);
+        err |= l2pKernel.setArg (11, ewaldBuffer);
+        if (!CheckCLError (err)
+            || !CheckCLError (queue.enqueueFillBuffer (arrivalBuffer, cl_int (0), 0, sizeof (cl_int) * std::max<size_t> (1, bodyCount - 1))))
+            return false;
+
+        return LaunchKernel (queue, upwardKernel, "FmmUpward", cl::NDRange (nodes), cl::NullRange)
+            && LaunchKernel (queue, m2lKernel, "FmmM2L", cl::NDRange (nodes), cl::NullRange)
+            && LaunchKernel (queue, l2pKernel, "FmmL2P", cl::NDRange (bodyCount), cl::NullRange);
+    }
+
+    // one step of `particles' into `updated', the first and the last command of the step are kept for the timing
+    bool Step (cl::CommandQueue& queue, const cl::Buffer& particles, const cl::Buffer& attributes, const cl::Buffer& updated,
+        size_t bodyCount, cl::Event& first, cl::Event& last)
+    {
+        if (!Accelerations (queue, particles, attributes, bodyCount, &first))
+            return false;
+
+        cl_int err = advanceKernel.setArg (0, particles);
+        err |= advanceKernel.setArg (1, updated);
+        err |= advanceKernel.setArg (2, accelerationBuffer);
+        err |= advanceKernel.setArg (3, static_cast<cl_int> (bodyCount));
+
+        return CheckCLError (err) && LaunchKernel (queue, advanceKernel, "FmmAdvance", cl::NDRange (bodyCount), cl::NullRange, &last);
+    }
+
+    const cl::Buffer& AccelerationBuffer () const
+    {
+        return accelerationBuffer;
+    }
+
+    // device time of the last tree, once its commands are done; 0 without profiling
+    double TreeSeconds () const
+    {
+        cl_ulong begin = 0;
+        cl_ulong end = 0;
+        if (treeFirst () == nullptr || treeFirst.getProfilingInfo (CL_PROFILING_COMMAND_START, &begin) != CL_SUCCESS
+            || treeLast.getProfilingInfo (CL_PROFILING_COMMAND_END, &end) != CL_SUCCESS)
+            return 0.0;
+
+        return (end - begin) * 1.0e-9;
+    }
+
+private:
+    int terms;
+    RadixTree tree;
+    cl::Event treeFirst;
+    cl::Event treeLast;
+
+    cl::Context context;
+    cl::Program program;
+    cl::Kernel upwardKernel;
+    cl::Kernel m2lKernel;
+    cl::Kernel l2pKernel;
+    cl::Kernel advanceKernel;
+
+    cl::Buffer multipoleBuffer;
+    cl::Buffer localBuffer;
+    cl::Buffer arrivalBuffer;
+    cl::Buffer accelerationBuffer;
+    cl::Buffer ewaldBuffer;
+};
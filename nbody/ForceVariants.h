@@ -0,0 +1,248 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include "../Common.h"
+
+// Variants of the force kernel. FORCE_VARIANT picks the inverse cube of the softened distance in the
+// kernel: 0 is length () and pow (), 1 is rsqrt () and 2 is native_rsqrt (); the build options of the
+// variant go to the compiler with it. Every variant is a program of its own, the relaxed math never
+// reaches the visualization.
+struct ForceVariant
+{
+    const char* name;
+    int kernel;                 // FORCE_VARIANT
+    const char* options;
+};
+
+const ForceVariant FORCE_VARIANTS [] = {
+    { "precise", 0, "" },
+    { "rsqrt",   1, "-cl-mad-enable" },
+    { "native",  2, "-cl-mad-enable" },
+    { "fast",    2, "-cl-fast-relaxed-math" }
+};
+
+const int FORCE_VARIANT_COUNT = sizeof (FORCE_VARIANTS) / sizeof (FORCE_VARIANTS [0]);
+
+
+// returns the variant of the name, or -1 after listing the known ones
+int ParseForceVariant (const std::string& name)
+{
+    for (int i = 0; i < FORCE_VARIANT_COUNT; ++i)
+        if (name == FORCE_VARIANTS [i].name)
+            return i;
+
+    std::cerr << "Unknown force variant `" << name << "', the variants are:";
+    for (int i = 0; i < FORCE_VARIANT_COUNT; ++i)
+        std::cerr << ' ' << FORCE_VARIANTS [i].name;
+    std::cerr << '\n';
+
+    return -1;
+}
+
+
+// Precision modes of the force program, its types come in as build options. The state is what the
+// simulation buffers hold, the pull of a pair is computed in the real type and summed in the sum type,
+// optionally with Kahan compensation. A double state is mirrored into the float buffers each step, the
+// visualization, the snapshots and the trajectories keep reading floats.
+struct Precision
+{
+    const char* name;
+    const char* state;
+    const char* real;
+    const char* sum;
+    bool kahan;
+};
+
+const Precision PRECISIONS [] = {
+    { "float",  "float",  "float",  "float",  false },
+    { "kahan",  "float",  "float",  "float",  true },
+    { "mixed",  "float",  "float",  "double", false },
+    { "double", "double", "double", "double", false }
+};
+
+const int PRECISION_COUNT = sizeof (PRECISIONS) / sizeof (PRECISIONS [0]);
+
+const char* FP64_PRAGMA = "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+
+// the accessors of a double state, the kernels load and store the state through LOAD_STATE and STORE_STATE
+const char* DOUBLE_STATE_SOURCE = STRINGIFY (
+    double4 LoadDouble (size_t i, __global const double4* p) { return p [i]; }
+    void StoreDouble (double4 v, size_t i, __global double4* p) { p [i] = v; }
+);
+
+
+bool NeedsDouble (const Precision& precision)
+{
+    return strcmp (precision.state, "double") == 0 || strcmp (precision.real, "double") == 0 || strcmp (precision.sum, "double") == 0;
+}
+
+
+bool DoubleState (const Precision& precision)
+{
+    return strcmp (precision.state, "double") == 0;
+}
+
+
+size_t SumBytes (const Precision& precision)
+{
+    return strcmp (precision.sum, "double") == 0 ? sizeof (cl_double2) : sizeof (cl_float2);
+}
+
+
+size_t RealBytes (const Precision& precision)
+{
+    return strcmp (precision.real, "double") == 0 ? sizeof (cl_double) : sizeof (cl_float);
+}
+
+
+// native_rsqrt has no double overload, a double pull takes rsqrt; a float state is the particle buffers
+std::string PrecisionOptions (const Precision& precision)
+{
+    std::ostringstream options;
+    if (DoubleState (precision))
+        options << "-DSTATE_MEMORY=double4 -DLOAD_STATE=LoadDouble -DSTORE_STATE=StoreDouble ";
+    else
+        options << "-DSTATE_MEMORY=PARTICLE_MEMORY -DLOAD_STATE=LOAD_PARTICLE -DSTORE_STATE=STORE_PARTICLE ";
+
+    options << "-DSTATE=" << precision.state << "4 -DSTATE2=" << precision.state << "2"
+        << " -DCONVERT_STATE=convert_" << precision.state << "4 -DCONVERT_STATE2=convert_" << precision.state << "2"
+        << " -DREAL=" << precision.real << " -DREAL2=" << precision.real << "2 -DCONVERT_REAL2=convert_" << precision.real << "2"
+        << " -DSUM2=" << precision.sum << "2 -DCONVERT_SUM2=convert_" << precision.sum << "2"
+        << " -DKAHAN=" << (precision.kahan ? 1 : 0) << " -DMIRROR=" << (DoubleState (precision) ? 1 : 0)
+        << " -DNATIVE_RSQRT=" << (strcmp (precision.real, "double") == 0 ? "rsqrt" : "native_rsqrt");
+
+    return options.str ();
+}
+
+
+// returns the precision of the name, or -1 after listing the known ones
+int ParsePrecision (const std::string& name)
+{
+    for (int i = 0; i < PRECISION_COUNT; ++i)
+        if (name == PRECISIONS [i].name)
+            return i;
+
+    std::cerr << "Unknown precision `" << name << "', the precisions are:";
+    for (int i = 0; i < PRECISION_COUNT; ++i)
+        std::cerr << ' ' << PRECISIONS [i].name;
+    std::cerr << '\n';
+
+    return -1;
+}
+
+
+// Storage of the particle buffers. A half body takes 8 bytes instead of 16: the kernels load and store
+// the bodies with vload_half4 and vstore_half4 and compute in float. Meant for runs that are only
+// watched, the snapshots and the trajectories take float bodies.
+const char* FLOAT_PARTICLE_SOURCE = STRINGIFY (
+    float4 LoadParticle (size_t i, __global const float4* p) { return p [i]; }
+    void StoreParticle (float4 v, size_t i, __global float4* p) { p [i] = v; }
+);
+
+
+std::string StorageOptions (bool half)
+{
+    return half ? "-DPARTICLE_MEMORY=half -DLOAD_PARTICLE=vload_half4 -DSTORE_PARTICLE=vstore_half4"
+        : "-DPARTICLE_MEMORY=float4 -DLOAD_PARTICLE=LoadParticle -DSTORE_PARTICLE=StoreParticle";
+}
+
+
+// the accessors of the particle buffers, the half ones are built in
+std::string StorageSource (bool half)
+{
+    return half ? "" : FLOAT_PARTICLE_SOURCE;
+}
+
+
+size_t ParticleBytes (bool half)
+{
+    return half ? 4 * sizeof (cl_half) : sizeof (cl_float4);
+}
+
+
+// The double precision reference of the accuracy check, the same softened sum as the kernels
+// (unit masses, the body itself left out).
+void ReferenceAcceleration (const std::vector<cl_float4>& bodies, size_t i, double gravity, double softening, double acceleration [2])
+{
+    const double eps2 = softening * softening;
+    double ax = 0.0;
+    double ay = 0.0;
+
+    for (size_t j = 0; j < bodies.size (); ++j)
+    {
+        if (j == i)
+            continue;
+
+        const double dx = static_cast<double> (bodies [j].s [0]) - bodies [i].s [0];
+        const double dy = static_cast<double> (bodies [j].s [1]) - bodies [i].s [1];
+        const double d2 = dx * dx + dy * dy + eps2;
+        const double inverseCube = 1.0 / (d2 * std::sqrt (d2));
+        ax += dx * inverseCube;
+        ay += dy * inverseCube;
+    }
+
+    acceleration [0] = gravity * ax;
+    acceleration [1] = gravity * ay;
+}
+
+
+// kinetic plus the softened potential energy, whose gradient is the force of the kernels
+double ReferenceEnergy (const std::vector<cl_float4>& bodies, double gravity, double softening)
+{
+    const double eps2 = softening * softening;
+    double kinetic = 0.0;
+    double potential = 0.0;
+
+    for (size_t i = 0; i < bodies.size (); ++i)
+    {
+        const double vx = bodies [i].s [2];
+        const double vy = bodies [i].s [3];
+        kinetic += 0.5 * (vx * vx + vy * vy);
+
+        for (size_t j = i + 1; j < bodies.size (); ++j)
+        {
+            const double dx = static_cast<double> (bodies [j].s [0]) - bodies [i].s [0];
+            const double dy = static_cast<double> (bodies [j].s [1]) - bodies [i].s [1];
+            potential -= 1.0 / std::sqrt (dx * dx + dy * dy + eps2);
+        }
+    }
+
+    return kinetic + gravity * potential;
+}
+
+
+// relative error of the accelerations of the sampled bodies against the reference
+struct AccelerationError
+{
+    double max;
+    double rms;
+};
+
+
+AccelerationError CompareAccelerations (const std::vector<cl_float2>& accelerations, const std::vector<size_t>& sample,
+    const std::vector<double>& reference)
+{
+    AccelerationError error = { 0.0, 0.0 };
+
+    for (size_t k = 0; k < sample.size (); ++k)
+    {
+        const double rx = reference [2 * k];
+        const double ry = reference [2 * k + 1];
+        const double dx = accelerations [sample [k]].s [0] - rx;
+        const double dy = accelerations [sample [k]].s [1] - ry;
+        const double magnitude = std::sqrt (rx * rx + ry * ry);
+
+        const double relative = std::sqrt (dx * dx + dy * dy) / std::max (magnitude, 1.0e-30);
+        error.max = std::max (error.max, relative);
+        error.rms += relative * relative;
+    }
+
+    if (!sample.empty ())
+        error.rms = std::sqrt (error.rms / sample.size ());
+
+    return error;
+}
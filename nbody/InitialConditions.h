@@ -0,0 +1,168 @@
+#pragma once
+
+#include "../Common.h"
+
+// Initial conditions generated on the device. Every body draws its random numbers from a counter
+// based generator (Philox4x32-10) keyed with the seed and counted by the body index, so the state
+// follows from the seed alone, independently of the number of work-items and of their order.
+// The systems are centred in the unit square, with G and the softening of the program. Every body gets
+// its attributes in a buffer of their own: mass, radius and type; the stars have unit masses, the radius
+// of a body is the radius of a unit mass times the cube root of its mass.
+enum InitialModel
+{
+    MODEL_UNIFORM,          // positions in the unit square, velocities in [-1, 1]
+    MODEL_PLUMMER,          // Plummer sphere, isotropic velocities of its local dispersion
+    MODEL_DISK,             // exponential disk on circular orbits of its rotation curve
+    MODEL_COLLISION,        // two disks on a collision course
+    MODEL_COLD,             // uniform disk at rest, the cold collapse
+    MODEL_BLACK_HOLE,       // exponential disk around a central black hole as heavy as all of its stars
+    MODEL_COUNT
+};
+
+const char* INITIAL_MODEL_NAMES [MODEL_COUNT] = { "uniform", "plummer", "disk", "collision", "cold", "blackhole" };
+
+
+// whether the bodies of the model have masses of their own
+bool HasVariableMasses (int model)
+{
+    return model == MODEL_BLACK_HOLE;
+}
+
+
+// returns the model of the name, or -1 after listing the known ones
+int ParseInitialModel (const std::string& name)
+{
+    for (int i = 0; i < MODEL_COUNT; ++i)
+        if (name == INITIAL_MODEL_NAMES [i])
+            return i;
+
+    std::cerr << "Unknown initial model `" << name << "', the models are:";
+    for (int i = 0; i < MODEL_COUNT; ++i)
+        std::cerr << ' ' << INITIAL_MODEL_NAMES [i];
+    std::cerr << '\n';
+
+    return -1;
+}
+
+
+// appended to the program after the simulation constants G and eps and the accessors of the particle
+// buffers; the model numbers follow InitialModel
+const char* INITIAL_CONDITIONS_SOURCE = STRINGIFY (
+    uint4 Philox (uint4 counter, uint2 key)
+    {
+        for (int round = 0; round < 10; ++round)
+        {
+            uint hi0 = mul_hi (0xD2511F53u, counter.x);
+            uint lo0 = 0xD2511F53u * counter.x;
+            uint hi1 = mul_hi (0xCD9E8D57u, counter.z);
+            uint lo1 = 0xCD9E8D57u * counter.z;
+            counter = (uint4) (hi1 ^ counter.y ^ key.x, lo1, hi0 ^ counter.w ^ key.y, lo0);
+            key += (uint2) (0x9E3779B9u, 0xBB67AE85u);
+        }
+
+        return counter;
+    }
+
+    // uniform in (0, 1), never 0 or 1
+    float4 Uniform4 (uint4 bits)
+    {
+        return (convert_float4 (bits >> 8) + 0.5f) * (1.0f / 16777216.0f);
+    }
+
+    // two independent standard normal numbers (Box-Muller)
+    float2 Gaussian2 (float2 u)
+    {
+        float r = sqrt (-2.0f * log (u.x));
+        return r * (float2) (cos (2.0f * M_PI_F * u.y), sin (2.0f * M_PI_F * u.y));
+    }
+
+    float2 Direction (float u)
+    {
+        return (float2) (cos (2.0f * M_PI_F * u), sin (2.0f * M_PI_F * u));
+    }
+
+    // mass fraction of a Plummer sphere inside r = a / sqrt (u^(-2/3) - 1) is u, the tail is cut at 98%
+    float4 PlummerBody (float4 u, float2 g, float a, float mass)
+    {
+        float r = a * rsqrt (pow (u.x * 0.98f, -2.0f / 3.0f) - 1.0f);
+        float sigma = sqrt (G * mass / (6.0f * sqrt (r * r + a * a)));
+
+        return (float4) (r * Direction (u.y), sigma * g);
+    }
+
+    // the radius of an exponential disk from its mass fraction 1 - (1 + x) exp (-x) by Newton's method,
+    // the circular speed of the mass inside and of a central mass under the softened force, with a 5% dispersion
+    float4 DiskBody (float4 u, float2 g, float scale, float mass, float central)
+    {
+        float target = u.x * 0.99f;
+        float x = 1.0f;
+        for (int i = 0; i < 16; ++i)
+            x = clamp (x - (1.0f - (1.0f + x) * exp (-x) - target) / (x * exp (-x)), 1.0e-4f, 10.0f);
+
+        float R = x * scale;
+        float inside = mass * (1.0f - (1.0f + x) * exp (-x)) + central;
+        float vc = sqrt (G * inside * R * R / pow (R * R + eps * eps, 1.5f));
+
+        float2 dir = Direction (u.y);
+        return (float4) (R * dir, vc * (float2) (-dir.y, dir.x) + 0.05f * vc * g);
+    }
+
+    // attributes: mass, radius, type (0 a star, 1 a black hole) and zero; `radius' is the one of a unit mass
+    __kernel
+    void GenerateBodies (__global PARTICLE_MEMORY* particles, const int BODY_NUM, const int model, const uint2 seed,
+        __global float4* attributes, const float radius)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        float4 u = Uniform4 (Philox ((uint4) (id, 0, 0, 0), seed));
+        float2 g = Gaussian2 (Uniform4 (Philox ((uint4) (id, 1, 0, 0), seed)).xy);
+        float mass = (float) BODY_NUM;
+
+        float4 body;
+        float4 attribute = (float4) (1.0f, radius, 0.0f, 0.0f);
+        if (model == 1)
+        {
+            body = PlummerBody (u, g, 0.04f, mass);
+        }
+        else if (model == 2)
+        {
+            body = DiskBody (u, g, 0.08f, mass, 0.0f);
+        }
+        else if (model == 3)
+        {
+            // the odd and even bodies form the two galaxies; they pass each other at 0.2 on a parabolic orbit
+            float side = (id & 1) ? 1.0f : -1.0f;
+            float2 offset = side * (float2) (0.2f, 0.1f);
+            float approach = 0.5f * sqrt (2.0f * G * mass / length (2.0f * offset));
+
+            body = DiskBody (u, g, 0.05f, 0.5f * mass, 0.0f) + (float4) (offset, -side * approach, 0.0f);
+        }
+        else if (model == 4)
+        {
+            body = (float4) (0.3f * sqrt (u.x) * Direction (u.y), 0.0f, 0.0f);
+        }
+        else if (model == 5)
+        {
+            // the first body is the black hole, at rest in the centre
+            float hole = (float) (BODY_NUM - 1);
+            if (id == 0)
+            {
+                body = (float4) (0.0f);
+                attribute = (float4) (hole, radius * cbrt (hole), 1.0f, 0.0f);
+            }
+            else
+            {
+                body = DiskBody (u, g, 0.08f, hole, hole);
+            }
+        }
+        else
+        {
+            body = (float4) (u.x - 0.5f, u.y - 0.5f, 2.0f * u.z - 1.0f, 2.0f * u.w - 1.0f);
+        }
+
+        STORE_PARTICLE (body + (float4) (0.5f, 0.5f, 0.0f, 0.0f), id, particles);
+        attributes [id] = attribute;
+    }
+);
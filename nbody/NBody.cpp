@@ -3,267 +3,1281 @@
 #include <GL/freeglut.h>
 
 #include "../Common.h"
+#include "../Runtime.h"
+#include "../FrameOutput.h"
+#include "../Presenter.h"
+#include "Snapshot.h"
+#include "Trajectory.h"
+#include "Ensemble.h"
+#include "InitialConditions.h"
+#include "ForceVariants.h"
+#include "Periodic.h"
+#include "FMM.h"
+#include "Collisions.h"
+#include "Space3D.h"
+#include "RadixTree.h"
 
 // global constants
-const std::string PROGRAM_SOURCE = STRINGIFY (
+// the simulation constants are shared by the programs
+const std::string CONSTANTS_SOURCE = STRINGIFY (
     /* -*- mode: c++ -*- */
+    __constant float dt = TIME_STEP;
+    __constant float G  = GRAVITY;
+    __constant float eps  = SOFTENING;
+);
 
-    // *************
-    // Simulation
-    // *************
-    __constant float dt = 1.0e-3;
-    __constant float G  = 5.0e-2;
-    __constant float eps  = 1.0e-1;
+// *************
+// Simulation
+// *************
+// built once for each force variant and precision: FORCE_VARIANT picks the inverse cube of the softened
+// distance, the types are given by the precision and the storage (see ForceVariants.h)
+const std::string SIMULATION_SOURCE = STRINGIFY (
+    REAL2 Pull (REAL2 r)
+    {
+        if (FORCE_VARIANT == 0)
+        {
+            REAL l = length (r);
+            return r / pow (l * l + (REAL) eps * eps, (REAL) 1.5);
+        }
+
+        REAL d2 = dot (r, r) + (REAL) eps * eps;
+        REAL inverse = FORCE_VARIANT == 2 ? NATIVE_RSQRT (d2) : rsqrt (d2);
+        return r * (inverse * inverse * inverse);
+    }
+
+    // with PERIODIC the pull of the minimum image and of all the others from the Ewald table (see Periodic.h)
+    REAL2 PairPull (REAL2 r, __constant float2* ewald)
+    {
+        if (!PERIODIC)
+            return Pull (r);
+
+        r -= round (r);
+
+        float2 t = (convert_float2 (r) + 0.5f) * (EWALD_SIZE - 1);
+        float2 cell = clamp (floor (t), 0.0f, EWALD_SIZE - 2.0f);
+        float2 f = t - cell;
+        int i = (int) cell.x + (int) cell.y * EWALD_SIZE;
+        float2 images = mix (mix (ewald [i], ewald [i + 1], f.x), mix (ewald [i + EWALD_SIZE], ewald [i + EWALD_SIZE + 1], f.x), f.y);
+
+        return Pull (r) + CONVERT_REAL2 (images);
+    }
+
+    // the pulls are summed in the sum type, with Kahan compensation if asked for
+    void Accumulate (SUM2* F, SUM2* compensation, SUM2 pull)
+    {
+        if (KAHAN)
+        {
+            SUM2 y = pull - *compensation;
+            SUM2 t = *F + y;
+            *compensation = (t - *F) - y;
+            *F = t;
+        }
+        else
+        {
+            *F += pull;
+        }
+    }
+
+    SUM2 Acceleration (__global const STATE_MEMORY* particles, int id, const int BODY_NUM, __constant float2* ewald)
+    {
+        REAL2 self = CONVERT_REAL2 (LOAD_STATE (id, particles).xy);
+        SUM2 F = (SUM2) (0);
+        SUM2 compensation = (SUM2) (0);
+
+        for (int i = 0; i < BODY_NUM; ++i)
+        {
+            if (i == id)
+                continue;
+
+            Accumulate (&F, &compensation, CONVERT_SUM2 (PairPull (CONVERT_REAL2 (LOAD_STATE (i, particles).xy) - self, ewald)));
+        }
+
+        return F * G;
+    }
+
+    // reads the state of the last step and writes the next one into the other buffer of the pair,
+    // a double state also into the float mirror the rest of the program reads; a periodic body is wrapped into the box
+    void Advance (__global const STATE_MEMORY* particles, __global STATE_MEMORY* updated, __global PARTICLE_MEMORY* mirror,
+        int id, SUM2 acceleration)
+    {
+        STATE2 F = CONVERT_STATE2 (acceleration);
+        STATE body = LOAD_STATE (id, particles);
+
+        STATE2 vel = body.zw + F * dt;
+        STATE2 pos = body.xy + vel * dt;
+        if (PERIODIC)
+            pos -= floor (pos);
+
+        body = (STATE) (pos, vel);
+        STORE_STATE (body, id, updated);
+        if (MIRROR)
+            STORE_PARTICLE (convert_float4 (body), id, mirror);
+    }
 
     __kernel
-    void SimulationKernel (__global float4* particles, const int BODY_NUM)
+    void SimulationKernel (__global const STATE_MEMORY* particles, __global STATE_MEMORY* updated, const int BODY_NUM,
+        __global PARTICLE_MEMORY* mirror, __constant float2* ewald)
     {
         int id = get_global_id (0);
-        float2 F = (float2) (0.0f, 0.0f);
+        if (id >= BODY_NUM)
+            return;
 
-        for (int i = 0; i < BODY_NUM; ++i)
+        Advance (particles, updated, mirror, id, Acceleration (particles, id, BODY_NUM, ewald));
+    }
+
+    // Bodies of their own masses, the first component of the attributes (see InitialConditions.h). The
+    // work-group stages the positions and the masses of a tile of bodies in local memory and every
+    // work-item sums the pulls of the tile; the work-items past the bodies stage massless ones.
+    __kernel
+    void MassSimulationKernel (__global const STATE_MEMORY* particles, __global STATE_MEMORY* updated, const int BODY_NUM,
+        __global PARTICLE_MEMORY* mirror, __constant float2* ewald, __global const float4* attributes,
+        __local REAL2* tilePositions, __local REAL* tileMasses)
+    {
+        int id = get_global_id (0);
+        int lid = get_local_id (0);
+        int size = get_local_size (0);
+
+        REAL2 self = CONVERT_REAL2 (LOAD_STATE (min (id, BODY_NUM - 1), particles).xy);
+        SUM2 F = (SUM2) (0);
+        SUM2 compensation = (SUM2) (0);
+
+        for (int start = 0; start < BODY_NUM; start += size)
         {
-            if (i != id)
+            int j = start + lid;
+            tilePositions [lid] = j < BODY_NUM ? CONVERT_REAL2 (LOAD_STATE (j, particles).xy) : (REAL2) (0);
+            tileMasses [lid] = j < BODY_NUM ? (REAL) attributes [j].x : (REAL) 0;
+            barrier (CLK_LOCAL_MEM_FENCE);
+
+            int count = min (size, BODY_NUM - start);
+            for (int k = 0; k < count; ++k)
+                if (start + k != id)
+                    Accumulate (&F, &compensation, CONVERT_SUM2 (PairPull (tilePositions [k] - self, ewald) * tileMasses [k]));
+            barrier (CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (id < BODY_NUM)
+            Advance (particles, updated, mirror, id, F * G);
+    }
+
+    // Symmetric evaluation for CPU devices, every pair once. The bodies are cut into tiles, the tile pairs of
+    // the upper triangle are dealt out to the work-items round-robin; a work-item is a thread of the host
+    // and adds the pull of a pair to one body and subtracts it from the other in a force buffer of its own.
+    __kernel
+    void PairForces (__global const STATE_MEMORY* particles, __global SUM2* forces, const int BODY_NUM, const int TILE,
+        __constant float2* ewald)
+    {
+        int thread = get_global_id (0);
+        int threads = get_global_size (0);
+        __global SUM2* own = forces + (size_t) thread * BODY_NUM;
+
+        for (int k = 0; k < BODY_NUM; ++k)
+            own [k] = (SUM2) (0);
+
+        int tiles = (BODY_NUM + TILE - 1) / TILE;
+        int pairs = tiles * (tiles + 1) / 2;
+        for (int pair = thread; pair < pairs; pair += threads)
+        {
+            // pair = column * (column + 1) / 2 + row, row <= column
+            int column = (int) ((sqrt (8.0f * pair + 1.0f) - 1.0f) * 0.5f);
+            while (column * (column + 1) / 2 > pair)
+                --column;
+            while ((column + 1) * (column + 2) / 2 <= pair)
+                ++column;
+            int row = pair - column * (column + 1) / 2;
+
+            int rowEnd = min ((row + 1) * TILE, BODY_NUM);
+            int columnEnd = min ((column + 1) * TILE, BODY_NUM);
+            for (int i = row * TILE; i < rowEnd; ++i)
             {
-                float2 r = particles [i].xy - particles [id].xy;
-                float l = length (r);
-                F += r / pow (l * l + eps * eps, 1.5f);
+                REAL2 self = CONVERT_REAL2 (LOAD_STATE (i, particles).xy);
+                SUM2 F = (SUM2) (0);
+
+                for (int j = row == column ? i + 1 : column * TILE; j < columnEnd; ++j)
+                {
+                    SUM2 pull = CONVERT_SUM2 (PairPull (CONVERT_REAL2 (LOAD_STATE (j, particles).xy) - self, ewald));
+                    F += pull;
+                    own [j] -= pull;
+                }
+
+                own [i] += F;
             }
         }
-        F *= G;
+    }
 
-        float2 vel = particles [id].zw + F * dt;
-        float2 pos = particles [id].xy + vel * dt;
+    // the acceleration of a body from the force buffers of the threads
+    SUM2 PairSum (__global const SUM2* forces, int id, const int BODY_NUM, const int THREADS)
+    {
+        SUM2 F = (SUM2) (0);
+        for (int t = 0; t < THREADS; ++t)
+            F += forces [(size_t) t * BODY_NUM + id];
 
-        particles [id] = (float4) (pos, vel);
+        return F * G;
     }
 
-    // *************
-    // Visualization
-    // *************
+    // sums the force buffers of the threads and advances the body
     __kernel
-    void VisualizationClear (const int width, const int height, __global float4* visualizationBuffer)
+    void PairUpdate (__global const STATE_MEMORY* particles, __global STATE_MEMORY* updated, const int BODY_NUM,
+        __global PARTICLE_MEMORY* mirror, __global const SUM2* forces, const int THREADS)
     {
-        int2 id = (int2) (get_global_id (0), get_global_id (1));
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        Advance (particles, updated, mirror, id, PairSum (forces, id, BODY_NUM, THREADS));
+    }
+
+    // the accelerations of the symmetric evaluation alone, for the accuracy check
+    __kernel
+    void PairAccelerations (__global const SUM2* forces, __global float2* accelerations, const int BODY_NUM, const int THREADS)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
 
-        if (id.x < width && id.y < height)
-            visualizationBuffer [id.x + id.y * width] = (float4) (0.0f);
+        accelerations [id] = convert_float2 (PairSum (forces, id, BODY_NUM, THREADS));
     }
 
+    // the accelerations alone, for the accuracy check
+    __kernel
+    void AccelerationKernel (__global const STATE_MEMORY* particles, __global float2* accelerations, const int BODY_NUM,
+        __constant float2* ewald)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
 
-    int2 Sampl (int2 coord, int width, int height)
+        accelerations [id] = convert_float2 (Acceleration (particles, id, BODY_NUM, ewald));
+    }
+
+    // a new float state, from a reset or a restart, becomes the state of the simulation
+    __kernel
+    void PromoteState (__global const PARTICLE_MEMORY* particles, __global STATE_MEMORY* state, const int BODY_NUM)
     {
-        int x = max (min (width - 1, coord.x), 0);
-        int y = max (min (height - 1, coord.y), 0);
-        return (int2) (x,y);
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        STORE_STATE (CONVERT_STATE (LOAD_PARTICLE (id, particles)), id, state);
     }
+);
+
+const std::string PROGRAM_SOURCE = STRINGIFY (
+    // *************
+    // Visualization
+    // *************
+    // The bodies are accumulated into a density image with atomic fixed point adds, each body is
+    // split bilinearly between the four nearest pixels. The density is tone mapped logarithmically
+    // relative to the densest pixel, so the structure stays visible from sparse to very dense regions.
+    // The tone mapping clears the density it has read, the image is ready for the next frame.
+    __constant float DENSITY_SCALE = 256.0f;
 
-    __constant float r = 2.0e-3;
+
+    void Deposit (__global uint* density, int width, int height, int x, int y, float weight)
+    {
+        if (x >= 0 && x < width && y >= 0 && y < height)
+            atomic_add (&density [x + y * width], convert_uint_rte (weight * DENSITY_SCALE));
+    }
 
     __kernel
-    void Visualization (const int width, const int height, __global float4* visualizationBuffer, __global float4* particleBuffer)
+    void Visualization (const int width, const int height, __global uint* density, __global const PARTICLE_MEMORY* particleBuffer, const int BODY_NUM)
     {
         int id = get_global_id (0);
-        float4 posdir = particleBuffer [id];
-        int w = width * r;
-        for (int i = -w; i <= w; ++i)
-        for (int j = -w; j <= w; ++j)
-        {
-            int2 coord = Sampl ( (int2) (posdir.x * (width -1) + i, posdir.y * (height -1) + j), width , height);
-            visualizationBuffer [coord.x + coord.y * width] = (float4) (1, 1, 1, 1);
-        }
+        if (id >= BODY_NUM)
+            return;
+
+        float2 p = LOAD_PARTICLE (id, particleBuffer).xy * (float2) (width - 1, height - 1);
+        float2 cell = floor (p);
+        float2 f = p - cell;
+
+        // the bodies far outside of the image are kept in the int range
+        int2 c = convert_int2 (fmax (fmin (cell, (float2) (width, height)), -1.0f));
+        int x = c.x;
+        int y = c.y;
+
+        Deposit (density, width, height, x,     y,     (1.0f - f.x) * (1.0f - f.y));
+        Deposit (density, width, height, x + 1, y,     f.x * (1.0f - f.y));
+        Deposit (density, width, height, x,     y + 1, (1.0f - f.x) * f.y);
+        Deposit (density, width, height, x + 1, y + 1, f.x * f.y);
+    }
+
+    // each work-item takes the maximum of a strided part of the image, one atomic per work-item
+    __kernel
+    void DensityMax (const int pixelCount, __global const uint* density, __global uint* maxDensity)
+    {
+        uint m = 0;
+        for (int i = get_global_id (0); i < pixelCount; i += get_global_size (0))
+            m = max (m, density [i]);
+
+        if (m > 0)
+            atomic_max (maxDensity, m);
+    }
+
+    // black - purple - red - orange - white
+    __constant float4 COLOUR_MAP [5] = {
+        (float4) (0.0f, 0.0f, 0.0f, 1.0f),
+        (float4) (0.35f, 0.05f, 0.55f, 1.0f),
+        (float4) (0.85f, 0.15f, 0.3f, 1.0f),
+        (float4) (1.0f, 0.65f, 0.1f, 1.0f),
+        (float4) (1.0f, 1.0f, 1.0f, 1.0f)
+    };
+
+    __kernel
+    void ToneMap (const int width, const int height, __global uint* density, __global const uint* maxDensity, __global uchar4* frame)
+    {
+        int2 id = (int2) (get_global_id (0), get_global_id (1));
+        if (id.x >= width || id.y >= height)
+            return;
+
+        int index = id.x + id.y * width;
+        float v = log1p ((float) density [index]) / log1p ((float) max (maxDensity [0], 1u));
+        density [index] = 0;
+
+        float t = clamp (v, 0.0f, 1.0f) * 4.0f;
+        int i = min ((int) t, 3);
+        float4 colour = mix (COLOUR_MAP [i], COLOUR_MAP [i + 1], t - i);
+
+        frame [index] = convert_uchar4_sat_rte (colour * 255.0f);
+    }
+);
+
+// colours of the visualization for the video stream
+const char* PIXEL_SOURCE = STRINGIFY (
+    float3 FramePixel (__global const uchar4* frame, int index)
+    {
+        return convert_float3 (frame [index].xyz) / 255.0f;
     }
 );
 
-const size_t BODY_NUM = 5000;
+// simulation constants, passed to the kernels as build options
+const float TIME_STEP = 1.0e-3f;
+const float GRAVITY = 5.0e-2f;
+const float SOFTENING = 1.0e-1f;
+
+// snapshots: NBODY_CHECKPOINT is the file, written every NBODY_CHECKPOINT_EVERY steps and on 's',
+// NBODY_RESTART continues from a snapshot (subsampled when NBODY_BODIES is smaller)
+const std::string CHECKPOINT_PATH = GetEnvironmentString ("NBODY_CHECKPOINT", "nbody.snap");
+const int CHECKPOINT_EVERY = GetEnvironmentInt ("NBODY_CHECKPOINT_EVERY", 0);
+const char* RESTART_PATH = GetEnvironmentString ("NBODY_RESTART", nullptr);
+
+// NBODY_ENSEMBLE runs the systems of an ensemble file for NBODY_ENSEMBLE_STEPS steps without a window
+const char* ENSEMBLE_PATH = GetEnvironmentString ("NBODY_ENSEMBLE", nullptr);
+
+// NBODY_MODEL names the initial conditions of a reset, the keys 1-6 switch between them
+const std::string INITIAL_MODEL = GetEnvironmentString ("NBODY_MODEL", "uniform");
+
+// NBODY_FORCE names the force variant, the key F switches to the next one; NBODY_ACCURACY runs the
+// accuracy check of all variants over that many steps without a window, NBODY_ACCURACY_SAMPLE bodies
+// are compared to the reference, a variant above NBODY_ACCURACY_TOLERANCE fails the check
+const std::string FORCE_VARIANT = GetEnvironmentString ("NBODY_FORCE", "precise");
+
+// NBODY_PRECISION is the precision of the simulation, the accuracy check runs all of them;
+// NBODY_STORAGE=half keeps the bodies in half precision for runs that are only displayed
+const std::string PRECISION = GetEnvironmentString ("NBODY_PRECISION", "float");
+const std::string STORAGE = GetEnvironmentString ("NBODY_STORAGE", "float");
+
+// NBODY_SYMMETRIC=1 evaluates every pair once with per-thread force buffers, 0 twice with the direct sum;
+// by default CPU devices take the symmetric evaluation
+const int SYMMETRIC = GetEnvironmentInt ("NBODY_SYMMETRIC", -1);
+const int PAIR_TILE = 256;
+
+// NBODY_PERIODIC=1 makes the unit square a periodic box
+const bool PERIODIC = GetEnvironmentInt ("NBODY_PERIODIC", 0) != 0;
+
+// NBODY_SOLVER=fmm takes the accelerations from the fast multipole method (see FMM.h), with expansions of
+// NBODY_FMM_ORDER, the opening angle NBODY_FMM_THETA and at most NBODY_FMM_LEAF bodies in a leaf
+const std::string SOLVER = GetEnvironmentString ("NBODY_SOLVER", "direct");
+const int FMM_ORDER = std::max (1, std::min (FMM_MAX_ORDER, GetEnvironmentInt ("NBODY_FMM_ORDER", 6)));
+const double FMM_THETA = atof (GetEnvironmentString ("NBODY_FMM_THETA", "0.5"));
+const int FMM_LEAF = std::max (1, GetEnvironmentInt ("NBODY_FMM_LEAF", 32));
+
+// NBODY_COLLISION_RADIUS is the radius of a unit mass, the overlapping bodies are merged every
+// NBODY_COLLISION_EVERY steps; 0 leaves the bodies apart, the radii are only kept in their attributes
+const float COLLISION_RADIUS = static_cast<float> (atof (GetEnvironmentString ("NBODY_COLLISION_RADIUS", "0")));
+const int COLLISION_EVERY = std::max (1, GetEnvironmentInt ("NBODY_COLLISION_EVERY", 16));
+
+// NBODY_DIMENSIONS=3 simulates and displays the bodies in space (see Space3D.h), 2 in the plane
+const int DIMENSIONS = GetEnvironmentInt ("NBODY_DIMENSIONS", 2);
+
+const int ACCURACY_STEPS = GetEnvironmentInt ("NBODY_ACCURACY", 0);
+const int ACCURACY_SAMPLE = std::max (1, GetEnvironmentInt ("NBODY_ACCURACY_SAMPLE", 1024));
+const char* ACCURACY_TOLERANCE = GetEnvironmentString ("NBODY_ACCURACY_TOLERANCE", nullptr);
+
+// NBODY_STEPS_PER_FRAME simulation steps are enqueued back-to-back for each displayed frame, or with
+// NBODY_FRAME_BUDGET_MS as many as fit into that much device time, measured on the steps of a previous frame
+const int MAX_STEPS_PER_FRAME = 4096;
+const int FRAME_BUDGET_MS = GetEnvironmentInt ("NBODY_FRAME_BUDGET_MS", 0);
 
 // global variables
+size_t bodyNum = static_cast<size_t> (std::max (1, GetEnvironmentInt ("NBODY_BODIES", 5000)));
+cl_ulong simulationStep = 0;
+int stepsPerFrame = std::max (1, std::min (MAX_STEPS_PER_FRAME, GetEnvironmentInt ("NBODY_STEPS_PER_FRAME", 1)));
+uint64_t rngState = 0;
+int initialModel = MODEL_UNIFORM;
+int forceVariant = 0;
+int precision = 0;
+bool halfStorage = false;
+bool periodic = false;
+bool fmmSolver = false;
+bool variableMasses = false;
+bool threeDimensions = false;
 bool keysPressed [256] = { false };
+int mouseX = 0;
+int mouseY = 0;
 int visualizationWidth = 512;
 int visualizationHeight = 512;
 
 // visualization buffers
 size_t visualizationBufferSize [2];
-cl_float4* visualizationBufferCPU = nullptr;
-cl::Buffer visualizationBufferGPU;
+cl::Buffer densityBuffer;
+cl::Buffer maxDensityBuffer;
+FrameRing visualizationFrames;
+Presenter presenter;
+ImageWriter frameWriter;
+VideoStream videoStream;
 
 cl_int errorCode = CL_SUCCESS;
 
-// simulation buffer
-// position + velocity
-cl::Buffer particlesBufferGPU;
-cl_float4* particlesBufferCPU = nullptr;
+// simulation buffers
+// position + velocity, the current state and the one the next step is written into
+cl::Buffer particlesBufferGPU;
+cl::Buffer particlesBufferNext;
+// mass, radius and type of the bodies, the pair follows the compaction of the collisions
+cl::Buffer attributeBuffer;
+cl::Buffer attributeBufferNext;
+// the pair of a double state, the float buffers are its mirror
+cl::Buffer stateBuffer;
+cl::Buffer stateBufferNext;
+// the force buffers of the threads of the symmetric evaluation
+cl::Buffer pairForceBuffer;
+// the Ewald correction table of the periodic box, a single zero otherwise
+cl::Buffer ewaldBuffer;
+cl_uint pairThreads = 1;
+bool symmetricForces = false;
+Fmm fmm;
+Collisions collisions;
+Space3D space;
+cl_float4* particlesBufferCPU = nullptr;
+SnapshotWriter snapshotWriter;
+TrajectoryWriter trajectoryWriter;
+
+// the first and the last step of a frame being timed for the frame budget
+cl::Event firstSimulationEvent;
+cl::Event lastSimulationEvent;
+cl::Event budgetFirst;
+cl::Event budgetLast;
+int budgetSteps = 0;
+
+// kernels
+Runtime runtime;
+cl::Context context;
+cl::Device device;
+cl::CommandQueue queue;
+cl::Program program;
+
+cl::Kernel visualizationKernel;
+cl::Kernel densityMaxKernel;
+cl::Kernel toneMapKernel;
+cl::Kernel simulationKernel;
+cl::Kernel generateKernel;
+
+cl::Kernel promoteKernel;
+cl::Kernel pairForcesKernel;
+cl::Kernel pairUpdateKernel;
+cl::Kernel massSimulationKernel;
+
+// the force programs are built when their variant is first used
+cl::Program forcePrograms [PRECISION_COUNT][FORCE_VARIANT_COUNT];
+
+// tuned local work sizes, zero means the driver's choice
+size_t visualizationLocalSize [3] = { 0 };
+size_t toneMapLocalSize [3] = { 0 };
+size_t simulationLocalSize [3] = { 0 };
+// the tiles of the variable masses are as large as the work-groups
+size_t massLocalSize = 1;
+
+
+// xorshift64*, its whole state goes into the snapshots
+uint64_t RandomBits (void)
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+
+    return rngState * 2685821657736338717ull;
+}
+
+
+float RandomFloat (void)
+{
+    return static_cast<float> (RandomBits () >> 40) / static_cast<float> (1 << 24);
+}
+
+
+// position in the unit square, velocity in [-1, 1]
+cl_float4 RandomBody (void)
+{
+    float p1 = RandomFloat ();
+    float p2 = RandomFloat ();
+    float v1 = 2.0 * RandomFloat () - 1.0;
+    float v2 = 2.0 * RandomFloat () - 1.0;
+
+    return { p1, p2, v1, v2 };
+}
+
+
+// a double state takes over the float particles
+bool PromoteState (void)
+{
+    if (!DoubleState (PRECISIONS [precision]))
+        return true;
+
+    errorCode = promoteKernel.setArg (0, particlesBufferGPU);
+    errorCode |= promoteKernel.setArg (1, stateBuffer);
+    errorCode |= promoteKernel.setArg (2, (int)bodyNum);
+    errorCode |= queue.enqueueNDRangeKernel (promoteKernel, cl::NullRange, cl::NDRange (bodyNum), cl::NullRange);
+
+    return errorCode == CL_SUCCESS;
+}
+
+
+// the bodies are generated on the device, every reset takes a new key from the host generator; the
+// bodies merged by the collisions come back
+bool ResetSimulation (void)
+{
+    const uint64_t bits = RandomBits ();
+    const cl_uint2 key = {{ static_cast<cl_uint> (bits), static_cast<cl_uint> (bits >> 32) }};
+    simulationStep = 0;
+
+    if (threeDimensions)
+        return space.Reset (queue, bodyNum, initialModel, key);
+
+    if (collisions.IsEnabled ())
+        bodyNum = collisions.Capacity ();
+
+    errorCode = generateKernel.setArg (0, particlesBufferGPU);
+    errorCode |= generateKernel.setArg (1, static_cast<cl_int> (bodyNum));
+    errorCode |= generateKernel.setArg (2, static_cast<cl_int> (initialModel));
+    errorCode |= generateKernel.setArg (3, key);
+    errorCode |= generateKernel.setArg (4, attributeBuffer);
+    errorCode |= generateKernel.setArg (5, COLLISION_RADIUS);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    variableMasses = HasVariableMasses (initialModel) || collisions.IsEnabled ();
+
+    cl::Event event;
+    errorCode = queue.enqueueNDRangeKernel (generateKernel, cl::NullRange, cl::NDRange (bodyNum), cl::NullRange, nullptr, &event);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    profiler.Add ("GenerateBodies", event);
+
+    return PromoteState ();
+}
+
+
+bool SaveSnapshot (void)
+{
+    if (threeDimensions)
+    {
+        std::cerr << "No snapshots of bodies in space, the snapshots take the plane\n";
+        return true;
+    }
+
+    if (halfStorage)
+    {
+        std::cerr << "No snapshots of half precision bodies\n";
+        return true;
+    }
+
+    SnapshotHeader header = MakeSnapshotHeader (bodyNum, simulationStep, TIME_STEP, rngState, GRAVITY, SOFTENING);
+
+    return snapshotWriter.Save (context (), queue (), particlesBufferGPU (), attributeBuffer (), header, CHECKPOINT_PATH);
+}
+
+
+// the mapped file backs a host pointer buffer, which is copied on the device; a snapshot with more bodies is subsampled,
+// the bodies of a version 1 snapshot get unit masses
+bool LoadSnapshot (const SnapshotFile& snapshot)
+{
+    const SnapshotHeader& header = snapshot.Header ();
+    if (header.timeStep != TIME_STEP || header.gravity != GRAVITY || header.softening != SOFTENING)
+        std::cerr << "The snapshot was taken with different simulation constants\n";
+
+    cl::Event event;
+    if (header.bodyCount == bodyNum)
+    {
+        cl::Buffer mapped (context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof (cl_float4) * bodyNum,
+            const_cast<cl_float4*> (snapshot.Particles ()), &errorCode);
+        if (errorCode != CL_SUCCESS)
+            return false;
+
+        errorCode = queue.enqueueCopyBuffer (mapped, particlesBufferGPU, 0, 0, sizeof (cl_float4) * bodyNum, nullptr, &event);
+        if (errorCode != CL_SUCCESS || queue.finish () != CL_SUCCESS)
+            return false;
+    }
+    else
+    {
+        for (size_t i = 0; i < bodyNum; ++i)
+            particlesBufferCPU [i] = snapshot.Particles () [i * header.bodyCount / bodyNum];
+
+        errorCode = queue.enqueueWriteBuffer (particlesBufferGPU, true, 0, sizeof (cl_float4) * bodyNum, particlesBufferCPU, nullptr, &event);
+        if (errorCode != CL_SUCCESS)
+            return false;
+
+        std::cout << "Subsampled " << header.bodyCount << " bodies of the snapshot to " << bodyNum << std::endl;
+    }
+    profiler.Add ("LoadSnapshot", event);
+
+    std::vector<cl_float4> attributes (bodyNum, {{ 1.0f, COLLISION_RADIUS, 0.0f, 0.0f }});
+    if (snapshot.Attributes () != nullptr)
+        for (size_t i = 0; i < bodyNum; ++i)
+            attributes [i] = snapshot.Attributes () [i * header.bodyCount / bodyNum];
+
+    errorCode = queue.enqueueWriteBuffer (attributeBuffer, true, 0, sizeof (cl_float4) * bodyNum, &attributes [0]);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    variableMasses = false;
+    for (size_t i = 0; i < bodyNum; ++i)
+        variableMasses = variableMasses || attributes [i].s [0] != 1.0f;
+
+    simulationStep = header.step;
+    rngState = header.rngState;
+    std::cout << "Restarted from step " << header.step << " (t = " << header.time << ")" << std::endl;
+
+    return PromoteState ();
+}
+
+
+// only needed for a new density image, afterwards the tone mapping leaves it cleared
+bool ClearDensity (void)
+{
+    cl::Event event;
+    errorCode = queue.enqueueFillBuffer (densityBuffer, cl_uint (0), 0, sizeof (cl_uint) * visualizationWidth * visualizationHeight, nullptr, &event);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    profiler.Add ("ClearDensity", event);
+
+    return true;
+}
+
+
+bool AllocateVisualizationBuffers (void)
+{
+    visualizationBufferSize [0] = visualizationWidth;
+    visualizationBufferSize [1] = visualizationHeight;
+
+    densityBuffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_uint) * visualizationWidth * visualizationHeight, nullptr, &errorCode);
+    if (errorCode != CL_SUCCESS || !ClearDensity ())
+        return false;
+
+    // the frames still in flight have the old size, they are dropped
+    return visualizationFrames.Allocate (context (), device (), sizeof (cl_uchar4) * visualizationWidth * visualizationHeight, FrameRing::DefaultSize ());
+}
+
+
+bool SetSimulationArguments (void)
+{
+    const bool doubleState = DoubleState (PRECISIONS [precision]);
+    errorCode = simulationKernel.setArg (0, doubleState ? stateBuffer : particlesBufferGPU);
+    errorCode |= simulationKernel.setArg (1, doubleState ? stateBufferNext : particlesBufferNext);
+    errorCode |= simulationKernel.setArg (2, (int)bodyNum);
+    errorCode |= simulationKernel.setArg (3, particlesBufferNext);
+    errorCode |= simulationKernel.setArg (4, ewaldBuffer);
+
+    if (variableMasses)
+    {
+        const size_t realBytes = RealBytes (PRECISIONS [precision]);
+        errorCode |= massSimulationKernel.setArg (0, doubleState ? stateBuffer : particlesBufferGPU);
+        errorCode |= massSimulationKernel.setArg (1, doubleState ? stateBufferNext : particlesBufferNext);
+        errorCode |= massSimulationKernel.setArg (2, (int)bodyNum);
+        errorCode |= massSimulationKernel.setArg (3, particlesBufferNext);
+        errorCode |= massSimulationKernel.setArg (4, ewaldBuffer);
+        errorCode |= massSimulationKernel.setArg (5, attributeBuffer);
+        errorCode |= massSimulationKernel.setArg (6, cl::Local (2 * realBytes * massLocalSize));
+        errorCode |= massSimulationKernel.setArg (7, cl::Local (realBytes * massLocalSize));
+    }
+
+    if (symmetricForces)
+    {
+        errorCode |= pairForcesKernel.setArg (0, doubleState ? stateBuffer : particlesBufferGPU);
+        errorCode |= pairForcesKernel.setArg (1, pairForceBuffer);
+        errorCode |= pairForcesKernel.setArg (2, (int)bodyNum);
+        errorCode |= pairForcesKernel.setArg (3, PAIR_TILE);
+        errorCode |= pairForcesKernel.setArg (4, ewaldBuffer);
+
+        errorCode |= pairUpdateKernel.setArg (0, doubleState ? stateBuffer : particlesBufferGPU);
+        errorCode |= pairUpdateKernel.setArg (1, doubleState ? stateBufferNext : particlesBufferNext);
+        errorCode |= pairUpdateKernel.setArg (2, (int)bodyNum);
+        errorCode |= pairUpdateKernel.setArg (3, particlesBufferNext);
+        errorCode |= pairUpdateKernel.setArg (4, pairForceBuffer);
+        errorCode |= pairUpdateKernel.setArg (5, (int)pairThreads);
+    }
+
+    return errorCode == CL_SUCCESS;
+}
+
+
+bool SetVisualizationArguments (void)
+{
+    errorCode = visualizationKernel.setArg (0, visualizationWidth);
+    errorCode |= visualizationKernel.setArg (1, visualizationHeight);
+    errorCode |= visualizationKernel.setArg (2, densityBuffer);
+    errorCode |= visualizationKernel.setArg (3, particlesBufferGPU);
+    errorCode |= visualizationKernel.setArg (4, (int)bodyNum);
+
+    errorCode |= densityMaxKernel.setArg (0, visualizationWidth * visualizationHeight);
+    errorCode |= densityMaxKernel.setArg (1, densityBuffer);
+    errorCode |= densityMaxKernel.setArg (2, maxDensityBuffer);
+
+    errorCode |= toneMapKernel.setArg (0, visualizationWidth);
+    errorCode |= toneMapKernel.setArg (1, visualizationHeight);
+    errorCode |= toneMapKernel.setArg (2, densityBuffer);
+    errorCode |= toneMapKernel.setArg (3, maxDensityBuffer);
+    errorCode |= toneMapKernel.setArg (4, visualizationFrames.Current ());
+
+    return errorCode == CL_SUCCESS;
+}
+
+
+bool TuneKernels (void)
+{
+    if (!SetSimulationArguments () || !SetVisualizationArguments ())
+        return false;
+
+    size_t bodies [1] = { bodyNum };
+    size_t pixels [2] = { (size_t)visualizationWidth, (size_t)visualizationHeight };
+
+    if (!autoTuner.Tune (queue (), simulationKernel (), "SimulationKernel", 1, bodies, simulationLocalSize)
+        || !autoTuner.Tune (queue (), visualizationKernel (), "Visualization", 1, bodies, visualizationLocalSize)
+        || !autoTuner.Tune (queue (), toneMapKernel (), "ToneMap", 2, pixels, toneMapLocalSize))
+        return false;
+
+    // the tuning runs of the splatting left their bodies in the density image
+    return ClearDensity ();
+}
+
+
+std::string ConstantOptions (void)
+{
+    std::ostringstream options;
+    options << "-DTIME_STEP=" << TIME_STEP << "f -DGRAVITY=" << GRAVITY << "f -DSOFTENING=" << SOFTENING << "f";
+
+    return options.str ();
+}
+
+
+// builds the program of the variant in the current precision when it is first asked for, the new kernel
+// takes over the tuned local size
+bool SelectForceVariant (int variant)
+{
+    cl::Program& forceProgram = forcePrograms [precision][variant];
+    if (forceProgram () == nullptr)
+    {
+        std::ostringstream options;
+        options << ConstantOptions () << " -DFORCE_VARIANT=" << FORCE_VARIANTS [variant].kernel << " -DPERIODIC=" << (periodic ? 1 : 0)
+            << " -DEWALD_SIZE=" << EWALD_TABLE_SIZE << ' ' << StorageOptions (halfStorage)
+            << ' ' << PrecisionOptions (PRECISIONS [precision]) << ' ' << FORCE_VARIANTS [variant].options;
+
+        const std::string source = (NeedsDouble (PRECISIONS [precision]) ? FP64_PRAGMA : "") + CONSTANTS_SOURCE + StorageSource (halfStorage)
+            + (DoubleState (PRECISIONS [precision]) ? DOUBLE_STATE_SOURCE : "") + SIMULATION_SOURCE;
+        forceProgram = cl::Program (BuildProgram (runtime, source.c_str (), options.str ().c_str ()));
+        if (forceProgram () == nullptr)
+            return false;
+    }
+
+    cl::Kernel kernel (forceProgram, "SimulationKernel", &errorCode);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    cl::Kernel promote (forceProgram, "PromoteState", &errorCode);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    cl::Kernel pairForces (forceProgram, "PairForces", &errorCode);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    cl::Kernel pairUpdate (forceProgram, "PairUpdate", &errorCode);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    cl::Kernel massSimulation (forceProgram, "MassSimulationKernel", &errorCode);
+    if (errorCode != CL_SUCCESS)
+        return false;
+
+    massLocalSize = std::min<size_t> (256, massSimulation.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (device));
+
+    simulationKernel = kernel;
+    promoteKernel = promote;
+    pairForcesKernel = pairForces;
+    pairUpdateKernel = pairUpdate;
+    massSimulationKernel = massSimulation;
+    forceVariant = variant;
+
+    return true;
+}
+
+
+// Every pair once on a CPU device, unless NBODY_SYMMETRIC says otherwise. Each thread needs a force buffer
+// for all of the bodies. The Kahan precision stays with the direct sum, a thread's sums are not compensated.
+bool SelectPairForces (void)
+{
+    const bool cpu = (device.getInfo<CL_DEVICE_TYPE> () & CL_DEVICE_TYPE_CPU) != 0;
+    symmetricForces = (SYMMETRIC < 0 ? cpu : SYMMETRIC > 0) && !PRECISIONS [precision].kahan;
+    if (!symmetricForces)
+        return true;
+
+    pairThreads = std::max<cl_uint> (1, device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS> ());
+    const size_t bytes = pairThreads * bodyNum * SumBytes (PRECISIONS [precision]);
+    if (pairForceBuffer () == nullptr || pairForceBuffer.getInfo<CL_MEM_SIZE> () != bytes)
+    {
+        pairForceBuffer = cl::Buffer (context, CL_MEM_READ_WRITE, bytes, nullptr, &errorCode);
+        if (errorCode != CL_SUCCESS)
+            return false;
+    }
+
+    return true;
+}
+
+
+bool SupportsDouble (void)
+{
+    return device.getInfo<CL_DEVICE_EXTENSIONS> ().find ("cl_khr_fp64") != std::string::npos;
+}
+
+
+// the buffers of a double state are allocated with the first double precision run
+bool SelectPrecision (int mode)
+{
+    if (NeedsDouble (PRECISIONS [mode]) && !SupportsDouble ())
+    {
+        std::cerr << "The " << PRECISIONS [mode].name << " precision needs cl_khr_fp64, which the device does not support\n";
+        return false;
+    }
+
+    if (DoubleState (PRECISIONS [mode]) && stateBuffer () == nullptr)
+    {
+        stateBuffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_double4) * bodyNum, nullptr, &errorCode);
+        if (errorCode != CL_SUCCESS)
+            return false;
+
+        stateBufferNext = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_double4) * bodyNum, nullptr, &errorCode);
+        if (errorCode != CL_SUCCESS)
+            return false;
+    }
+
+    precision = mode;
+
+    return SelectForceVariant (forceVariant) && SelectPairForces ();
+}
+
+
+// the updated state becomes the current one
+void SwapState (void)
+{
+    std::swap (particlesBufferGPU, particlesBufferNext);
+    if (DoubleState (PRECISIONS [precision]))
+        std::swap (stateBuffer, stateBufferNext);
+}
+
+
+// the FMM integrates float bodies, in open space or in the periodic box
+bool InitFmm (Fmm& solver, int order)
+{
+    if (halfStorage || strcmp (PRECISIONS [precision].name, "float") != 0)
+    {
+        std::cerr << "The FMM solver takes the float precision and storage\n";
+        return false;
+    }
+
+    // at theta >= 1 a cell may take the expansion of a neighbour that reaches into it, where it diverges
+    if (!(FMM_THETA > 0.0 && FMM_THETA < 1.0))
+    {
+        std::cerr << "The FMM opening angle NBODY_FMM_THETA has to be between 0 and 1, not " << FMM_THETA << "\n";
+        return false;
+    }
 
-// kernels
-cl::Context context;
-cl::CommandQueue queue;
-cl::Program program;
+    std::ostringstream options;
+    options << ConstantOptions () << ' ' << StorageOptions (false) << " -DPERIODIC=" << (periodic ? 1 : 0) << " -DEWALD_SIZE=" << EWALD_TABLE_SIZE;
 
-cl::Kernel visualizationClearKernel;
-cl::Kernel visualizationKernel;
-cl::Kernel simulationKernel;
+    return solver.Init (runtime, bodyNum, order, FMM_THETA, FMM_LEAF, CONSTANTS_SOURCE + StorageSource (false), options.str (), ewaldBuffer);
+}
 
 
-bool ResetSimulation (void)
+// the collisions change the body count and the masses, which the double state, the periodic box, the
+// snapshots and the trajectories do not follow
+bool InitCollisions (void)
 {
-    for (size_t i = 0; i < BODY_NUM; ++i)
+    if (DoubleState (PRECISIONS [precision]) || periodic || RESTART_PATH != nullptr || CHECKPOINT_EVERY > 0 || trajectoryWriter.IsEnabled ())
     {
-        float p1 = static_cast<float> (rand ()) / RAND_MAX;
-        float p2 = static_cast<float> (rand ()) / RAND_MAX;
-        float v1 = 2.0 * static_cast<float> (rand ()) / RAND_MAX - 1.0;
-        float v2 = 2.0 * static_cast<float> (rand ()) / RAND_MAX - 1.0;
-        particlesBufferCPU [i] = { p1, p2, v1, v2 };
+        std::cerr << "The collisions take a float state in open space, without snapshots, restarts and trajectories\n";
+        return false;
     }
-    errorCode = queue.enqueueWriteBuffer (particlesBufferGPU, true, 0, sizeof (cl_float4) * BODY_NUM, particlesBufferCPU);
-    if (errorCode != CL_SUCCESS)
+
+    return collisions.Init (runtime, bodyNum, StorageSource (halfStorage), StorageOptions (halfStorage));
+}
+
+
+// the merged bodies leave the state, the survivors are compacted into the other buffer
+bool CollideBodies (void)
+{
+    if (!collisions.Collide (queue, particlesBufferGPU, attributeBuffer, particlesBufferNext, attributeBufferNext, bodyNum))
         return false;
 
+    std::swap (particlesBufferGPU, particlesBufferNext);
+    std::swap (attributeBuffer, attributeBufferNext);
+
     return true;
 }
 
 
-bool AllocateVisualizationBuffers (void)
+bool BuildKernels (void)
 {
-    visualizationBufferSize [0] = visualizationWidth;
-    visualizationBufferSize [1] = visualizationHeight;
-    if (visualizationBufferCPU != nullptr)
-        delete [] visualizationBufferCPU;
+    // the kernels of the bodies in space are only built for them
+    const std::string source = CONSTANTS_SOURCE + StorageSource (halfStorage) + PROGRAM_SOURCE + INITIAL_CONDITIONS_SOURCE
+        + (threeDimensions ? SPACE_KERNEL_SOURCE : "");
+    const std::string options = ConstantOptions () + ' ' + StorageOptions (halfStorage);
+    program = cl::Program (BuildProgram (runtime, source.c_str (), options.c_str ()));
+    if (program () == nullptr)
+        return false;
 
-    try {
-        visualizationBufferCPU = new cl_float4 [visualizationWidth * visualizationHeight];
-    } catch (const std::bad_alloc& ba) {
-        std::cout << ba.what () << std::endl;
+    visualizationKernel = cl::Kernel (program, "Visualization", &errorCode);
+    if (errorCode != CL_SUCCESS)
+        return false;
 
+    densityMaxKernel = cl::Kernel (program, "DensityMax", &errorCode);
+    if (errorCode != CL_SUCCESS)
         return false;
-    }
-    visualizationBufferGPU = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_float4) * visualizationWidth * visualizationHeight, nullptr, &errorCode);
+
+    toneMapKernel = cl::Kernel (program, "ToneMap", &errorCode);
     if (errorCode != CL_SUCCESS)
         return false;
 
-    return true;
+    generateKernel = cl::Kernel (program, "GenerateBodies", &errorCode);
+
+    return errorCode == CL_SUCCESS;
 }
 
 
-bool InitSimulation (void)
+bool AllocateParticleBuffers (void)
 {
-    std::vector<cl::Platform> platforms;
-
-    cl::Platform::get (&platforms);
-    if (platforms.size () == 0)
-    {
-        std::cout << "Unable to find suitable platform." << std::endl;
+    try {
+        particlesBufferCPU = new cl_float4 [bodyNum];
+    } catch (const std::bad_alloc& ba) {
+        std::cout << ba.what () << std::endl;
 
         return false;
     }
 
-    cl_context_properties properties [] =
-        { CL_CONTEXT_PLATFORM, (cl_context_properties) (platforms [0]) (), 0 };
+    particlesBufferGPU = cl::Buffer (context, CL_MEM_READ_WRITE, ParticleBytes (halfStorage) * bodyNum, nullptr, &errorCode);
+    if (errorCode != CL_SUCCESS)
+        return false;
 
-    context = cl::Context (CL_DEVICE_TYPE_GPU, properties, nullptr, nullptr, &errorCode);
+    particlesBufferNext = cl::Buffer (context, CL_MEM_READ_WRITE, ParticleBytes (halfStorage) * bodyNum, nullptr, &errorCode);
     if (errorCode != CL_SUCCESS)
         return false;
 
-    std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES> (&errorCode);
+    attributeBuffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_float4) * bodyNum, nullptr, &errorCode);
     if (errorCode != CL_SUCCESS)
         return false;
 
-    queue = cl::CommandQueue (context, devices [0], 0, &errorCode);
+    attributeBufferNext = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_float4) * bodyNum, nullptr, &errorCode);
     if (errorCode != CL_SUCCESS)
         return false;
 
-    program = cl::Program (context, PROGRAM_SOURCE);
-    errorCode = program.build (devices);
-    if (errorCode != CL_SUCCESS) {
-        std::string buildlog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG> (devices [0]);
-        std::cerr << "Build log:\n" << buildlog << std::endl;
+    std::vector<cl_float2> ewald (1, cl_float2 ());
+    if (periodic)
+        ewald = EwaldCorrectionTable (SOFTENING);
+
+    ewaldBuffer = cl::Buffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof (cl_float2) * ewald.size (), &ewald [0], &errorCode);
+
+    return errorCode == CL_SUCCESS;
+}
+
 
+// the bodies in space take the float direct sum in open space, the rest of the program follows the plane
+bool InitSpace (void)
+{
+    if (halfStorage || periodic || fmmSolver || COLLISION_RADIUS > 0.0f || strcmp (PRECISIONS [precision].name, "float") != 0
+        || RESTART_PATH != nullptr || CHECKPOINT_EVERY > 0 || trajectoryWriter.IsEnabled ())
+    {
+        std::cerr << "The bodies in space take the float precision and storage and the direct sum in open space, "
+            "without collisions, snapshots, restarts and trajectories\n";
         return false;
     }
 
-    visualizationClearKernel = cl::Kernel (program, "VisualizationClear", &errorCode);
+    maxDensityBuffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_uint), nullptr, &errorCode);
     if (errorCode != CL_SUCCESS)
         return false;
 
-    visualizationKernel = cl::Kernel (program, "Visualization", &errorCode);
-    if (errorCode != CL_SUCCESS)
+    return AllocateVisualizationBuffers () && space.Init (context, device, program, bodyNum) && ResetSimulation ();
+}
+
+
+bool InitSimulation (void)
+{
+    // the frame budget is measured with the profiling info of the simulation steps
+    if (!InitRuntime (runtime, FRAME_BUDGET_MS > 0 ? CL_QUEUE_PROFILING_ENABLE : 0))
         return false;
 
-    simulationKernel = cl::Kernel (program, "SimulationKernel", &errorCode);
-    if (errorCode != CL_SUCCESS)
+    context = runtime.context;
+    device = runtime.device;
+    queue = runtime.queue;
+
+    if (!BuildKernels () || !videoStream.Init (runtime, PIXEL_SOURCE, "uchar4"))
         return false;
 
-    try {
-        particlesBufferCPU = new cl_float4 [BODY_NUM];
-    } catch (const std::bad_alloc& ba) {
-        std::cout << ba.what () << std::endl;
+    if (threeDimensions)
+        return InitSpace ();
 
+    if (halfStorage && (RESTART_PATH != nullptr || CHECKPOINT_EVERY > 0 || trajectoryWriter.IsEnabled ()))
+    {
+        std::cerr << "Half precision bodies are only displayed, the snapshots, the restarts and the trajectories take float bodies\n";
         return false;
     }
 
-    particlesBufferGPU = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_float4) * BODY_NUM, nullptr, &errorCode);
+    // a restart takes the body count of the snapshot, unless fewer bodies were asked for
+    SnapshotFile snapshot;
+    if (RESTART_PATH != nullptr)
+    {
+        if (!snapshot.Open (RESTART_PATH))
+            return false;
+
+        if (getenv ("NBODY_BODIES") == nullptr || bodyNum > snapshot.Header ().bodyCount)
+            bodyNum = snapshot.Header ().bodyCount;
+    }
+
+    if (!AllocateParticleBuffers () || !SelectPrecision (precision) || (fmmSolver && !InitFmm (fmm, FMM_ORDER))
+        || (COLLISION_RADIUS > 0.0f && !InitCollisions ()))
+        return false;
+
+    maxDensityBuffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_uint), nullptr, &errorCode);
     if (errorCode != CL_SUCCESS)
         return false;
 
     if (!AllocateVisualizationBuffers ())
         return false;
 
-    if (!ResetSimulation ())
+    if (!trajectoryWriter.Init (runtime, bodyNum, TIME_STEP))
+        return false;
+
+    // the tuning runs get the same initial state as the real run
+    const uint64_t seed = rngState;
+    if (!ResetSimulation () || !TuneKernels ())
+        return false;
+
+    rngState = seed;
+    if (RESTART_PATH != nullptr)
+        return LoadSnapshot (snapshot);
+
+    return ResetSimulation ();
+}
+
+
+// one step of the state into the other buffer; the first and the last command of the step are kept for the timing
+bool EnqueueSimulationStep (void)
+{
+    if (threeDimensions)
+        return space.Step (queue, bodyNum, firstSimulationEvent, lastSimulationEvent);
+
+    if (fmmSolver)
+        return fmm.Step (queue, particlesBufferGPU, attributeBuffer, particlesBufferNext, bodyNum, firstSimulationEvent, lastSimulationEvent);
+
+    if (!SetSimulationArguments ())
+        return false;
+
+    // the equal masses keep their kernels, the tiles of the variable masses take whole work-groups
+    if (variableMasses)
+    {
+        const size_t global = (bodyNum + massLocalSize - 1) / massLocalSize * massLocalSize;
+        errorCode = queue.enqueueNDRangeKernel (massSimulationKernel, cl::NullRange, cl::NDRange (global), cl::NDRange (massLocalSize), nullptr, &lastSimulationEvent);
+        if (errorCode != CL_SUCCESS)
+            return false;
+
+        profiler.Add ("MassSimulationKernel", lastSimulationEvent);
+        firstSimulationEvent = lastSimulationEvent;
+
+        return true;
+    }
+
+    size_t bodies [1] = { bodyNum };
+    if (symmetricForces)
+    {
+        // a work-group of one is a thread of the host
+        errorCode = queue.enqueueNDRangeKernel (pairForcesKernel, cl::NullRange, cl::NDRange (pairThreads), cl::NDRange (1), nullptr, &firstSimulationEvent);
+        if (errorCode != CL_SUCCESS)
+            return false;
+
+        errorCode = queue.enqueueNDRangeKernel (pairUpdateKernel, cl::NullRange, cl::NDRange (bodyNum), cl::NullRange, nullptr, &lastSimulationEvent);
+        if (errorCode != CL_SUCCESS)
+            return false;
+
+        profiler.Add ("PairForces", firstSimulationEvent);
+        profiler.Add ("PairUpdate", lastSimulationEvent);
+
+        return true;
+    }
+
+    errorCode = queue.enqueueNDRangeKernel (simulationKernel, cl::NullRange,
+        AutoTuner::GlobalRange (1, bodies, simulationLocalSize), AutoTuner::LocalRange (1, simulationLocalSize), nullptr, &lastSimulationEvent);
+    if (errorCode != CL_SUCCESS)
         return false;
 
+    profiler.Add ("SimulationKernel", lastSimulationEvent);
+    firstSimulationEvent = lastSimulationEvent;
+
     return true;
 }
 
 
 void RunSimulationKernel (void)
 {
-    errorCode = simulationKernel.setArg (0, particlesBufferGPU);
-    errorCode |= simulationKernel.setArg (1, (int)BODY_NUM);
-    if (errorCode != CL_SUCCESS)
+    if (!EnqueueSimulationStep ())
         exit (-1);
 
-    errorCode = queue.enqueueNDRangeKernel (simulationKernel, cl::NullRange, cl::NDRange (BODY_NUM), cl::NullRange, nullptr, nullptr);
-    if (errorCode != CL_SUCCESS)
+    SwapState ();
+    simulationStep++;
+    if (collisions.IsEnabled () && simulationStep % COLLISION_EVERY == 0 && !CollideBodies ())
+        exit (-1);
+
+    if (!trajectoryWriter.Record (queue (), particlesBufferGPU (), simulationStep))
+        exit (-1);
+
+    if (CHECKPOINT_EVERY > 0 && simulationStep % CHECKPOINT_EVERY == 0 && !SaveSnapshot ())
         exit (-1);
 }
 
 
+// picks the steps per frame from the last timed frame, once the device has finished it
+void AdaptStepsToBudget (void)
+{
+    if (budgetSteps == 0)
+        return;
+
+    cl_int status = CL_COMPLETE;
+    errorCode = budgetLast.getInfo (CL_EVENT_COMMAND_EXECUTION_STATUS, &status);
+    if (errorCode != CL_SUCCESS || status > CL_COMPLETE)
+        return;
+
+    cl_ulong begin = 0;
+    cl_ulong end = 0;
+    errorCode = budgetFirst.getProfilingInfo (CL_PROFILING_COMMAND_START, &begin);
+    errorCode |= budgetLast.getProfilingInfo (CL_PROFILING_COMMAND_END, &end);
+    if (errorCode == CL_SUCCESS && end > begin)
+    {
+        const double msPerStep = (end - begin) * 1.0e-6 / budgetSteps;
+        stepsPerFrame = std::max (1, std::min (MAX_STEPS_PER_FRAME, static_cast<int> (FRAME_BUDGET_MS / msPerStep)));
+    }
+    budgetSteps = 0;
+}
+
+
+// the steps are only flushed with the readback of the frame, the host never waits for them
+void RunSimulationSteps (void)
+{
+    if (FRAME_BUDGET_MS > 0)
+        AdaptStepsToBudget ();
+
+    const bool timed = FRAME_BUDGET_MS > 0 && budgetSteps == 0;
+
+    for (int i = 0; i < stepsPerFrame; ++i)
+    {
+        RunSimulationKernel ();
+        if (timed && i == 0)
+            budgetFirst = firstSimulationEvent;
+    }
+
+    if (timed)
+    {
+        budgetLast = lastSimulationEvent;
+        budgetSteps = stepsPerFrame;
+    }
+}
+
+
 void RunVisualizationKernels (void)
 {
-    errorCode = visualizationClearKernel.setArg (0, visualizationWidth);
-    errorCode |= visualizationClearKernel.setArg (1, visualizationHeight);
-    errorCode |= visualizationClearKernel.setArg (2, visualizationBufferGPU);
-    if (errorCode != CL_SUCCESS)
+    // the frame rendered into may still be mapped by the host from an earlier presentation
+    if (!visualizationFrames.Acquire (queue ()) || !SetVisualizationArguments ())
         exit (-1);
 
+    size_t bodies [1] = { bodyNum };
+    size_t pixels [2] = { (size_t)visualizationWidth, (size_t)visualizationHeight };
+
+    // the frame is overwritten completely by the tone mapping, only the maximum is reset
     cl::Event event;
-    errorCode = queue.enqueueNDRangeKernel (visualizationClearKernel, cl::NullRange, cl::NDRange (visualizationWidth, visualizationHeight), cl::NullRange, nullptr, &event);
+    errorCode = queue.enqueueFillBuffer (maxDensityBuffer, cl_uint (0), 0, sizeof (cl_uint), nullptr, &event);
     if (errorCode != CL_SUCCESS)
         exit (-1);
 
-    errorCode = visualizationKernel.setArg (0, visualizationWidth);
-    errorCode |= visualizationKernel.setArg (1, visualizationHeight);
-    errorCode |= visualizationKernel.setArg (2, visualizationBufferGPU);
-    errorCode |= visualizationKernel.setArg (3, particlesBufferGPU);
+    profiler.Add ("ClearMaxDensity", event);
+
+    if (threeDimensions)
+    {
+        if (!space.Render (queue, densityBuffer, visualizationWidth, visualizationHeight, bodyNum))
+            exit (-1);
+    }
+    else
+    {
+        errorCode = queue.enqueueNDRangeKernel (visualizationKernel, cl::NullRange,
+            AutoTuner::GlobalRange (1, bodies, visualizationLocalSize), AutoTuner::LocalRange (1, visualizationLocalSize), nullptr, &event);
+        if (errorCode != CL_SUCCESS)
+            exit (-1);
+
+        profiler.Add ("Visualization", event);
+    }
+
+    // a few thousand work-items are enough for the maximum, they keep the atomics few
+    const size_t pixelCount = visualizationWidth * visualizationHeight;
+    errorCode = queue.enqueueNDRangeKernel (densityMaxKernel, cl::NullRange, cl::NDRange (std::min<size_t> (pixelCount, 16384)), cl::NullRange, nullptr, &event);
     if (errorCode != CL_SUCCESS)
         exit (-1);
-    
-    errorCode = queue.enqueueNDRangeKernel (visualizationKernel, cl::NullRange, cl::NDRange (BODY_NUM), cl::NullRange, nullptr, &event);
+
+    profiler.Add ("DensityMax", event);
+
+    errorCode = queue.enqueueNDRangeKernel (toneMapKernel, cl::NullRange,
+        AutoTuner::GlobalRange (2, pixels, toneMapLocalSize), AutoTuner::LocalRange (2, toneMapLocalSize), nullptr, &event);
     if (errorCode != CL_SUCCESS)
         exit (-1);
 
-    errorCode = 
-        queue.enqueueReadBuffer (visualizationBufferGPU, CL_TRUE, 0, sizeof (cl_float4) * visualizationWidth * visualizationHeight, visualizationBufferCPU, nullptr, &event);
-    if (errorCode != CL_SUCCESS)
+    profiler.Add ("ToneMap", event);
+
+    // the video is converted on the device, before the slot moves on
+    if (!videoStream.Encode (queue (), visualizationFrames.Current (), visualizationWidth, visualizationHeight))
+        exit (-1);
+
+    // non-blocking readback straight into a pixel buffer of the presenter, chained to the rendering through its event
+    if (!visualizationFrames.Submit (queue (), event (), presenter.Acquire ()))
         exit (-1);
 
-    glDrawPixels (visualizationWidth, visualizationHeight, GL_RGBA, GL_FLOAT, visualizationBufferCPU);
+    profiler.Collect ();
+
+    // the oldest frame in flight is shown while the device works on the newer ones
+    const void* frame = visualizationFrames.Present ();
+    if (frame == nullptr)
+        return;
+
+    // dumping the frame before the upload, which may unmap the pixel buffer; the file is written by the writer thread
+    if (frameWriter.IsEnabled ())
+        frameWriter.Write (static_cast<const unsigned char*> (frame), visualizationWidth, visualizationHeight, 4);
+
+    presenter.Upload (frame);
 }
 
 
 void DestroySimulation (void)
 {
-    if (visualizationBufferCPU != nullptr)
-        delete [] visualizationBufferCPU;
+    snapshotWriter.Release ();
+    trajectoryWriter.Stop ();
+    frameWriter.Stop ();
+    videoStream.Stop ();
+    visualizationFrames.Release ();
+    presenter.Release ();
+    profiler.Finish (queue ());
+
     if (particlesBufferCPU != nullptr)
         delete [] particlesBufferCPU;
 }
@@ -274,6 +1288,11 @@ void InitOpenGL (void)
 {
     glClearColor (0.17f, 0.4f, 0.6f, 1.0f);
     glDisable (GL_DEPTH_TEST);
+
+    // one pixel buffer for each frame in flight, one being uploaded and one spare
+    if (!presenter.Init (GL_RGBA, GL_UNSIGNED_BYTE, sizeof (cl_uchar4), FrameRing::DefaultSize () + 2)
+        || !presenter.Resize (visualizationWidth, visualizationHeight))
+        exit (-1);
 }
 
 
@@ -281,8 +1300,9 @@ void Display (void)
 {
     glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    RunSimulationKernel ();
+    RunSimulationSteps ();
     RunVisualizationKernels ();
+    presenter.Draw ();
 
     glutSwapBuffers ();
 }
@@ -309,6 +1329,34 @@ void KeyUp (unsigned char key, int /*x*/, int /*y*/)
         ResetSimulation ();
         break;
 
+    case 'S': case 's':
+        SaveSnapshot ();
+        break;
+
+    case 'F': case 'f':
+        if (threeDimensions)
+            break;
+        if (!SelectForceVariant ((forceVariant + 1) % FORCE_VARIANT_COUNT))
+            exit (-1);
+        std::cout << FORCE_VARIANTS [forceVariant].name << " force" << std::endl;
+        break;
+
+    case '1': case '2': case '3': case '4': case '5': case '6':
+        initialModel = key - '1';
+        std::cout << INITIAL_MODEL_NAMES [initialModel] << " initial conditions" << std::endl;
+        ResetSimulation ();
+        break;
+
+    case '+':
+        stepsPerFrame = std::min (MAX_STEPS_PER_FRAME, stepsPerFrame * 2);
+        std::cout << stepsPerFrame << " steps per frame" << std::endl;
+        break;
+
+    case '-':
+        stepsPerFrame = std::max (1, stepsPerFrame / 2);
+        std::cout << stepsPerFrame << " steps per frame" << std::endl;
+        break;
+
     case 27:
         DestroySimulation ();
         exit (0);
@@ -317,13 +1365,24 @@ void KeyUp (unsigned char key, int /*x*/, int /*y*/)
 }
 
 
-void MouseClick (int /*button*/, int /*state*/, int /*x*/, int /*y*/)
+void MouseClick (int /*button*/, int state, int x, int y)
 {
+    if (state == GLUT_DOWN)
+    {
+        mouseX = x;
+        mouseY = y;
+    }
 }
 
 
-void MouseMove (int /*x*/, int /*y*/)
+// dragging turns the camera of the bodies in space around the centre of the box
+void MouseMove (int x, int y)
 {
+    if (threeDimensions)
+        space.Orbit (0.01f * (mouseX - x), 0.01f * (y - mouseY));
+
+    mouseX = x;
+    mouseY = y;
 }
 
 
@@ -331,14 +1390,314 @@ void Reshape (int newWidth, int newHeight)
 {
     visualizationWidth = newWidth;
     visualizationHeight = newHeight;
-    AllocateVisualizationBuffers ();
+    // the frames in flight are dropped before their pixel buffers go away
+    if (!AllocateVisualizationBuffers () || !presenter.Resize (visualizationWidth, visualizationHeight))
+        exit (-1);
     glViewport (0, 0, visualizationWidth, visualizationHeight);
 }
 
 
+// the batch mode, every system starts from the same kind of random state as the interactive one
+int RunEnsemble (void)
+{
+    std::vector<EnsembleSystem> systems;
+    if (!ReadEnsembleFile (ENSEMBLE_PATH, systems) || !InitRuntime (runtime))
+        return -1;
+
+    queue = runtime.queue;
+
+    Ensemble ensemble;
+    if (!ensemble.Init (runtime, systems))
+        return -1;
+
+    std::vector<cl_float4> particles (ensemble.BodyCount ());
+    for (size_t i = 0; i < particles.size (); ++i)
+        particles [i] = RandomBody ();
+
+    const bool succeeded = ensemble.Run (queue, particles, std::max (1, GetEnvironmentInt ("NBODY_ENSEMBLE_STEPS", 1000)));
+    profiler.Finish (queue ());
+
+    return succeeded ? 0 : -1;
+}
+
+
+// Every force variant in every precision computes the accelerations of the same initial state, they
+// are compared to the double precision reference on a sample of the bodies; then each of them integrates
+// the state and the energy drift is taken in double precision. The table gives the error bound and the
+// cost of each; the precisions the device has no fp64 for are left out. The FMM of every order follows
+// on the float state, timed on the wall clock over its steps with the device time of its last tree;
+// the tolerance is left to the direct sums.
+int RunAccuracyCheck (void)
+{
+    if (!InitRuntime (runtime, CL_QUEUE_PROFILING_ENABLE))
+        return -1;
+
+    context = runtime.context;
+    device = runtime.device;
+    queue = runtime.queue;
+
+    if (!BuildKernels () || !AllocateParticleBuffers () || !SelectPrecision (0) || !ResetSimulation ())
+        return -1;
+
+    std::vector<cl_float4> initial (bodyNum);
+    std::vector<cl_float4> integrated (bodyNum);
+    std::vector<cl_float2> accelerations (bodyNum);
+    cl::Buffer accelerationBuffer (context, CL_MEM_WRITE_ONLY, sizeof (cl_float2) * bodyNum, nullptr, &errorCode);
+    if (errorCode != CL_SUCCESS || queue.enqueueReadBuffer (particlesBufferGPU, true, 0, sizeof (cl_float4) * bodyNum, &initial [0]) != CL_SUCCESS)
+        return -1;
+
+    // an even stride over the bodies, the generators do not order them
+    std::vector<size_t> sample;
+    std::vector<double> reference;
+    const size_t stride = std::max<size_t> (1, bodyNum / ACCURACY_SAMPLE);
+    for (size_t i = 0; i < bodyNum; i += stride)
+    {
+        double a [2];
+        ReferenceAcceleration (initial, i, GRAVITY, SOFTENING, a);
+        sample.push_back (i);
+        reference.push_back (a [0]);
+        reference.push_back (a [1]);
+    }
+
+    const double initialEnergy = ReferenceEnergy (initial, GRAVITY, SOFTENING);
+    const double tolerance = ACCURACY_TOLERANCE != nullptr ? atof (ACCURACY_TOLERANCE) : 0.0;
+    bool passed = true;
+
+    std::cout << bodyNum << " " << INITIAL_MODEL_NAMES [initialModel] << " bodies, " << sample.size () << " compared, "
+        << ACCURACY_STEPS << " steps\n";
+    std::cout << "precision variant  step        max rel. error   rms rel. error   energy drift    ms / step\n";
+
+    for (int mode = 0; mode < PRECISION_COUNT * FORCE_VARIANT_COUNT; ++mode)
+    {
+        const int variant = mode % FORCE_VARIANT_COUNT;
+        if (NeedsDouble (PRECISIONS [mode / FORCE_VARIANT_COUNT]) && !SupportsDouble ())
+            continue;
+
+        forceVariant = variant;
+        if (!SelectPrecision (mode / FORCE_VARIANT_COUNT))
+            return -1;
+
+        cl::Kernel accelerationKernel (forcePrograms [precision][variant], "AccelerationKernel", &errorCode);
+        if (errorCode != CL_SUCCESS)
+            return -1;
+
+        errorCode = queue.enqueueWriteBuffer (particlesBufferGPU, true, 0, sizeof (cl_float4) * bodyNum, &initial [0]);
+        if (errorCode != CL_SUCCESS || !PromoteState ())
+            return -1;
+
+        // the symmetric rows compare the pair pass and the reduction of its buffers, the others the direct sum
+        if (symmetricForces)
+        {
+            cl::Kernel pairAccelerationKernel (forcePrograms [precision][variant], "PairAccelerations", &errorCode);
+            if (errorCode != CL_SUCCESS || !SetSimulationArguments ())
+                return -1;
+
+            errorCode = pairAccelerationKernel.setArg (0, pairForceBuffer);
+            errorCode |= pairAccelerationKernel.setArg (1, accelerationBuffer);
+            errorCode |= pairAccelerationKernel.setArg (2, (int)bodyNum);
+            errorCode |= pairAccelerationKernel.setArg (3, (int)pairThreads);
+            errorCode |= queue.enqueueNDRangeKernel (pairForcesKernel, cl::NullRange, cl::NDRange (pairThreads), cl::NDRange (1));
+            errorCode |= queue.enqueueNDRangeKernel (pairAccelerationKernel, cl::NullRange, cl::NDRange (bodyNum), cl::NullRange);
+        }
+        else
+        {
+            errorCode = accelerationKernel.setArg (0, DoubleState (PRECISIONS [precision]) ? stateBuffer : particlesBufferGPU);
+            errorCode |= accelerationKernel.setArg (1, accelerationBuffer);
+            errorCode |= accelerationKernel.setArg (2, (int)bodyNum);
+            errorCode |= accelerationKernel.setArg (3, ewaldBuffer);
+            errorCode |= queue.enqueueNDRangeKernel (accelerationKernel, cl::NullRange, cl::NDRange (bodyNum), cl::NullRange);
+        }
+        errorCode |= queue.enqueueReadBuffer (accelerationBuffer, true, 0, sizeof (cl_float2) * bodyNum, &accelerations [0]);
+        if (errorCode != CL_SUCCESS)
+            return -1;
+
+        const AccelerationError error = CompareAccelerations (accelerations, sample, reference);
+
+        cl::Event first;
+        for (int step = 0; step < ACCURACY_STEPS; ++step)
+        {
+            if (!EnqueueSimulationStep ())
+                return -1;
+
+            if (step == 0)
+                first = firstSimulationEvent;
+            SwapState ();
+        }
+
+        if (queue.enqueueReadBuffer (particlesBufferGPU, true, 0, sizeof (cl_float4) * bodyNum, &integrated [0]) != CL_SUCCESS)
+            return -1;
+
+        const double drift = std::fabs ((ReferenceEnergy (integrated, GRAVITY, SOFTENING) - initialEnergy) / initialEnergy);
+
+        double msPerStep = 0.0;
+        cl_ulong begin = 0;
+        cl_ulong end = 0;
+        if (ACCURACY_STEPS > 0 && first.getProfilingInfo (CL_PROFILING_COMMAND_START, &begin) == CL_SUCCESS
+            && lastSimulationEvent.getProfilingInfo (CL_PROFILING_COMMAND_END, &end) == CL_SUCCESS)
+            msPerStep = (end - begin) * 1.0e-6 / ACCURACY_STEPS;
+
+        const bool failed = tolerance > 0.0 && error.max > tolerance;
+        passed = passed && !failed;
+
+        char row [128];
+        snprintf (row, sizeof (row), "%-9s %-8s %-9s %16.4g %16.4g %14.4g %12.4g%s\n",
+            PRECISIONS [precision].name, FORCE_VARIANTS [variant].name, symmetricForces ? "symmetric" : "direct", error.max, error.rms, drift, msPerStep, failed ? "   above the tolerance" : "");
+        std::cout << row;
+    }
+
+    if (!SelectPrecision (0))
+        return -1;
+
+    std::cout << "fmm, theta " << FMM_THETA << ", leaf " << FMM_LEAF << "\n";
+    std::cout << "order                          max rel. error   rms rel. error   energy drift    ms / step      tree ms\n";
+
+    for (int order = 1; order <= FMM_MAX_ORDER; ++order)
+    {
+        Fmm solver;
+        if (!InitFmm (solver, order)
+            || queue.enqueueWriteBuffer (particlesBufferGPU, true, 0, sizeof (cl_float4) * bodyNum, &initial [0]) != CL_SUCCESS
+            || !solver.Accelerations (queue, particlesBufferGPU, attributeBuffer, bodyNum)
+            || queue.enqueueReadBuffer (solver.AccelerationBuffer (), true, 0, sizeof (cl_float2) * bodyNum, &accelerations [0]) != CL_SUCCESS)
+            return -1;
+
+        const AccelerationError error = CompareAccelerations (accelerations, sample, reference);
+
+        const std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now ();
+        for (int step = 0; step < ACCURACY_STEPS; ++step)
+        {
+            if (!solver.Step (queue, particlesBufferGPU, attributeBuffer, particlesBufferNext, bodyNum, firstSimulationEvent, lastSimulationEvent))
+                return -1;
+
+            SwapState ();
+        }
+
+        if (queue.enqueueReadBuffer (particlesBufferGPU, true, 0, sizeof (cl_float4) * bodyNum, &integrated [0]) != CL_SUCCESS)
+            return -1;
+
+        // the tree of the last step, on the device
+        const double treeSeconds = solver.TreeSeconds ();
+
+        const double seconds = std::chrono::duration<double> (std::chrono::high_resolution_clock::now () - begin).count ();
+        const double drift = std::fabs ((ReferenceEnergy (integrated, GRAVITY, SOFTENING) - initialEnergy) / initialEnergy);
+        const int steps = std::max (1, ACCURACY_STEPS);
+
+        char row [128];
+        snprintf (row, sizeof (row), "%-28d %16.4g %16.4g %14.4g %12.4g %12.4g\n",
+            order, error.max, error.rms, drift, seconds * 1.0e3 / steps, treeSeconds * 1.0e3);
+        std::cout << row;
+    }
+
+    // the radix tree of the initial state: every internal node has the mass of its children and a box
+    // around theirs, the root is at the centre of mass of the bodies
+    RadixTree tree;
+    const size_t nodes = RadixTree::NodeCount (bodyNum);
+    std::vector<cl_float4> centres (nodes);
+    std::vector<cl_float4> boxes (nodes);
+    std::vector<cl_int2> children (std::max<size_t> (1, bodyNum - 1));
+    if (!tree.Init (runtime, bodyNum, StorageSource (false), StorageOptions (false))
+        || queue.enqueueWriteBuffer (particlesBufferGPU, true, 0, sizeof (cl_float4) * bodyNum, &initial [0]) != CL_SUCCESS
+        || !tree.Build (queue, particlesBufferGPU, attributeBuffer, bodyNum, firstSimulationEvent, lastSimulationEvent)
+        || queue.enqueueReadBuffer (tree.Centres (), true, 0, sizeof (cl_float4) * nodes, &centres [0]) != CL_SUCCESS
+        || queue.enqueueReadBuffer (tree.Boxes (), true, 0, sizeof (cl_float4) * nodes, &boxes [0]) != CL_SUCCESS
+        || (bodyNum > 1 && queue.enqueueReadBuffer (tree.Children (), true, 0, sizeof (cl_int2) * (bodyNum - 1), &children [0]) != CL_SUCCESS))
+        return -1;
+
+    size_t inconsistent = 0;
+    for (size_t i = 0; i + 1 < bodyNum; ++i)
+    {
+        const cl_float4& a = centres [children [i].s [0]];
+        const cl_float4& b = centres [children [i].s [1]];
+        const cl_float4& boxA = boxes [children [i].s [0]];
+        const cl_float4& boxB = boxes [children [i].s [1]];
+        const cl_float4& box = boxes [i];
+        const double mass = static_cast<double> (a.s [2]) + b.s [2];
+
+        if (std::fabs (centres [i].s [2] - mass) > 1.0e-5 * mass
+            || box.s [0] > std::min (boxA.s [0], boxB.s [0]) || box.s [1] > std::min (boxA.s [1], boxB.s [1])
+            || box.s [2] < std::max (boxA.s [2], boxB.s [2]) || box.s [3] < std::max (boxA.s [3], boxB.s [3]))
+            ++inconsistent;
+    }
+
+    double centre [2] = { 0.0, 0.0 };
+    for (size_t i = 0; i < bodyNum; ++i)
+    {
+        centre [0] += initial [i].s [0] / bodyNum;
+        centre [1] += initial [i].s [1] / bodyNum;
+    }
+
+    double buildMs = 0.0;
+    cl_ulong begin = 0;
+    cl_ulong end = 0;
+    if (firstSimulationEvent.getProfilingInfo (CL_PROFILING_COMMAND_START, &begin) == CL_SUCCESS
+        && lastSimulationEvent.getProfilingInfo (CL_PROFILING_COMMAND_END, &end) == CL_SUCCESS)
+        buildMs = (end - begin) * 1.0e-6;
+
+    passed = passed && inconsistent == 0;
+
+    std::cout << "radix tree                   root mass error   root centre error   inconsistent nodes     build ms\n";
+    char row [128];
+    snprintf (row, sizeof (row), "%-28s %16.4g %19.4g %20d %12.4g\n", "",
+        std::fabs (centres [0].s [2] - static_cast<double> (bodyNum)) / bodyNum,
+        std::hypot (centres [0].s [0] - centre [0], centres [0].s [1] - centre [1]), static_cast<int> (inconsistent), buildMs);
+    std::cout << row;
+    profiler.Finish (queue ());
+
+    return passed ? 0 : -1;
+}
+
+
 int main (int argc, char* argv [])
 {
-    srand (time (0));
+    rngState = static_cast<uint64_t> (GetEnvironmentInt ("NBODY_SEED", static_cast<int> (time (0)))) * 0x9E3779B97F4A7C15ull | 1;
+
+    if (ENSEMBLE_PATH != nullptr)
+        return RunEnsemble ();
+
+    initialModel = ParseInitialModel (INITIAL_MODEL);
+    forceVariant = ParseForceVariant (FORCE_VARIANT);
+    precision = ParsePrecision (PRECISION);
+    if (initialModel < 0 || forceVariant < 0 || precision < 0)
+        return -1;
+
+    if (STORAGE != "float" && STORAGE != "half")
+    {
+        std::cerr << "Unknown storage `" << STORAGE << "', the storages are: float half\n";
+        return -1;
+    }
+
+    if (SOLVER != "direct" && SOLVER != "fmm")
+    {
+        std::cerr << "Unknown solver `" << SOLVER << "', the solvers are: direct fmm\n";
+        return -1;
+    }
+
+    if (DIMENSIONS != 2 && DIMENSIONS != 3)
+    {
+        std::cerr << "The bodies move in 2 or 3 dimensions, not in " << DIMENSIONS << "\n";
+        return -1;
+    }
+
+    // the accuracy check compares the force kernels of the plane
+    if (ACCURACY_STEPS > 0 && DIMENSIONS == 3)
+    {
+        std::cerr << "The accuracy check takes the bodies in the plane\n";
+        return -1;
+    }
+
+    // the accuracy check compares float bodies of unit masses in open space
+    if (ACCURACY_STEPS > 0 && HasVariableMasses (initialModel))
+    {
+        std::cerr << "The accuracy check takes bodies of unit masses, not the " << INITIAL_MODEL_NAMES [initialModel] << " model\n";
+        return -1;
+    }
+
+    if (ACCURACY_STEPS > 0)
+        return RunAccuracyCheck ();
+
+    halfStorage = STORAGE == "half";
+    periodic = PERIODIC;
+    fmmSolver = SOLVER == "fmm";
+    threeDimensions = DIMENSIONS == 3;
 
     // OpenCL processing
     if (!InitSimulation ())
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "../Common.h"
+
+// Periodic boundaries: the unit square is the box, the bodies are wrapped into it and a pair is taken at
+// its minimum image. The pull of all the other images comes from a correction table, the Ewald sum of
+// the lattice minus the nearest image, sampled over the separations [-0.5, 0.5]^2 and interpolated
+// bilinearly by the kernels. The lattice is periodic in the plane and open across it, so the reciprocal
+// sum is the one of a two-dimensional lattice in three dimensions, evaluated in its plane (where the
+// k = 0 term adds no force). The images are softened like the nearest one, so the pull of a body and its
+// images is periodic and smooth, also where the nearest image changes (the FMM pairs far cells at the
+// nearest image of their centres, see FMM.h).
+const int EWALD_TABLE_SIZE = 65;
+const double EWALD_ALPHA = 2.0;
+const int SOFTENING_IMAGES = 8;
+
+
+// pull of a unit mass and all of its images at the separation (x, y), source minus body
+void EwaldPull (double x, double y, double pull [2])
+{
+    const double pi = 3.14159265358979323846;
+    pull [0] = 0.0;
+    pull [1] = 0.0;
+
+    // real space, erfc (4 alpha) is below the double precision
+    for (int nx = -4; nx <= 4; ++nx)
+    {
+        for (int ny = -4; ny <= 4; ++ny)
+        {
+            const double dx = x + nx;
+            const double dy = y + ny;
+            const double d = std::sqrt (dx * dx + dy * dy);
+            if (d < 1.0e-12)
+                continue;
+
+            const double magnitude = (std::erfc (EWALD_ALPHA * d) / (d * d)
+                + 2.0 * EWALD_ALPHA / std::sqrt (pi) * std::exp (-EWALD_ALPHA * EWALD_ALPHA * d * d) / d) / d;
+            pull [0] += magnitude * dx;
+            pull [1] += magnitude * dy;
+        }
+    }
+
+    // reciprocal space
+    for (int mx = -8; mx <= 8; ++mx)
+    {
+        for (int my = -8; my <= 8; ++my)
+        {
+            if (mx == 0 && my == 0)
+                continue;
+
+            const double kx = 2.0 * pi * mx;
+            const double ky = 2.0 * pi * my;
+            const double k = std::sqrt (kx * kx + ky * ky);
+            const double magnitude = 2.0 * pi * std::erfc (k / (2.0 * EWALD_ALPHA)) / k * std::sin (kx * x + ky * y);
+            pull [0] += magnitude * kx;
+            pull [1] += magnitude * ky;
+        }
+    }
+}
+
+
+// the softening of the pulls of the images of a unit mass at the separation (x, y), but the one at (x, y):
+// it falls off with the fourth power of the distance, the images are summed directly
+void SofteningPull (double x, double y, double softening, double pull [2])
+{
+    pull [0] = 0.0;
+    pull [1] = 0.0;
+
+    for (int nx = -SOFTENING_IMAGES; nx <= SOFTENING_IMAGES; ++nx)
+    {
+        for (int ny = -SOFTENING_IMAGES; ny <= SOFTENING_IMAGES; ++ny)
+        {
+            if (nx == 0 && ny == 0)
+                continue;
+
+            const double dx = x + nx;
+            const double dy = y + ny;
+            const double d2 = dx * dx + dy * dy;
+            const double softened = d2 + softening * softening;
+            const double magnitude = 1.0 / (softened * std::sqrt (softened)) - 1.0 / (d2 * std::sqrt (d2));
+            pull [0] += magnitude * dx;
+            pull [1] += magnitude * dy;
+        }
+    }
+}
+
+
+// EWALD_TABLE_SIZE^2 samples, row by row, the first one at (-0.5, -0.5)
+std::vector<cl_float2> EwaldCorrectionTable (double softening)
+{
+    std::vector<cl_float2> table (EWALD_TABLE_SIZE * EWALD_TABLE_SIZE);
+
+    for (int row = 0; row < EWALD_TABLE_SIZE; ++row)
+    {
+        for (int column = 0; column < EWALD_TABLE_SIZE; ++column)
+        {
+            const double x = column / (EWALD_TABLE_SIZE - 1.0) - 0.5;
+            const double y = row / (EWALD_TABLE_SIZE - 1.0) - 0.5;
+
+            double pull [2];
+            EwaldPull (x, y, pull);
+
+            double soft [2];
+            SofteningPull (x, y, softening, soft);
+            pull [0] += soft [0];
+            pull [1] += soft [1];
+
+            // the nearest image is left to the kernels, with the softening
+            const double d2 = x * x + y * y;
+            if (d2 > 0.0)
+            {
+                const double inverseCube = 1.0 / (d2 * std::sqrt (d2));
+                pull [0] -= x * inverseCube;
+                pull [1] -= y * inverseCube;
+            }
+
+            table [column + row * EWALD_TABLE_SIZE] = {{ static_cast<float> (pull [0]), static_cast<float> (pull [1]) }};
+        }
+    }
+
+    return table;
+}
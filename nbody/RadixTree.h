@@ -0,0 +1,409 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+
+#include "../Common.h"
+#include "../Runtime.h"
+#include "DeviceStage.h"
+
+// A binary radix tree of the bodies, built on the device without reading them back (Karras, "Maximizing
+// parallelism in the construction of BVHs, octrees, and k-d trees", 2012). The bodies get Morton codes
+// of 16 bits per axis in the square around their bounding box and are sorted by them with a radix sort of
+// four bits per pass. Every internal node of the tree is then found independently: node i covers a range
+// of the sorted codes that starts or ends at i, its split is where the common prefix of the range ends;
+// equal codes are told apart by their indices. The nodes are reduced bottom-up: every leaf walks up
+// to the root, the first child to arrive at a node leaves it to the second one (an atomic counter of the
+// node), which then combines the two, so each node is written once after both of its children.
+//
+// Of the 2n - 1 nodes, the n - 1 internal ones come first, with the root at 0; leaf k is node n - 1 + k
+// and holds the k-th body of the Morton order. An internal node has its two children, the range of
+// leaves it covers, its centre of mass (x, y, mass, 0) and its bounding box (min x, min y, max x, max y);
+// the leaves of one internal node are a quadtree cell of the Morton grid or a part of one.
+//
+// Built after the accessors of the particle buffers (see ForceVariants.h) and SCAN_KERNEL_SOURCE.
+const char* RADIX_TREE_KERNEL_SOURCE = STRINGIFY (
+    // the bits of a 16 bit value spread to the even bits
+    uint SpreadBits (uint v)
+    {
+        v &= 0xFFFFu;
+        v = (v | (v << 8)) & 0x00FF00FFu;
+        v = (v | (v << 4)) & 0x0F0F0F0Fu;
+        v = (v | (v << 2)) & 0x33333333u;
+        v = (v | (v << 1)) & 0x55555555u;
+        return v;
+    }
+
+    // the bounding box of the bodies (min x, min y, max x, max y), in one work-group of a power of two
+    __kernel
+    void MeasureBounds (__global const PARTICLE_MEMORY* particles, __global float4* bounds, __local float4* scratch, const int BODY_NUM)
+    {
+        int lid = get_local_id (0);
+        float4 box = (float4) (INFINITY, INFINITY, -INFINITY, -INFINITY);
+        for (int i = lid; i < BODY_NUM; i += get_local_size (0))
+        {
+            float2 p = LOAD_PARTICLE (i, particles).xy;
+            box = (float4) (fmin (box.xy, p), fmax (box.zw, p));
+        }
+
+        scratch [lid] = box;
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (int half = get_local_size (0) / 2; half > 0; half /= 2)
+        {
+            if (lid < half)
+                scratch [lid] = (float4) (fmin (scratch [lid].xy, scratch [lid + half].xy), fmax (scratch [lid].zw, scratch [lid + half].zw));
+            barrier (CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (lid == 0)
+            bounds [0] = scratch [0];
+    }
+
+    // the codes interleave y and x, the grid is square over the larger side of the box
+    __kernel
+    void MortonCodes (__global const PARTICLE_MEMORY* particles, __global const float4* bounds, __global uint* keys,
+        __global int* values, const int BODY_NUM)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        float4 box = bounds [0];
+        float side = fmax (fmax (box.z - box.x, box.w - box.y), 1.0e-30f);
+        float2 p = (LOAD_PARTICLE (id, particles).xy - box.xy) / side;
+        uint2 cell = convert_uint2_sat_rtz (p * 65535.0f);
+
+        keys [id] = SpreadBits (cell.x) | (SpreadBits (cell.y) << 1);
+        values [id] = id;
+    }
+
+    // the digits of the work-group, digit major: groupCounts [digit * groups + group]
+    __kernel
+    void RadixCount (__global const uint* keys, __global int* groupCounts, __local int* counts, const int shift, const int BODY_NUM)
+    {
+        int id = get_global_id (0);
+        int lid = get_local_id (0);
+        if (lid < 16)
+            counts [lid] = 0;
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        if (id < BODY_NUM)
+            atomic_inc (counts + ((keys [id] >> shift) & 15u));
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        if (lid < 16)
+            groupCounts [lid * get_num_groups (0) + get_group_id (0)] = counts [lid];
+    }
+
+    // stable: the keys of a digit keep their order within the work-group, the work-groups keep theirs
+    __kernel
+    void RadixScatter (__global const uint* keys, __global const int* values, __global uint* sortedKeys, __global int* sortedValues,
+        __global const int* groupPlaces, __local int* scratch, const int shift, const int BODY_NUM)
+    {
+        int id = get_global_id (0);
+        uint key = id < BODY_NUM ? keys [id] : 0u;
+        int digit = id < BODY_NUM ? (int) ((key >> shift) & 15u) : -1;
+
+        for (int d = 0; d < 16; ++d)
+        {
+            int flag = digit == d;
+            int rank = GroupScan (scratch, flag) - flag;
+            if (flag)
+            {
+                int place = groupPlaces [d * get_num_groups (0) + get_group_id (0)] + rank;
+                sortedKeys [place] = key;
+                sortedValues [place] = id < BODY_NUM ? values [id] : 0;
+            }
+        }
+    }
+
+    // the length of the common prefix of the codes i and j, with the indices appended to equal codes; -1 outside
+    int CommonPrefix (__global const uint* keys, int i, int j, int count)
+    {
+        if (j < 0 || j >= count)
+            return -1;
+
+        uint a = keys [i];
+        uint b = keys [j];
+        return a == b ? 32 + (int) clz ((uint) (i ^ j)) : (int) clz (a ^ b);
+    }
+
+    // internal node i: the direction of its range, the other end by an exponential and a binary search, then the split
+    __kernel
+    void BuildRadixTree (__global const uint* keys, __global int2* children, __global int* parents, __global int2* ranges,
+        __global int* arrivals, const int BODY_NUM)
+    {
+        int i = get_global_id (0);
+        if (i >= BODY_NUM - 1)
+            return;
+
+        int d = CommonPrefix (keys, i, i + 1, BODY_NUM) >= CommonPrefix (keys, i, i - 1, BODY_NUM) ? 1 : -1;
+        int shortest = CommonPrefix (keys, i, i - d, BODY_NUM);
+
+        int bound = 2;
+        while (CommonPrefix (keys, i, i + bound * d, BODY_NUM) > shortest)
+            bound *= 2;
+
+        int length = 0;
+        for (int step = bound / 2; step >= 1; step /= 2)
+        {
+            if (CommonPrefix (keys, i, i + (length + step) * d, BODY_NUM) > shortest)
+                length += step;
+        }
+
+        int j = i + length * d;
+        int prefix = CommonPrefix (keys, i, j, BODY_NUM);
+
+        int split = 0;
+        int step = length;
+        do
+        {
+            step = (step + 1) / 2;
+            if (CommonPrefix (keys, i, i + (split + step) * d, BODY_NUM) > prefix)
+                split += step;
+        } while (step > 1);
+
+        int gamma = i + split * d + min (d, 0);
+        int first = min (i, j);
+        int last = max (i, j);
+        int left = first == gamma ? BODY_NUM - 1 + gamma : gamma;
+        int right = last == gamma + 1 ? BODY_NUM + gamma : gamma + 1;
+
+        children [i] = (int2) (left, right);
+        ranges [i] = (int2) (first, last);
+        parents [left] = i;
+        parents [right] = i;
+        arrivals [i] = 0;
+        if (i == 0)
+            parents [0] = -1;
+    }
+
+    // one work-item per leaf, up to the first node whose other child is still missing
+    __kernel
+    void ReduceRadixTree (__global const PARTICLE_MEMORY* particles, __global const float4* attributes, __global const int* values,
+        __global const int2* children, __global const int* parents, volatile __global float4* centres, volatile __global float4* boxes,
+        __global int* arrivals, const int BODY_NUM)
+    {
+        int k = get_global_id (0);
+        if (k >= BODY_NUM)
+            return;
+
+        int body = values [k];
+        float2 p = LOAD_PARTICLE (body, particles).xy;
+        int node = BODY_NUM - 1 + k;
+        centres [node] = (float4) (p, attributes [body].x, 0.0f);
+        boxes [node] = (float4) (p, p);
+
+        node = BODY_NUM > 1 ? parents [node] : -1;
+        while (node >= 0)
+        {
+            // the writes of this child are visible before the second one can see the count
+            mem_fence (CLK_GLOBAL_MEM_FENCE);
+            if (atomic_inc (arrivals + node) == 0)
+                return;
+
+            int2 c = children [node];
+            float4 a = centres [c.x];
+            float4 b = centres [c.y];
+            float4 boxA = boxes [c.x];
+            float4 boxB = boxes [c.y];
+
+            float mass = a.z + b.z;
+            float2 centre = mass > 0.0f ? (a.xy * a.z + b.xy * b.z) / mass : 0.5f * (a.xy + b.xy);
+            centres [node] = (float4) (centre, mass, 0.0f);
+            boxes [node] = (float4) (fmin (boxA.xy, boxB.xy), fmax (boxA.zw, boxB.zw));
+
+            node = parents [node];
+        }
+    }
+);
+
+
+// The tree of the bodies, walked by the broad phase of the collisions (see Collisions.h) and by the
+// FMM (see FMM.h). The buffers are allocated for the body count it starts with and stay on the device.
+class RadixTree
+{
+public:
+    RadixTree () : capacity (0), localSize (1) {}
+
+    size_t Capacity () const
+    {
+        return capacity;
+    }
+
+    static size_t NodeCount (size_t bodies)
+    {
+        return 2 * bodies - 1;
+    }
+
+    // the body of every leaf, in Morton order
+    const cl::Buffer& Bodies () const { return values [0]; }
+    const cl::Buffer& Keys () const { return keys [0]; }
+    const cl::Buffer& Bounds () const { return bounds; }
+
+    // the internal nodes
+    const cl::Buffer& Children () const { return children; }
+    const cl::Buffer& Ranges () const { return ranges; }
+
+    // all the nodes
+    const cl::Buffer& Parents () const { return parents; }
+    const cl::Buffer& Centres () const { return centres; }
+    const cl::Buffer& Boxes () const { return boxes; }
+
+    bool Init (const Runtime& runtime, size_t bodies, const std::string& prefix, const std::string& options)
+    {
+        context = runtime.context;
+
+        program = BuildStageProgram (runtime, prefix + SCAN_KERNEL_SOURCE, RADIX_TREE_KERNEL_SOURCE, options);
+        if (program () == nullptr)
+            return false;
+
+        cl::Kernel* kernels [] = { &boundsKernel, &mortonKernel, &countKernel, &scanKernel, &scatterKernel, &buildKernel, &reduceKernel };
+        const char* names [] = { "MeasureBounds", "MortonCodes", "RadixCount", "ScanGroups", "RadixScatter", "BuildRadixTree", "ReduceRadixTree" };
+        if (!CreateKernels (program, kernels, names, 7))
+            return false;
+
+        // the scans and the reduction run in work-groups of a power of two, at least one work-item per digit
+        size_t maxLocal = boundsKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (runtime.device);
+        maxLocal = std::min (maxLocal, countKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (runtime.device));
+        maxLocal = std::min (maxLocal, scanKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (runtime.device));
+        maxLocal = std::min (maxLocal, scatterKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (runtime.device));
+        localSize = 16;
+        while (localSize * 2 <= std::min<size_t> (maxLocal, 256))
+            localSize *= 2;
+
+        if (maxLocal < localSize)
+        {
+            std::cerr << "The radix tree needs work-groups of 16\n";
+            return false;
+        }
+
+        const size_t groups = (bodies + localSize - 1) / localSize;
+        const size_t internal = std::max<size_t> (1, bodies - 1);
+        cl::Buffer* buffers [] = { &keys [0], &keys [1], &values [0], &values [1], &groupCounts, &total, &bounds,
+            &children, &ranges, &arrivals, &parents, &centres, &boxes };
+        const size_t bytes [] = { sizeof (cl_uint) * bodies, sizeof (cl_uint) * bodies, sizeof (cl_int) * bodies, sizeof (cl_int) * bodies,
+            16 * sizeof (cl_int) * groups, sizeof (cl_uint), sizeof (cl_float4), sizeof (cl_int2) * internal, sizeof (cl_int2) * internal, sizeof (cl_int) * internal,
+            sizeof (cl_int) * NodeCount (bodies), sizeof (cl_float4) * NodeCount (bodies), sizeof (cl_float4) * NodeCount (bodies) };
+        for (int i = 0; i < 13; ++i)
+        {
+            cl_int err = CL_SUCCESS;
+            *buffers [i] = cl::Buffer (context, CL_MEM_READ_WRITE, bytes [i], nullptr, &err);
+            if (!CheckCLError (err))
+                return false;
+        }
+
+        capacity = bodies;
+
+        return true;
+    }
+
+    // the tree of the first `bodyCount' bodies (at most the capacity), nothing is read back; the first and
+    // the last command are kept for the timing
+    bool Build (cl::CommandQueue& queue, const cl::Buffer& particles, const cl::Buffer& attributes, size_t bodyCount,
+        cl::Event& first, cl::Event& last)
+    {
+        const cl_int bodies = static_cast<cl_int> (bodyCount);
+        const size_t groups = (bodyCount + localSize - 1) / localSize;
+        const cl_int digitCount = static_cast<cl_int> (16 * groups);
+
+        cl_int err = boundsKernel.setArg (0, particles);
+        err |= boundsKernel.setArg (1, bounds);
+        err |= boundsKernel.setArg (2, cl::Local (sizeof (cl_float4) * localSize));
+        err |= boundsKernel.setArg (3, bodies);
+
+        err |= mortonKernel.setArg (0, particles);
+        err |= mortonKernel.setArg (1, bounds);
+        err |= mortonKernel.setArg (2, keys [0]);
+        err |= mortonKernel.setArg (3, values [0]);
+        err |= mortonKernel.setArg (4, bodies);
+
+        err |= countKernel.setArg (1, groupCounts);
+        err |= countKernel.setArg (2, cl::Local (16 * sizeof (cl_int)));
+        err |= countKernel.setArg (4, bodies);
+
+        err |= scanKernel.setArg (0, groupCounts);
+        err |= scanKernel.setArg (1, total);
+        err |= scanKernel.setArg (2, cl::Local (sizeof (cl_int) * localSize));
+        err |= scanKernel.setArg (3, digitCount);
+
+        err |= scatterKernel.setArg (4, groupCounts);
+        err |= scatterKernel.setArg (5, cl::Local (sizeof (cl_int) * localSize));
+        err |= scatterKernel.setArg (7, bodies);
+        if (!CheckCLError (err)
+            || !LaunchKernel (queue, boundsKernel, "MeasureBounds", cl::NDRange (localSize), cl::NDRange (localSize), &first)
+            || !LaunchKernel (queue, mortonKernel, "MortonCodes", cl::NDRange (bodyCount), cl::NullRange))
+            return false;
+
+        // eight passes of four bits, the sorted codes end up in the first buffers again
+        for (int pass = 0; pass < 8; ++pass)
+        {
+            const int from = pass & 1;
+            const cl_int shift = 4 * pass;
+
+            err = countKernel.setArg (0, keys [from]);
+            err |= countKernel.setArg (3, shift);
+
+            err |= scatterKernel.setArg (0, keys [from]);
+            err |= scatterKernel.setArg (1, values [from]);
+            err |= scatterKernel.setArg (2, keys [1 - from]);
+            err |= scatterKernel.setArg (3, values [1 - from]);
+            err |= scatterKernel.setArg (6, shift);
+            if (!CheckCLError (err)
+                || !LaunchKernel (queue, countKernel, "RadixCount", cl::NDRange (groups * localSize), cl::NDRange (localSize))
+                || !LaunchKernel (queue, scanKernel, "ScanGroups", cl::NDRange (localSize), cl::NDRange (localSize))
+                || !LaunchKernel (queue, scatterKernel, "RadixScatter", cl::NDRange (groups * localSize), cl::NDRange (localSize)))
+                return false;
+        }
+
+        err = buildKernel.setArg (0, keys [0]);
+        err |= buildKernel.setArg (1, children);
+        err |= buildKernel.setArg (2, parents);
+        err |= buildKernel.setArg (3, ranges);
+        err |= buildKernel.setArg (4, arrivals);
+        err |= buildKernel.setArg (5, bodies);
+
+        err |= reduceKernel.setArg (0, particles);
+        err |= reduceKernel.setArg (1, attributes);
+        err |= reduceKernel.setArg (2, values [0]);
+        err |= reduceKernel.setArg (3, children);
+        err |= reduceKernel.setArg (4, parents);
+        err |= reduceKernel.setArg (5, centres);
+        err |= reduceKernel.setArg (6, boxes);
+        err |= reduceKernel.setArg (7, arrivals);
+        err |= reduceKernel.setArg (8, bodies);
+
+        // a single body is a leaf and the root, without internal nodes
+        return CheckCLError (err)
+            && (bodyCount < 2 || LaunchKernel (queue, buildKernel, "BuildRadixTree", cl::NDRange (bodyCount - 1), cl::NullRange))
+            && LaunchKernel (queue, reduceKernel, "ReduceRadixTree", cl::NDRange (bodyCount), cl::NullRange, &last);
+    }
+
+private:
+    size_t capacity;
+    size_t localSize;
+
+    cl::Context context;
+    cl::Program program;
+    cl::Kernel boundsKernel;
+    cl::Kernel mortonKernel;
+    cl::Kernel countKernel;
+    cl::Kernel scanKernel;
+    cl::Kernel scatterKernel;
+    cl::Kernel buildKernel;
+    cl::Kernel reduceKernel;
+
+    cl::Buffer keys [2];
+    cl::Buffer values [2];
+    cl::Buffer groupCounts;
+    // the body count, from the scans
+    cl::Buffer total;
+    cl::Buffer bounds;
+    cl::Buffer children;
+    cl::Buffer ranges;
+    cl::Buffer arrivals;
+    cl::Buffer parents;
+    cl::Buffer centres;
+    cl::Buffer boxes;
+};
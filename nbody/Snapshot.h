@@ -0,0 +1,338 @@
+#pragma once
+
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../Common.h"
+
+// Versioned binary snapshot of the simulation state. The header is padded to a page, so the
+// particle array of a memory-mapped file is page aligned and can back a CL_MEM_USE_HOST_PTR buffer.
+// Version 2 appends the attributes of the bodies (see InitialConditions.h) after the particles,
+// version 1 files are still read, their bodies have unit masses.
+const char SNAPSHOT_MAGIC [8] = { 'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P' };
+const uint32_t SNAPSHOT_VERSION = 2;
+const uint32_t SNAPSHOT_HEADER_BYTES = 4096;
+
+struct SnapshotHeader
+{
+    char magic [8];
+    uint32_t version;
+    uint32_t headerBytes;           // offset of the particle array
+    uint64_t bodyCount;
+    uint32_t floatsPerBody;         // position.xy + velocity.xy
+    uint32_t floatsPerAttribute;    // mass, radius, type, 0; none before version 2
+    uint64_t step;
+    double time;
+    uint64_t rngState;
+    double timeStep;
+    double gravity;
+    double softening;
+};
+
+
+SnapshotHeader MakeSnapshotHeader (uint64_t bodyCount, uint64_t step, double timeStep, uint64_t rngState, double gravity, double softening)
+{
+    SnapshotHeader header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.headerBytes = SNAPSHOT_HEADER_BYTES;
+    header.bodyCount = bodyCount;
+    header.floatsPerBody = 4;
+    header.floatsPerAttribute = 4;
+    header.step = step;
+    header.time = step * timeStep;
+    header.rngState = rngState;
+    header.timeStep = timeStep;
+    header.gravity = gravity;
+    header.softening = softening;
+
+    return header;
+}
+
+
+// the particles and the attributes that follow them
+size_t SnapshotDataBytes (const SnapshotHeader& header)
+{
+    return header.bodyCount * (header.floatsPerBody + header.floatsPerAttribute) * sizeof (float);
+}
+
+
+// writes the header, the particles and their attributes through a mapping of the file (plain stdio on Windows)
+bool WriteSnapshotFile (const std::string& path, const SnapshotHeader& header, const void* bodies)
+{
+    const size_t dataBytes = SnapshotDataBytes (header);
+    const size_t fileBytes = header.headerBytes + dataBytes;
+
+    // the snapshot is written next to its final name and renamed, a crash never leaves a torn file behind
+    const std::string temporary = path + ".tmp";
+
+#ifdef _WIN32
+    FILE* f = fopen (temporary.c_str (), "wb");
+    if (f == nullptr)
+    {
+        std::cerr << "Unable to create snapshot `" << temporary << "'\n";
+        return false;
+    }
+
+    std::vector<char> padded (header.headerBytes, 0);
+    memcpy (&padded [0], &header, sizeof (header));
+    bool written = fwrite (&padded [0], 1, padded.size (), f) == padded.size ()
+        && fwrite (bodies, 1, dataBytes, f) == dataBytes;
+    written = (fclose (f) == 0) && written;
+    remove (path.c_str ());
+#else
+    int fd = open (temporary.c_str (), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Unable to create snapshot `" << temporary << "'\n";
+        return false;
+    }
+
+    bool written = false;
+    if (ftruncate (fd, fileBytes) == 0)
+    {
+        void* mapping = mmap (nullptr, fileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            memcpy (mapping, &header, sizeof (header));
+            memcpy (static_cast<char*> (mapping) + header.headerBytes, bodies, dataBytes);
+            written = msync (mapping, fileBytes, MS_SYNC) == 0;
+            munmap (mapping, fileBytes);
+        }
+    }
+    written = (close (fd) == 0) && written;
+#endif
+
+    if (!written || rename (temporary.c_str (), path.c_str ()) != 0)
+    {
+        std::cerr << "Unable to write snapshot `" << path << "'\n";
+        remove (temporary.c_str ());
+        return false;
+    }
+
+    return true;
+}
+
+
+// Read-only mapping of a snapshot file, the particles stay in the page cache instead of being copied.
+class SnapshotFile
+{
+public:
+    SnapshotFile () : base (nullptr), bytes (0) {}
+    ~SnapshotFile () { Close (); }
+
+    bool Open (const std::string& path)
+    {
+        Close ();
+
+#ifdef _WIN32
+        std::ifstream in (path.c_str (), std::ios::binary);
+        if (!in)
+            return Fail (path, "unable to open");
+
+        in.seekg (0, std::ios::end);
+        bytes = static_cast<size_t> (in.tellg ());
+        in.seekg (0, std::ios::beg);
+
+        // the buffer is page aligned, like a mapping would be
+        base = AlignedAlloc (HOST_PAGE_SIZE, bytes);
+        if (base == nullptr || !in.read (static_cast<char*> (base), bytes))
+            return Fail (path, "unable to read");
+#else
+        int fd = open (path.c_str (), O_RDONLY);
+        if (fd < 0)
+            return Fail (path, "unable to open");
+
+        struct stat info;
+        if (fstat (fd, &info) != 0 || info.st_size < static_cast<off_t> (sizeof (SnapshotHeader)))
+        {
+            close (fd);
+            return Fail (path, "too short");
+        }
+
+        bytes = static_cast<size_t> (info.st_size);
+        void* mapping = mmap (nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        close (fd);
+        if (mapping == MAP_FAILED)
+            return Fail (path, "unable to map");
+        base = mapping;
+#endif
+
+        if (bytes < sizeof (SnapshotHeader))
+            return Fail (path, "too short");
+
+        const SnapshotHeader& h = Header ();
+        if (memcmp (h.magic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC)) != 0)
+            return Fail (path, "not a snapshot");
+        if (h.version != 1 && h.version != SNAPSHOT_VERSION)
+            return Fail (path, "unsupported version");
+        if (h.floatsPerBody != 4 || h.floatsPerAttribute != (h.version == 1 ? 0u : 4u) || h.headerBytes < sizeof (SnapshotHeader)
+            || bytes < h.headerBytes + SnapshotDataBytes (h))
+            return Fail (path, "truncated or corrupt");
+
+        return true;
+    }
+
+    void Close ()
+    {
+        if (base == nullptr)
+            return;
+
+#ifdef _WIN32
+        AlignedFree (base);
+#else
+        munmap (base, bytes);
+#endif
+        base = nullptr;
+        bytes = 0;
+    }
+
+    const SnapshotHeader& Header () const
+    {
+        return *static_cast<const SnapshotHeader*> (base);
+    }
+
+    const cl_float4* Particles () const
+    {
+        return reinterpret_cast<const cl_float4*> (static_cast<const char*> (base) + Header ().headerBytes);
+    }
+
+    // null in a version 1 snapshot
+    const cl_float4* Attributes () const
+    {
+        return Header ().floatsPerAttribute > 0 ? Particles () + Header ().bodyCount : nullptr;
+    }
+
+private:
+    bool Fail (const std::string& path, const char* reason)
+    {
+        std::cerr << "Unable to load snapshot `" << path << "': " << reason << '\n';
+        Close ();
+        return false;
+    }
+
+    void* base;
+    size_t bytes;
+};
+
+
+// Writes snapshots without stopping the simulation: the particles and their attributes are copied on
+// the device into a host-visible staging buffer, which is mapped without blocking. A thread waits for the map,
+// writes the file and unmaps. One snapshot is in flight at a time, a request meanwhile is skipped.
+class SnapshotWriter
+{
+public:
+    SnapshotWriter () : staging (nullptr), stagingBytes (0), mapped (nullptr), mapEvent (nullptr), busy (false) {}
+    ~SnapshotWriter () { Release (); }
+
+    bool Save (cl_context context, cl_command_queue queue, cl_mem particles, cl_mem attributes, const SnapshotHeader& header,
+        const std::string& path)
+    {
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            if (busy)
+            {
+                std::cerr << "Snapshot of step " << header.step << " skipped, the previous one is still being written\n";
+                return true;
+            }
+        }
+
+        if (worker.joinable ())
+            worker.join ();
+
+        const size_t bytes = SnapshotDataBytes (header);
+        if (staging == nullptr || stagingBytes != bytes)
+        {
+            if (staging != nullptr)
+                clReleaseMemObject (staging);
+
+            cl_int err = CL_SUCCESS;
+            staging = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, nullptr, &err);
+            if (staging == nullptr || !CheckCLError (err))
+                return false;
+            stagingBytes = bytes;
+        }
+
+        const size_t particleBytes = header.bodyCount * header.floatsPerBody * sizeof (float);
+        cl_event copied [2] = { nullptr, nullptr };
+        cl_int err = clEnqueueCopyBuffer (queue, particles, staging, 0, 0, particleBytes, 0, nullptr, &copied [0]);
+        if (!CheckCLError (err))
+            return false;
+
+        err = clEnqueueCopyBuffer (queue, attributes, staging, 0, particleBytes, bytes - particleBytes, 0, nullptr, &copied [1]);
+        if (!CheckCLError (err))
+            return false;
+
+        mapped = clEnqueueMapBuffer (queue, staging, CL_FALSE, CL_MAP_READ, 0, bytes, 2, copied, &mapEvent, &err);
+        profiler.Add ("CopySnapshot", copied [0]);
+        profiler.Add ("CopySnapshotAttributes", copied [1]);
+        if (!CheckCLError (err))
+            return false;
+        clFlush (queue);
+
+        busy = true;
+        worker = std::thread (&SnapshotWriter::Run, this, queue, header, path);
+
+        return true;
+    }
+
+    // blocks until the snapshot in flight is on the disk
+    void Wait ()
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        done.wait (lock, [this] { return !busy; });
+    }
+
+    void Release ()
+    {
+        Wait ();
+        if (worker.joinable ())
+            worker.join ();
+
+        if (staging != nullptr)
+            clReleaseMemObject (staging);
+        staging = nullptr;
+        stagingBytes = 0;
+    }
+
+private:
+    void Run (cl_command_queue queue, SnapshotHeader header, std::string path)
+    {
+        clWaitForEvents (1, &mapEvent);
+        clReleaseEvent (mapEvent);
+        mapEvent = nullptr;
+
+        if (WriteSnapshotFile (path, header, mapped))
+            std::cout << "Snapshot of step " << header.step << " written to " << path << std::endl;
+
+        clEnqueueUnmapMemObject (queue, staging, mapped, 0, nullptr, nullptr);
+        clFlush (queue);
+        mapped = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            busy = false;
+        }
+        done.notify_all ();
+    }
+
+    cl_mem staging;
+    size_t stagingBytes;
+    void* mapped;
+    cl_event mapEvent;
+    bool busy;
+
+    std::mutex mutex;
+    std::condition_variable done;
+    std::thread worker;
+};
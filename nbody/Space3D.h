@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "../Common.h"
+#include "../Runtime.h"
+#include "DeviceStage.h"
+
+// The three dimensional mode. The bodies are float4 positions, xyz and the mass, with float4 velocities
+// in a buffer of their own; the force is the softened direct sum in space, read in tiles staged in local
+// memory. The kernels are appended to the program only in this mode, the plane keeps its own.
+//
+// The view is a perspective camera around the centre of the unit box. The bodies are put into depth
+// slices, each slice is splatted into a slice image and composited back to front over the density
+// image, which it dims by its own density; the density image is tone mapped as in the plane.
+const int SPACE_SLICES = 16;
+// every body in a pixel of a slice dims the slices behind it by this much, 14 of them by half
+const float SPACE_ABSORPTION = 0.05f;
+
+// appended to the program after the visualization (Deposit, DENSITY_SCALE) and the initial conditions
+const char* SPACE_KERNEL_SOURCE = STRINGIFY (
+    // isotropic direction from two uniform numbers
+    float3 Direction3 (float2 u)
+    {
+        float z = 2.0f * u.x - 1.0f;
+        return (float3) (sqrt (1.0f - z * z) * Direction (u.y), z);
+    }
+
+    // the models follow GenerateBodies, the disks lie in the plane z = 0.5 with a thin vertical scatter
+    __kernel
+    void GenerateBodies3D (__global float4* positions, __global float4* velocities, const int BODY_NUM, const int model, const uint2 seed)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        float4 u = Uniform4 (Philox ((uint4) (id, 0, 0, 0), seed));
+        float4 v = Uniform4 (Philox ((uint4) (id, 1, 0, 0), seed));
+        float2 g = Gaussian2 (v.xy);
+        float2 h = Gaussian2 (v.zw);
+        float mass = (float) BODY_NUM;
+
+        float3 pos;
+        float3 vel = (float3) (0.0f);
+        float m = 1.0f;
+        if (model == 1)
+        {
+            float r = 0.04f * rsqrt (pow (u.x * 0.98f, -2.0f / 3.0f) - 1.0f);
+            pos = r * Direction3 (u.yz);
+            vel = sqrt (G * mass / (6.0f * sqrt (r * r + 0.04f * 0.04f))) * (float3) (g, h.x);
+        }
+        else if (model == 2 || model == 3 || model == 5)
+        {
+            float hole = model == 5 ? (float) (BODY_NUM - 1) : 0.0f;
+            float4 body = model == 3 ? DiskBody (u, g, 0.05f, 0.5f * mass, 0.0f) : DiskBody (u, g, 0.08f, model == 5 ? hole : mass, hole);
+            if (model == 3)
+            {
+                float side = (id & 1) ? 1.0f : -1.0f;
+                float2 offset = side * (float2) (0.2f, 0.1f);
+                float approach = 0.5f * sqrt (2.0f * G * mass / length (2.0f * offset));
+                body += (float4) (offset, -side * approach, 0.0f);
+            }
+
+            pos = (float3) (body.xy, 0.005f * h.y);
+            vel = (float3) (body.zw, 0.0f);
+
+            // the first body is the black hole, at rest in the centre
+            if (model == 5 && id == 0)
+            {
+                pos = (float3) (0.0f);
+                vel = (float3) (0.0f);
+                m = hole;
+            }
+        }
+        else if (model == 4)
+        {
+            pos = 0.3f * cbrt (u.x) * Direction3 (u.yz);
+        }
+        else
+        {
+            pos = u.xyz - 0.5f;
+            vel = 2.0f * v.xyz - 1.0f;
+        }
+
+        positions [id] = (float4) (pos + 0.5f, m);
+        velocities [id] = (float4) (vel, 0.0f);
+    }
+
+    // the velocities are updated in place, the positions into the other buffer
+    __kernel
+    void Simulation3D (__global const float4* positions, __global float4* updated, __global float4* velocities, const int BODY_NUM,
+        __local float4* tile)
+    {
+        int id = get_global_id (0);
+        int lid = get_local_id (0);
+        int size = get_local_size (0);
+
+        // the body itself adds nothing, its distance is zero; the work-items past the bodies stage massless ones
+        float4 self = positions [min (id, BODY_NUM - 1)];
+        float3 F = (float3) (0.0f);
+        for (int start = 0; start < BODY_NUM; start += size)
+        {
+            int j = start + lid;
+            tile [lid] = j < BODY_NUM ? positions [j] : (float4) (0.0f);
+            barrier (CLK_LOCAL_MEM_FENCE);
+
+            int count = min (size, BODY_NUM - start);
+            for (int k = 0; k < count; ++k)
+            {
+                float3 r = tile [k].xyz - self.xyz;
+                float inverse = rsqrt (dot (r, r) + eps * eps);
+                F += r * (tile [k].w * inverse * inverse * inverse);
+            }
+            barrier (CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (id < BODY_NUM)
+        {
+            float3 vel = velocities [id].xyz + F * G * dt;
+            velocities [id] = (float4) (vel, 0.0f);
+            updated [id] = (float4) (self.xyz + vel * dt, self.w);
+        }
+    }
+
+    // the bodies of one depth slice in perspective; the camera is at eye.xyz with the focal length in eye.w,
+    // `slices' divide [nearDepth, farDepth]
+    __kernel
+    void Splat3D (const int width, const int height, __global uint* slice, __global const float4* positions, const int BODY_NUM,
+        const float4 eye, const float4 right, const float4 up, const float4 forward, const float nearDepth, const float farDepth, const int index, const int slices)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        float3 r = positions [id].xyz - eye.xyz;
+        float depth = dot (r, forward.xyz);
+        int s = clamp ((int) ((depth - nearDepth) / (farDepth - nearDepth) * slices), 0, slices - 1);
+        if (depth < 1.0e-3f || s != index)
+            return;
+
+        float2 p = eye.w / depth * (float2) (dot (r, right.xyz), dot (r, up.xyz)) + 0.5f * (float2) (width - 1, height - 1);
+        float2 cell = floor (p);
+        float2 f = p - cell;
+
+        int2 c = convert_int2 (fmax (fmin (cell, (float2) (width, height)), -1.0f));
+        Deposit (slice, width, height, c.x,     c.y,     (1.0f - f.x) * (1.0f - f.y));
+        Deposit (slice, width, height, c.x + 1, c.y,     f.x * (1.0f - f.y));
+        Deposit (slice, width, height, c.x,     c.y + 1, (1.0f - f.x) * f.y);
+        Deposit (slice, width, height, c.x + 1, c.y + 1, f.x * f.y);
+    }
+
+    // the slice over the image behind it, which it dims by its density; the slice is cleared for the next one
+    __kernel
+    void CompositeSlice (__global uint* density, __global uint* slice, const int pixelCount, const float absorption)
+    {
+        int id = get_global_id (0);
+        if (id >= pixelCount)
+            return;
+
+        uint s = slice [id];
+        density [id] = s + convert_uint_rte (density [id] * exp (-absorption * s / DENSITY_SCALE));
+        slice [id] = 0;
+    }
+);
+
+
+// The bodies and the camera of the three dimensional mode. The kernels come from the program of the
+// visualization, built with SPACE_KERNEL_SOURCE.
+class Space3D
+{
+public:
+    Space3D () : localSize (1), current (0), azimuth (0.6f), elevation (0.4f), distance (2.0f) {}
+
+    bool Init (const cl::Context& context, const cl::Device& device, const cl::Program& program, size_t bodies)
+    {
+        cl::Kernel* kernels [] = { &generateKernel, &simulationKernel, &splatKernel, &compositeKernel };
+        const char* names [] = { "GenerateBodies3D", "Simulation3D", "Splat3D", "CompositeSlice" };
+        if (!CreateKernels (program, kernels, names, 4))
+            return false;
+
+        localSize = std::min<size_t> (256, simulationKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (device));
+        this->context = context;
+
+        cl::Buffer* buffers [] = { &positions [0], &positions [1], &velocities };
+        for (int i = 0; i < 3; ++i)
+        {
+            cl_int err = CL_SUCCESS;
+            *buffers [i] = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_float4) * bodies, nullptr, &err);
+            if (!CheckCLError (err))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool Reset (cl::CommandQueue& queue, size_t bodies, int model, const cl_uint2& seed)
+    {
+        current = 0;
+
+        cl_int err = generateKernel.setArg (0, positions [current]);
+        err |= generateKernel.setArg (1, velocities);
+        err |= generateKernel.setArg (2, static_cast<cl_int> (bodies));
+        err |= generateKernel.setArg (3, static_cast<cl_int> (model));
+        err |= generateKernel.setArg (4, seed);
+
+        return CheckCLError (err) && LaunchKernel (queue, generateKernel, "GenerateBodies3D", cl::NDRange (bodies), cl::NullRange);
+    }
+
+    // one step, the first and the last command of the step are kept for the timing
+    bool Step (cl::CommandQueue& queue, size_t bodies, cl::Event& first, cl::Event& last)
+    {
+        cl_int err = simulationKernel.setArg (0, positions [current]);
+        err |= simulationKernel.setArg (1, positions [1 - current]);
+        err |= simulationKernel.setArg (2, velocities);
+        err |= simulationKernel.setArg (3, static_cast<cl_int> (bodies));
+        err |= simulationKernel.setArg (4, cl::Local (sizeof (cl_float4) * localSize));
+
+        const size_t global = (bodies + localSize - 1) / localSize * localSize;
+        if (!CheckCLError (err) || !LaunchKernel (queue, simulationKernel, "Simulation3D", cl::NDRange (global), cl::NDRange (localSize), &last))
+            return false;
+
+        first = last;
+        current = 1 - current;
+
+        return true;
+    }
+
+    // the slices back to front into `density', which has to be cleared
+    bool Render (cl::CommandQueue& queue, const cl::Buffer& density, int width, int height, size_t bodies)
+    {
+        const size_t pixels = static_cast<size_t> (width) * height;
+        if (sliceBuffer () == nullptr || sliceBuffer.getInfo<CL_MEM_SIZE> () < sizeof (cl_uint) * pixels)
+        {
+            cl_int err = CL_SUCCESS;
+            sliceBuffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (cl_uint) * pixels, nullptr, &err);
+            if (!CheckCLError (err) || !CheckCLError (queue.enqueueFillBuffer (sliceBuffer, cl_uint (0), 0, sizeof (cl_uint) * pixels)))
+                return false;
+        }
+
+        // the camera looks at the centre of the box with z up, the box fits into the smaller side of the image
+        const float ce = std::cos (elevation);
+        const cl_float4 forward = {{ -ce * std::cos (azimuth), -ce * std::sin (azimuth), -std::sin (elevation), 0.0f }};
+        const cl_float4 right = {{ -std::sin (azimuth), std::cos (azimuth), 0.0f, 0.0f }};
+        const cl_float4 up = {{ right.s [1] * forward.s [2] - right.s [2] * forward.s [1], right.s [2] * forward.s [0] - right.s [0] * forward.s [2],
+            right.s [0] * forward.s [1] - right.s [1] * forward.s [0], 0.0f }};
+        const cl_float4 eye = {{ 0.5f - distance * forward.s [0], 0.5f - distance * forward.s [1], 0.5f - distance * forward.s [2],
+            0.8f * distance * std::min (width, height) }};
+        const cl_float nearDepth = distance - 0.9f;
+        const cl_float farDepth = distance + 0.9f;
+
+        cl_int err = splatKernel.setArg (0, width);
+        err |= splatKernel.setArg (1, height);
+        err |= splatKernel.setArg (2, sliceBuffer);
+        err |= splatKernel.setArg (3, positions [current]);
+        err |= splatKernel.setArg (4, static_cast<cl_int> (bodies));
+        err |= splatKernel.setArg (5, eye);
+        err |= splatKernel.setArg (6, right);
+        err |= splatKernel.setArg (7, up);
+        err |= splatKernel.setArg (8, forward);
+        err |= splatKernel.setArg (9, nearDepth);
+        err |= splatKernel.setArg (10, farDepth);
+        err |= splatKernel.setArg (12, SPACE_SLICES);
+
+        err |= compositeKernel.setArg (0, density);
+        err |= compositeKernel.setArg (1, sliceBuffer);
+        err |= compositeKernel.setArg (2, static_cast<cl_int> (pixels));
+        err |= compositeKernel.setArg (3, SPACE_ABSORPTION);
+        if (!CheckCLError (err))
+            return false;
+
+        for (int slice = SPACE_SLICES - 1; slice >= 0; --slice)
+        {
+            if (!CheckCLError (splatKernel.setArg (11, slice))
+                || !LaunchKernel (queue, splatKernel, "Splat3D", cl::NDRange (bodies), cl::NullRange)
+                || !LaunchKernel (queue, compositeKernel, "CompositeSlice", cl::NDRange (pixels), cl::NullRange))
+                return false;
+        }
+
+        return true;
+    }
+
+    // turns the camera around the centre of the box
+    void Orbit (float deltaAzimuth, float deltaElevation)
+    {
+        azimuth += deltaAzimuth;
+        elevation = std::max (-1.5f, std::min (1.5f, elevation + deltaElevation));
+    }
+
+private:
+    size_t localSize;
+    int current;
+    float azimuth;
+    float elevation;
+    float distance;
+
+    cl::Context context;
+    cl::Kernel generateKernel;
+    cl::Kernel simulationKernel;
+    cl::Kernel splatKernel;
+    cl::Kernel compositeKernel;
+
+    cl::Buffer positions [2];
+    cl::Buffer velocities;
+    cl::Buffer sliceBuffer;
+};
@@ -0,0 +1,806 @@
+#pragma once
+
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "../Common.h"
+#include "../Runtime.h"
+#include "DeviceStage.h"
+
+// Trajectory files: the positions of every recorded step, quantized to 16 or 24 bit fixed point
+// inside a bounding box. The box is kept between key frames, the frames in between store the
+// difference to the previous frame, which is small for slowly moving bodies. The values are
+// stored in byte planes (the low bytes of every x, then the next bytes, ..., then y), so the
+// planes of the high bytes are mostly zero and the zero-run coding removes them. The coding runs
+// on the device as a stream compaction, only the coded bytes are read back.
+//
+// file:   TrajectoryHeader, the frames (TrajectoryFrameHeader + compressed planes), the index
+//         (TrajectoryIndexEntry per frame) and TrajectoryFooter; without the index (the writer
+//         did not finish) the reader scans the frames
+const char TRAJECTORY_MAGIC [8] = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+const char TRAJECTORY_INDEX_MAGIC [8] = { 'N', 'B', 'O', 'D', 'Y', 'I', 'D', 'X' };
+const uint32_t TRAJECTORY_VERSION = 1;
+const uint32_t TRAJECTORY_KEY_FRAME = 1;
+
+// the device writes the flags and the box in front of the planes; in front of the coded planes it writes
+// their byte count, the flags and the box, which are read back first
+const size_t TRAJECTORY_RECORD_HEADER_BYTES = 32;
+
+struct TrajectoryHeader
+{
+    char magic [8];
+    uint32_t version;
+    uint32_t bits;                  // per coordinate
+    uint64_t bodyCount;
+    double timeStep;
+    uint32_t every;                 // simulation steps between the frames
+    uint32_t keyInterval;           // frames between the key frames, at most
+};
+
+struct TrajectoryFrameHeader
+{
+    uint64_t step;
+    uint32_t flags;
+    uint32_t bytes;                 // of the compressed planes following the header
+    float box [4];                  // min.xy, max.xy
+};
+
+struct TrajectoryIndexEntry
+{
+    uint64_t step;
+    uint64_t offset;                // of the TrajectoryFrameHeader
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct TrajectoryFooter
+{
+    uint64_t indexOffset;
+    uint64_t frameCount;
+    char magic [8];
+};
+
+
+// Built after SCAN_KERNEL_SOURCE.
+const char* TRAJECTORY_KERNEL_SOURCE = STRINGIFY (
+    // min.xy and max.xy of the positions for each work-group, the local size is a power of two
+    __kernel
+    void TrajectoryBounds (__global const float4* particles, const int BODY_NUM, __local float4* scratch, __global float4* partials)
+    {
+        int lid = get_local_id (0);
+
+        float4 bounds = (float4) (INFINITY, INFINITY, -INFINITY, -INFINITY);
+        for (int i = get_global_id (0); i < BODY_NUM; i += get_global_size (0))
+        {
+            float2 p = particles [i].xy;
+            bounds = (float4) (fmin (bounds.xy, p), fmax (bounds.zw, p));
+        }
+        scratch [lid] = bounds;
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (int s = get_local_size (0) / 2; s > 0; s >>= 1)
+        {
+            if (lid < s)
+            {
+                float4 other = scratch [lid + s];
+                scratch [lid] = (float4) (fmin (scratch [lid].xy, other.xy), fmax (scratch [lid].zw, other.zw));
+            }
+            barrier (CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (lid == 0)
+            partials [get_group_id (0)] = scratch [0];
+    }
+
+    // single work-item: a frame becomes a key frame after keyInterval frames or when a body left the box,
+    // the new box gets a margin, so it lasts for a while
+    __kernel
+    void TrajectoryFrame (__global const float4* partials, const int groups, const int keyInterval,
+        __global float4* keyBox, __global int* sinceKey, __global uint* record)
+    {
+        float4 bounds = partials [0];
+        for (int i = 1; i < groups; ++i)
+            bounds = (float4) (fmin (bounds.xy, partials [i].xy), fmax (bounds.zw, partials [i].zw));
+
+        float4 box = keyBox [0];
+        int since = sinceKey [0] + 1;
+        bool key = since >= keyInterval || any (bounds.xy < box.xy) || any (bounds.zw > box.zw);
+        if (key)
+        {
+            float2 margin = fmax ((bounds.zw - bounds.xy) * 0.25f, 1.0e-6f);
+            box = (float4) (bounds.xy - margin, bounds.zw + margin);
+            keyBox [0] = box;
+            since = 0;
+        }
+        sinceKey [0] = since;
+
+        record [0] = key ? 1 : 0;
+        vstore4 (box, 1, (__global float*) record);
+    }
+
+    // quantizes the positions into the box of the record, key frames store the values and the others the
+    // zigzag encoded difference to the previous frame (modulo 2^bits, so it is exact); the planes follow
+    // the 32 bytes of the record header
+    __kernel
+    void TrajectoryQuantize (__global const float4* particles, const int BODY_NUM, const int bits,
+        __global uchar* record, __global uint2* previous)
+    {
+        int id = get_global_id (0);
+        if (id >= BODY_NUM)
+            return;
+
+        __global uchar* planes = record + 32;
+        uint mask = (1u << bits) - 1;
+        float4 box = vload4 (1, (__global const float*) record);
+        float2 scaled = (particles [id].xy - box.xy) / (box.zw - box.xy) * (float) mask;
+        uint2 q = min (convert_uint2_sat_rte (scaled), (uint2) (mask));
+
+        uint2 value = q;
+        if (((__global const uint*) record) [0] == 0)
+        {
+            int shift = 32 - bits;
+            int2 delta = as_int2 ((q - previous [id]) << shift) >> shift;
+            value = as_uint2 ((delta << 1) ^ (delta >> 31)) & mask;
+        }
+        previous [id] = q;
+
+        int bytes = bits / 8;
+        for (int b = 0; b < bytes; ++b)
+        {
+            planes [b * BODY_NUM + id] = (uchar) (value.x >> (8 * b));
+            planes [(bytes + b) * BODY_NUM + id] = (uchar) (value.y >> (8 * b));
+        }
+    }
+
+    // the coded bytes of byte i of the planes: a non-zero byte is stored as it is, a run of zeros becomes
+    // a zero and the number of zeros after it (ExpandZeroRuns); the runs are cut at every 256th byte, so
+    // the number fits in a byte and the head of a run is found next to it
+    int ZeroRunBytes (__global const uchar* planes, int i)
+    {
+        if (planes [i] != 0)
+            return 1;
+
+        return i % 256 == 0 || planes [i - 1] != 0 ? 2 : 0;
+    }
+
+    __kernel
+    void ZeroRunCount (__global const uchar* record, const int bytes, __global int* groupCounts, __local int* scratch)
+    {
+        int i = get_global_id (0);
+        int count = GroupScan (scratch, i < bytes ? ZeroRunBytes (record + 32, i) : 0);
+
+        if (get_local_id (0) == get_local_size (0) - 1)
+            groupCounts [get_group_id (0)] = count;
+    }
+
+    // the coded planes follow the 32 bytes of the coded header, whose byte count ScanGroups wrote
+    __kernel
+    void ZeroRunScatter (__global const uchar* record, const int bytes, __global const int* groupPlaces, __local int* scratch,
+        __global uchar* coded)
+    {
+        int i = get_global_id (0);
+        __global const uchar* planes = record + 32;
+        int size = i < bytes ? ZeroRunBytes (planes, i) : 0;
+        int place = groupPlaces [get_group_id (0)] + GroupScan (scratch, size) - size;
+
+        if (i == 0)
+        {
+            ((__global uint*) coded) [1] = ((__global const uint*) record) [0];
+            vstore4 (vload4 (1, (__global const float*) record), 1, (__global float*) coded);
+        }
+
+        __global uchar* data = coded + 32;
+        if (size == 1)
+            data [place] = planes [i];
+        else if (size == 2)
+        {
+            int limit = min ((i / 256 + 1) * 256, bytes);
+            int end = i + 1;
+            while (end < limit && planes [end] == 0)
+                ++end;
+
+            data [place] = 0;
+            data [place + 1] = (uchar) (end - i - 1);
+        }
+    }
+);
+
+
+// a zero byte is followed by the number of zeros after it (up to 255), everything else is stored as it is
+bool ExpandZeroRuns (const unsigned char* data, size_t bytes, unsigned char* out, size_t outBytes)
+{
+    size_t o = 0;
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        if (o >= outBytes)
+            return false;
+
+        out [o++] = data [i];
+        if (data [i] != 0)
+            continue;
+
+        if (++i >= bytes || o + data [i] > outBytes)
+            return false;
+
+        memset (out + o, 0, data [i]);
+        o += data [i];
+    }
+
+    return o == outBytes;
+}
+
+
+// Records the trajectory of the bodies every `every' simulation steps. The quantization, the delta
+// encoding and the zero-run coding run on the device; a thread reads back the byte count of the coded
+// planes, then only those bytes, and appends them to the file. The queue in between is bounded, a slow disk holds the simulation back
+// instead of losing frames.
+//
+// NBODY_TRAJECTORY        - output file; unset disables the recording
+// NBODY_TRAJECTORY_EVERY  - simulation steps between the recorded frames (default: 10)
+// NBODY_TRAJECTORY_BITS   - 16 (default) or 24 bits per coordinate
+// NBODY_TRAJECTORY_KEY    - frames between the key frames, at most (default: 64)
+class TrajectoryWriter
+{
+public:
+    TrajectoryWriter () :
+        path (GetEnvironmentString ("NBODY_TRAJECTORY", "")),
+        every (std::max (1, GetEnvironmentInt ("NBODY_TRAJECTORY_EVERY", 10))),
+        bits (GetEnvironmentInt ("NBODY_TRAJECTORY_BITS", 16)),
+        keyInterval (std::max (1, GetEnvironmentInt ("NBODY_TRAJECTORY_KEY", 64))),
+        capacity (4),
+        file (nullptr),
+        program (nullptr),
+        boundsKernel (nullptr),
+        frameKernel (nullptr),
+        quantizeKernel (nullptr),
+        countKernel (nullptr),
+        scanKernel (nullptr),
+        scatterKernel (nullptr),
+        context (nullptr),
+        partials (nullptr),
+        keyBox (nullptr),
+        sinceKey (nullptr),
+        previous (nullptr),
+        record (nullptr),
+        groupCounts (nullptr),
+        bodyCount (0),
+        planeBytes (0),
+        boundsLocal (1),
+        boundsGroups (1),
+        codeLocal (1),
+        codeGroups (1),
+        fileBytes (0),
+        rawBytes (0),
+        stopping (false),
+        failed (false)
+    {
+        if (bits != 16 && bits != 24)
+        {
+            std::cerr << "NBODY_TRAJECTORY_BITS has to be 16 or 24, using 16\n";
+            bits = 16;
+        }
+    }
+
+    ~TrajectoryWriter () { Stop (); }
+
+    bool IsEnabled () const
+    {
+        return !path.empty ();
+    }
+
+    // builds the kernels, allocates the device state and writes the file header
+    bool Init (const Runtime& runtime, size_t bodies, double timeStep)
+    {
+        if (!IsEnabled ())
+            return true;
+
+        const std::string source = std::string (SCAN_KERNEL_SOURCE) + TRAJECTORY_KERNEL_SOURCE;
+        program = BuildProgram (runtime, source.c_str (), nullptr);
+        if (program == nullptr)
+            return false;
+
+        cl_kernel* kernels [] = { &boundsKernel, &frameKernel, &quantizeKernel, &countKernel, &scanKernel, &scatterKernel };
+        const char* names [] = { "TrajectoryBounds", "TrajectoryFrame", "TrajectoryQuantize", "ZeroRunCount", "ScanGroups", "ZeroRunScatter" };
+        cl_int err = CL_SUCCESS;
+        for (int i = 0; i < 6; ++i)
+        {
+            *kernels [i] = clCreateKernel (program, names [i], &err);
+            if (!CheckCLError (err))
+                return false;
+        }
+
+        // the reduction needs a power of two work-group, a few groups are enough for a bounding box
+        size_t maxLocal = 1;
+        clGetKernelWorkGroupInfo (boundsKernel, runtime.device (), CL_KERNEL_WORK_GROUP_SIZE, sizeof (maxLocal), &maxLocal, nullptr);
+        while (boundsLocal * 2 <= std::min<size_t> (maxLocal, 256))
+            boundsLocal *= 2;
+        boundsGroups = std::max<size_t> (1, std::min<size_t> (64, (bodies + boundsLocal - 1) / boundsLocal));
+
+        // the scans of the coding, in work-groups of a power of two
+        maxLocal = 1;
+        clGetKernelWorkGroupInfo (countKernel, runtime.device (), CL_KERNEL_WORK_GROUP_SIZE, sizeof (maxLocal), &maxLocal, nullptr);
+        size_t scatterLocal = 1;
+        clGetKernelWorkGroupInfo (scatterKernel, runtime.device (), CL_KERNEL_WORK_GROUP_SIZE, sizeof (scatterLocal), &scatterLocal, nullptr);
+        while (codeLocal * 2 <= std::min<size_t> (std::min (maxLocal, scatterLocal), 256))
+            codeLocal *= 2;
+
+        context = runtime.context ();
+        bodyCount = bodies;
+        planeBytes = 2 * (bits / 8) * bodies;
+        codeGroups = (planeBytes + codeLocal - 1) / codeLocal;
+        cl_int errors [6];
+        partials = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (cl_float4) * boundsGroups, nullptr, &errors [0]);
+        keyBox = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (cl_float4), nullptr, &errors [1]);
+        sinceKey = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (cl_int), nullptr, &errors [2]);
+        previous = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (cl_uint2) * bodies, nullptr, &errors [3]);
+        record = clCreateBuffer (context, CL_MEM_READ_WRITE, TRAJECTORY_RECORD_HEADER_BYTES + planeBytes, nullptr, &errors [4]);
+        groupCounts = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (cl_int) * codeGroups, nullptr, &errors [5]);
+        for (int i = 0; i < 6; ++i)
+            if (!CheckCLError (errors [i]))
+                return false;
+
+        // the first frame is a key frame
+        cl_int since = keyInterval;
+        err = clEnqueueWriteBuffer (runtime.queue (), sinceKey, CL_TRUE, 0, sizeof (since), &since, 0, nullptr, nullptr);
+        if (!CheckCLError (err))
+            return false;
+
+        const cl_int count = static_cast<cl_int> (bodies);
+        const cl_int groups = static_cast<cl_int> (boundsGroups);
+        const cl_int keys = keyInterval;
+        const cl_int codeBytes = static_cast<cl_int> (planeBytes);
+        const cl_int codeCount = static_cast<cl_int> (codeGroups);
+        err = clSetKernelArg (boundsKernel, 1, sizeof (cl_int), &count);
+        err |= clSetKernelArg (boundsKernel, 2, sizeof (cl_float4) * boundsLocal, nullptr);
+        err |= clSetKernelArg (boundsKernel, 3, sizeof (cl_mem), &partials);
+        err |= clSetKernelArg (frameKernel, 0, sizeof (cl_mem), &partials);
+        err |= clSetKernelArg (frameKernel, 1, sizeof (cl_int), &groups);
+        err |= clSetKernelArg (frameKernel, 2, sizeof (cl_int), &keys);
+        err |= clSetKernelArg (frameKernel, 3, sizeof (cl_mem), &keyBox);
+        err |= clSetKernelArg (frameKernel, 4, sizeof (cl_mem), &sinceKey);
+        err |= clSetKernelArg (frameKernel, 5, sizeof (cl_mem), &record);
+        err |= clSetKernelArg (quantizeKernel, 1, sizeof (cl_int), &count);
+        err |= clSetKernelArg (quantizeKernel, 2, sizeof (cl_int), &bits);
+        err |= clSetKernelArg (quantizeKernel, 3, sizeof (cl_mem), &record);
+        err |= clSetKernelArg (quantizeKernel, 4, sizeof (cl_mem), &previous);
+        err |= clSetKernelArg (countKernel, 0, sizeof (cl_mem), &record);
+        err |= clSetKernelArg (countKernel, 1, sizeof (cl_int), &codeBytes);
+        err |= clSetKernelArg (countKernel, 2, sizeof (cl_mem), &groupCounts);
+        err |= clSetKernelArg (countKernel, 3, sizeof (cl_int) * codeLocal, nullptr);
+        err |= clSetKernelArg (scanKernel, 0, sizeof (cl_mem), &groupCounts);
+        err |= clSetKernelArg (scanKernel, 2, sizeof (cl_int) * codeLocal, nullptr);
+        err |= clSetKernelArg (scanKernel, 3, sizeof (cl_int), &codeCount);
+        err |= clSetKernelArg (scatterKernel, 0, sizeof (cl_mem), &record);
+        err |= clSetKernelArg (scatterKernel, 1, sizeof (cl_int), &codeBytes);
+        err |= clSetKernelArg (scatterKernel, 2, sizeof (cl_mem), &groupCounts);
+        err |= clSetKernelArg (scatterKernel, 3, sizeof (cl_int) * codeLocal, nullptr);
+        if (!CheckCLError (err))
+            return false;
+
+        file = fopen (path.c_str (), "wb");
+        if (file == nullptr)
+        {
+            std::cerr << "Unable to create trajectory `" << path << "'\n";
+            return false;
+        }
+
+        TrajectoryHeader header;
+        memset (&header, 0, sizeof (header));
+        memcpy (header.magic, TRAJECTORY_MAGIC, sizeof (TRAJECTORY_MAGIC));
+        header.version = TRAJECTORY_VERSION;
+        header.bits = bits;
+        header.bodyCount = bodies;
+        header.timeStep = timeStep;
+        header.every = every;
+        header.keyInterval = keyInterval;
+
+        return Append (&header, sizeof (header));
+    }
+
+    // records the particles after simulation step `step', if it is one of the recorded steps
+    bool Record (cl_command_queue queue, cl_mem particles, uint64_t step)
+    {
+        if (file == nullptr || step % every != 0)
+            return true;
+
+        Slot* slot = Acquire ();
+        if (slot == nullptr)
+            return false;
+        slot->step = step;
+        slot->queue = queue;
+
+        // the byte count of the coded planes goes to the front of the slot
+        cl_int err = clSetKernelArg (boundsKernel, 0, sizeof (cl_mem), &particles);
+        err |= clSetKernelArg (quantizeKernel, 0, sizeof (cl_mem), &particles);
+        err |= clSetKernelArg (scanKernel, 1, sizeof (cl_mem), &slot->device);
+        err |= clSetKernelArg (scatterKernel, 4, sizeof (cl_mem), &slot->device);
+        if (!CheckCLError (err))
+            return false;
+
+        const size_t boundsGlobal = boundsGroups * boundsLocal;
+        const size_t codeGlobal = codeGroups * codeLocal;
+        const size_t one = 1;
+
+        cl_event event = nullptr;
+        err = clEnqueueNDRangeKernel (queue, boundsKernel, 1, nullptr, &boundsGlobal, &boundsLocal, 0, nullptr, profiler.Track (&event));
+        profiler.Add ("TrajectoryBounds", event);
+        err |= clEnqueueNDRangeKernel (queue, frameKernel, 1, nullptr, &one, &one, 0, nullptr, profiler.Track (&event));
+        profiler.Add ("TrajectoryFrame", event);
+        err |= clEnqueueNDRangeKernel (queue, quantizeKernel, 1, nullptr, &bodyCount, nullptr, 0, nullptr, profiler.Track (&event));
+        profiler.Add ("TrajectoryQuantize", event);
+        err |= clEnqueueNDRangeKernel (queue, countKernel, 1, nullptr, &codeGlobal, &codeLocal, 0, nullptr, profiler.Track (&event));
+        profiler.Add ("ZeroRunCount", event);
+        err |= clEnqueueNDRangeKernel (queue, scanKernel, 1, nullptr, &codeLocal, &codeLocal, 0, nullptr, profiler.Track (&event));
+        profiler.Add ("ScanGroups", event);
+        err |= clEnqueueNDRangeKernel (queue, scatterKernel, 1, nullptr, &codeGlobal, &codeLocal, 0, nullptr, profiler.Track (&event));
+        profiler.Add ("ZeroRunScatter", event);
+        if (!CheckCLError (err))
+            return false;
+
+        err = clEnqueueReadBuffer (queue, slot->device, CL_FALSE, 0, sizeof (slot->header), slot->header, 0, nullptr, &slot->ready);
+        if (!CheckCLError (err))
+            return false;
+
+        if (profiler.IsEnabled ())
+        {
+            clRetainEvent (slot->ready);
+            profiler.Add ("ReadTrajectory", slot->ready);
+        }
+        clFlush (queue);
+
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            jobs.push_back (slot);
+        }
+        changed.notify_all ();
+
+        if (!worker.joinable ())
+            worker = std::thread (&TrajectoryWriter::Run, this);
+
+        return true;
+    }
+
+    // writes the queued frames and the index, then releases everything
+    void Stop ()
+    {
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            stopping = true;
+        }
+        changed.notify_all ();
+
+        if (worker.joinable ())
+            worker.join ();
+
+        if (file != nullptr)
+        {
+            TrajectoryFooter footer;
+            memset (&footer, 0, sizeof (footer));
+            footer.indexOffset = fileBytes;
+            footer.frameCount = index.size ();
+            memcpy (footer.magic, TRAJECTORY_INDEX_MAGIC, sizeof (TRAJECTORY_INDEX_MAGIC));
+
+            if (!index.empty ())
+                Append (&index [0], sizeof (TrajectoryIndexEntry) * index.size ());
+            Append (&footer, sizeof (footer));
+
+            if (fclose (file) != 0 || failed)
+                std::cerr << "Unable to write trajectory `" << path << "'\n";
+            else if (!index.empty ())
+                std::cout << index.size () << " trajectory frames written to " << path << ", "
+                    << fileBytes << " bytes instead of " << rawBytes << std::endl;
+        }
+        file = nullptr;
+        index.clear ();
+
+        for (size_t i = 0; i < pool.size (); ++i)
+        {
+            clReleaseMemObject (pool [i]->device);
+            delete pool [i];
+        }
+        pool.clear ();
+
+        cl_kernel kernels [6] = { boundsKernel, frameKernel, quantizeKernel, countKernel, scanKernel, scatterKernel };
+        for (int i = 0; i < 6; ++i)
+            if (kernels [i] != nullptr)
+                clReleaseKernel (kernels [i]);
+        boundsKernel = frameKernel = quantizeKernel = countKernel = scanKernel = scatterKernel = nullptr;
+
+        cl_mem buffers [6] = { partials, keyBox, sinceKey, previous, record, groupCounts };
+        for (int i = 0; i < 6; ++i)
+            if (buffers [i] != nullptr)
+                clReleaseMemObject (buffers [i]);
+        partials = keyBox = sinceKey = previous = record = groupCounts = nullptr;
+
+        if (program != nullptr)
+            clReleaseProgram (program);
+        program = nullptr;
+    }
+
+private:
+    struct Slot
+    {
+        cl_mem device;                  // the coded header and the coded planes
+        unsigned char header [TRAJECTORY_RECORD_HEADER_BYTES];
+        std::vector<unsigned char> host;
+        cl_event ready;
+        cl_command_queue queue;
+        uint64_t step;
+    };
+
+    Slot* Acquire ()
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        changed.wait (lock, [this] { return jobs.size () < capacity; });
+
+        if (!pool.empty ())
+        {
+            Slot* slot = pool.back ();
+            pool.pop_back ();
+            return slot;
+        }
+
+        lock.unlock ();
+
+        Slot* slot = new Slot ();
+        slot->ready = nullptr;
+
+        // a coded byte takes two bytes at most
+        cl_int err = CL_SUCCESS;
+        slot->device = clCreateBuffer (context, CL_MEM_READ_WRITE, TRAJECTORY_RECORD_HEADER_BYTES + 2 * planeBytes, nullptr, &err);
+        if (slot->device == nullptr || !CheckCLError (err))
+        {
+            delete slot;
+            return nullptr;
+        }
+
+        return slot;
+    }
+
+    bool Append (const void* data, size_t bytes)
+    {
+        if (fwrite (data, 1, bytes, file) != bytes)
+            failed = true;
+        fileBytes += bytes;
+
+        return !failed;
+    }
+
+    void Run ()
+    {
+        for (;;)
+        {
+            Slot* slot = nullptr;
+            {
+                std::unique_lock<std::mutex> lock (mutex);
+                changed.wait (lock, [this] { return stopping || !jobs.empty (); });
+                if (jobs.empty ())
+                    break;
+
+                slot = jobs.front ();
+            }
+
+            clWaitForEvents (1, &slot->ready);
+            clReleaseEvent (slot->ready);
+            slot->ready = nullptr;
+
+            TrajectoryFrameHeader frame;
+            memset (&frame, 0, sizeof (frame));
+            frame.step = slot->step;
+            memcpy (&frame.bytes, slot->header, sizeof (frame.bytes));
+            memcpy (&frame.flags, slot->header + 4, sizeof (frame.flags));
+            memcpy (frame.box, slot->header + 16, sizeof (frame.box));
+
+            // the queue is in order, the read waits for the steps enqueued meanwhile but not the simulation
+            slot->host.resize (frame.bytes);
+            if (frame.bytes > 0 && clEnqueueReadBuffer (slot->queue, slot->device, CL_TRUE, TRAJECTORY_RECORD_HEADER_BYTES, frame.bytes,
+                &slot->host [0], 0, nullptr, nullptr) != CL_SUCCESS)
+                failed = true;
+
+            TrajectoryIndexEntry entry = { frame.step, fileBytes, frame.flags, 0 };
+            index.push_back (entry);
+            rawBytes += sizeof (cl_float2) * bodyCount;
+
+            Append (&frame, sizeof (frame));
+            if (!slot->host.empty ())
+                Append (&slot->host [0], slot->host.size ());
+
+            {
+                std::lock_guard<std::mutex> lock (mutex);
+                jobs.pop_front ();
+                pool.push_back (slot);
+            }
+            changed.notify_all ();
+        }
+
+        fflush (file);
+    }
+
+    std::string path;
+    int every;
+    int bits;
+    int keyInterval;
+    size_t capacity;
+    FILE* file;
+
+    cl_program program;
+    cl_kernel boundsKernel;
+    cl_kernel frameKernel;
+    cl_kernel quantizeKernel;
+    cl_kernel countKernel;
+    cl_kernel scanKernel;
+    cl_kernel scatterKernel;
+    cl_context context;
+    cl_mem partials;
+    cl_mem keyBox;
+    cl_mem sinceKey;
+    cl_mem previous;
+    cl_mem record;                      // the record header and the planes
+    cl_mem groupCounts;
+    size_t bodyCount;
+    size_t planeBytes;
+    size_t boundsLocal;
+    size_t boundsGroups;
+    size_t codeLocal;
+    size_t codeGroups;
+
+    // written by the worker only, read after it is joined
+    uint64_t fileBytes;
+    uint64_t rawBytes;
+    std::vector<TrajectoryIndexEntry> index;
+
+    bool stopping;
+    bool failed;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Slot*> jobs;
+    std::vector<Slot*> pool;
+    std::thread worker;
+};
+
+
+// Random access to a trajectory file for analysis: a frame is decoded from the key frame before it,
+// reading the frames in order decodes each of them once.
+class TrajectoryReader
+{
+public:
+    TrajectoryReader () : decoded (static_cast<size_t> (-1)) {}
+
+    bool Open (const std::string& filename)
+    {
+        in.close ();
+        in.clear ();
+        index.clear ();
+        decoded = static_cast<size_t> (-1);
+
+        in.open (filename.c_str (), std::ios::binary);
+        if (!in.read (reinterpret_cast<char*> (&header), sizeof (header))
+            || memcmp (header.magic, TRAJECTORY_MAGIC, sizeof (TRAJECTORY_MAGIC)) != 0
+            || header.version != TRAJECTORY_VERSION || (header.bits != 16 && header.bits != 24))
+        {
+            std::cerr << "Unable to load trajectory `" << filename << "'\n";
+            return false;
+        }
+
+        in.seekg (0, std::ios::end);
+        const uint64_t fileBytes = static_cast<uint64_t> (in.tellg ());
+
+        TrajectoryFooter footer;
+        in.seekg (fileBytes - sizeof (footer));
+        if (fileBytes >= sizeof (header) + sizeof (footer) && in.read (reinterpret_cast<char*> (&footer), sizeof (footer))
+            && memcmp (footer.magic, TRAJECTORY_INDEX_MAGIC, sizeof (TRAJECTORY_INDEX_MAGIC)) == 0)
+        {
+            index.resize (footer.frameCount);
+            in.seekg (footer.indexOffset);
+            if (footer.frameCount == 0 || in.read (reinterpret_cast<char*> (&index [0]), sizeof (TrajectoryIndexEntry) * index.size ()))
+                return true;
+            index.clear ();
+        }
+
+        // the writer did not finish, the frames are indexed by walking through them
+        in.clear ();
+        uint64_t offset = sizeof (header);
+        TrajectoryFrameHeader frame;
+        while (in.seekg (offset) && in.read (reinterpret_cast<char*> (&frame), sizeof (frame))
+            && offset + sizeof (frame) + frame.bytes <= fileBytes)
+        {
+            TrajectoryIndexEntry entry = { frame.step, offset, frame.flags, 0 };
+            index.push_back (entry);
+            offset += sizeof (frame) + frame.bytes;
+        }
+        in.clear ();
+
+        return true;
+    }
+
+    const TrajectoryHeader& Header () const
+    {
+        return header;
+    }
+
+    size_t FrameCount () const
+    {
+        return index.size ();
+    }
+
+    uint64_t Step (size_t frame) const
+    {
+        return index [frame].step;
+    }
+
+    // the positions of the bodies in a frame
+    bool Read (size_t frame, std::vector<cl_float2>& positions)
+    {
+        if (frame >= index.size ())
+            return false;
+
+        size_t first = frame;
+        while (first > 0 && (index [first].flags & TRAJECTORY_KEY_FRAME) == 0)
+            --first;
+
+        // the decoded frame is continued from, if it is in between
+        if (decoded != static_cast<size_t> (-1) && decoded >= first && decoded < frame)
+            first = decoded + 1;
+
+        for (size_t f = first; f <= frame; ++f)
+            if (!Decode (f))
+                return false;
+
+        const uint32_t mask = (1u << header.bits) - 1;
+        positions.resize (header.bodyCount);
+        for (size_t i = 0; i < positions.size (); ++i)
+            for (int c = 0; c < 2; ++c)
+                positions [i].s [c] = box [c] + (box [2 + c] - box [c]) * (values [c * header.bodyCount + i] / static_cast<float> (mask));
+
+        return true;
+    }
+
+private:
+    bool Decode (size_t frame)
+    {
+        decoded = static_cast<size_t> (-1);
+
+        TrajectoryFrameHeader frameHeader;
+        in.seekg (index [frame].offset);
+        if (!in.read (reinterpret_cast<char*> (&frameHeader), sizeof (frameHeader)))
+            return false;
+
+        const size_t bytes = header.bits / 8;
+        compressed.resize (frameHeader.bytes);
+        planes.resize (2 * bytes * header.bodyCount);
+        if ((frameHeader.bytes > 0 && !in.read (reinterpret_cast<char*> (&compressed [0]), compressed.size ()))
+            || !ExpandZeroRuns (compressed.empty () ? nullptr : &compressed [0], compressed.size (), &planes [0], planes.size ()))
+            return false;
+
+        const uint32_t mask = (1u << header.bits) - 1;
+        const bool key = (frameHeader.flags & TRAJECTORY_KEY_FRAME) != 0;
+        values.resize (2 * header.bodyCount);
+        for (size_t c = 0; c < 2; ++c)
+            for (size_t i = 0; i < header.bodyCount; ++i)
+            {
+                uint32_t value = 0;
+                for (size_t b = 0; b < bytes; ++b)
+                    value |= static_cast<uint32_t> (planes [(c * bytes + b) * header.bodyCount + i]) << (8 * b);
+
+                uint32_t& q = values [c * header.bodyCount + i];
+                q = key ? value : (q + ((value >> 1) ^ (0u - (value & 1)))) & mask;
+            }
+
+        memcpy (box, frameHeader.box, sizeof (box));
+        decoded = frame;
+
+        return true;
+    }
+
+    std::ifstream in;
+    TrajectoryHeader header;
+    std::vector<TrajectoryIndexEntry> index;
+    std::vector<unsigned char> compressed;
+    std::vector<unsigned char> planes;
+    std::vector<uint32_t> values;
+    float box [4];
+    size_t decoded;
+};